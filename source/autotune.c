@@ -0,0 +1,213 @@
+/* choice of the smix kernel configuration by measurement, remembered per cpu model.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <unistd.h>
+
+#define autotune_rounds 2
+#define autotune_line_max 512
+#define autotune_kernels_max 8
+// smallest V for which huge pages are tried
+#define autotune_hugepage_min (2 * 1024 * 1024)
+
+/** the model name of the first cpu, or "unknown". the name has no tabs, which separate the fields of the file */
+void autotune_cpu_model (char* model, size_t size) {
+  char line[autotune_line_max];
+  char* a;
+  snprintf(model, size, "unknown");
+  FILE* file = fopen("/proc/cpuinfo", "r");
+  if (!file) { return; }
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "model name", 10)) { continue; }
+    a = strchr(line, ':'); if (!a) { continue; }
+    for (a += 1; (' ' == *a) || ('\t' == *a); a += 1) {}
+    a[strcspn(a, "\n")] = 0;
+    snprintf(model, size, "%s", a);
+    break;
+  }
+  fclose(file);
+  for (a = model; *a; a += 1) { if ('\t' == *a) { *a = ' '; } }
+}
+
+/** use a tuning. returns 1 if it is not possible on this host */
+uint32_t autotune_apply (const struct scrypt_tuning* tuning) {
+  struct crypto_scrypt_tuning a;
+  a.kernel = tuning->kernel;
+  a.interleave = tuning->interleave;
+  a.prefetch = tuning->prefetch;
+  a.hugepages = tuning->hugepages;
+  return(crypto_scrypt_set_tuning(&a) ? 1 : 0);
+}
+
+/** use a tuning, for example one that scrypt_autotune chose on another host with the same cpu model. a null kernel
+  selects the fastest one that works. returns 1 if it is not possible on this host */
+uint32_t scrypt_set_tuning (const struct scrypt_tuning* tuning) {
+  return(autotune_apply(tuning));
+}
+
+/** parse a line "model\tN\tr\tkernel\tinterleave\tprefetch\thugepages\trate" of the tuning file.
+  the kernel name is replaced by that of the library, which stays valid. returns 1 if it does not match */
+uint32_t autotune_parse (char* line, const char* model, uint64_t N, uint32_t r, struct scrypt_tuning* tuning) {
+  const char* kernels[autotune_kernels_max];
+  char kernel[32];
+  unsigned long line_N;
+  unsigned int line_r, interleave, prefetch, hugepages;
+  size_t count;
+  size_t index;
+  char* a = strchr(line, '\t'); if (!a) { return(1); }
+  if (((size_t)(a - line) != strlen(model)) || strncmp(line, model, a - line)) { return(1); }
+  if (7 != sscanf(a, "\t%lu\t%u\t%31s\t%u\t%u\t%u\t%lf", &line_N, &line_r, kernel, &interleave, &prefetch, &hugepages, &tuning->rate)
+    || (line_N != N) || (line_r != r)) { return(1); }
+  count = crypto_scrypt_kernels(kernels, autotune_kernels_max);
+  for (index = 0; (index < count) && (index < autotune_kernels_max); index += 1) {
+    if (!strcmp(kernels[index], kernel)) { break; }
+  }
+  if ((index == count) || (index == autotune_kernels_max)) { return(1); }
+  tuning->kernel = kernels[index];
+  tuning->interleave = interleave;
+  tuning->prefetch = prefetch;
+  tuning->hugepages = hugepages;
+  return(0);
+}
+
+/** find the tuning for model, N and r in the file at path. returns 1 if there is none */
+uint32_t autotune_load (const char* path, const char* model, uint64_t N, uint32_t r, struct scrypt_tuning* tuning) {
+  char line[autotune_line_max];
+  uint32_t status = 1;
+  FILE* file = fopen(path, "r");
+  if (!file) { return(1); }
+  while (status && fgets(line, sizeof(line), file)) { status = autotune_parse(line, model, N, r, tuning); }
+  fclose(file);
+  return(status);
+}
+
+/** replace the tuning for model, N and r in the file at path, keeping those of other cpus and parameters.
+  the file is replaced at once, so that processes starting at the same time read either version */
+uint32_t autotune_save (const char* path, const char* model, uint64_t N, uint32_t r, const struct scrypt_tuning* tuning) {
+  char line[autotune_line_max];
+  char temp_path[4096];
+  struct scrypt_tuning other;
+  FILE* file;
+  if (snprintf(temp_path, sizeof(temp_path), "%s.%d", path, getpid()) >= (int)sizeof(temp_path)) { return(1); }
+  FILE* temp = fopen(temp_path, "w"); if (!temp) { return(1); }
+  file = fopen(path, "r");
+  if (file) {
+    while (fgets(line, sizeof(line), file)) {
+      if (autotune_parse(line, model, N, r, &other)) { fputs(line, temp); }
+    }
+    fclose(file);
+  }
+  fprintf(temp, "%s\t%lu\t%u\t%s\t%u\t%u\t%u\t%.17g\n", model, (unsigned long)N, r, tuning->kernel,
+    tuning->interleave, tuning->prefetch, tuning->hugepages, tuning->rate);
+  if (fclose(temp) || rename(temp_path, path)) {
+    unlink(temp_path);
+    return(1);
+  }
+  return(0);
+}
+
+/** derivations per second with the settings in use. interleave derivations with p 1 run together,
+  the best of autotune_rounds. 0 if they failed */
+double autotune_rate (uint64_t N, uint32_t r, uint32_t interleave) {
+  struct crypto_scrypt_multi_job jobs[CRYPTO_SCRYPT_SMIX_MULTI];
+  uint8_t salt[CRYPTO_SCRYPT_SMIX_MULTI];
+  uint8_t res[CRYPTO_SCRYPT_SMIX_MULTI][32];
+  uint32_t index;
+  uint32_t round;
+  uint64_t start;
+  uint64_t ns;
+  double rate;
+  double best = 0;
+  for (index = 0; index < interleave; index += 1) {
+    salt[index] = index;
+    jobs[index].passwd = (const uint8_t*)"autotune";
+    jobs[index].passwdlen = 8;
+    jobs[index].salt = salt + index;
+    jobs[index].saltlen = 1;
+    jobs[index].p = 1;
+    jobs[index].buf = res[index];
+    jobs[index].buflen = sizeof(res[index]);
+  }
+  for (round = 0; round < autotune_rounds; round += 1) {
+    start = timing_now();
+    if ((interleave > 1) ? crypto_scrypt_multi(jobs, interleave, N, r)
+      : crypto_scrypt(jobs[0].passwd, 8, salt, 1, N, r, 1, res[0], sizeof(res[0]))) { return(0); }
+    ns = timing_now() - start;
+    rate = interleave * 1e9 / (ns ? ns : 1);
+    if (rate > best) { best = rate; }
+  }
+  return(best);
+}
+
+/** use the fastest configuration of the smix kernels for N and r: kernel, derivations mixed together by batches of the
+  worker pool, prefetching for them, and huge pages for V. it is measured, or with force 0 read from the file at path
+  if it has a tuning for the model of the cpu, N and r. a measured tuning is written there. path 0 is the environment
+  variable SCRYPT_AUTOTUNE_FILE, or else nothing is read or written. measuring takes a few seconds for N 16384 and
+  r 8 and should happen before derivations start. tuning may be 0. returns 1 if nothing could be measured or the file
+  could not be written, the measured tuning is used anyway */
+uint32_t scrypt_autotune (uint64_t N, uint32_t r, const char* path, uint8_t force, struct scrypt_tuning* tuning) {
+  static const uint32_t interleaves[] = {1, 2, 4};
+  struct crypto_scrypt_tuning saved;
+  struct crypto_scrypt_tuning a;
+  struct scrypt_tuning best = {0};
+  const char* kernels[autotune_kernels_max];
+  char model[256];
+  size_t kernel_count;
+  size_t kernel;
+  uint32_t index;
+  uint8_t hugepages;
+  uint8_t prefetch;
+  double rate;
+  if (!path) { path = getenv("SCRYPT_AUTOTUNE_FILE"); }
+  autotune_cpu_model(model, sizeof(model));
+  if (!force && path && !autotune_load(path, model, N, r, &best) && !autotune_apply(&best)) {
+    if (tuning) { *tuning = best; }
+    return(0);
+  }
+  crypto_scrypt_get_tuning(&saved);
+  kernel_count = crypto_scrypt_kernels(kernels, autotune_kernels_max);
+  if (kernel_count > autotune_kernels_max) { kernel_count = autotune_kernels_max; }
+  for (kernel = 0; kernel < kernel_count; kernel += 1) {
+    for (hugepages = 0; hugepages < 2; hugepages += 1) {
+      if (hugepages && ((N > SIZE_MAX / 128 / r) || (128 * r * N < autotune_hugepage_min))) { continue; }
+      for (index = 0; index < sizeof(interleaves) / sizeof(*interleaves); index += 1) {
+        for (prefetch = 0; prefetch < 2; prefetch += 1) {
+          // a single derivation does not prefetch
+          if ((1 == interleaves[index]) && prefetch) { continue; }
+          a.kernel = kernels[kernel];
+          a.interleave = interleaves[index];
+          a.prefetch = prefetch;
+          a.hugepages = hugepages;
+          if (crypto_scrypt_set_tuning(&a)) { continue; }
+          if ((a.interleave > 1) && !crypto_scrypt_multi_wanted(N, r)) { continue; }
+          rate = autotune_rate(N, r, a.interleave);
+          if (rate <= best.rate) { continue; }
+          best.kernel = a.kernel;
+          best.interleave = a.interleave;
+          best.prefetch = a.prefetch;
+          best.hugepages = a.hugepages;
+          best.rate = rate;
+        }
+      }
+    }
+  }
+  if (!best.rate || autotune_apply(&best)) {
+    crypto_scrypt_set_tuning(&saved);
+    return(1);
+  }
+  if (tuning) { *tuning = best; }
+  return((path && autotune_save(path, model, N, r, &best)) ? 1 : 0);
+}
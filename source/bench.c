@@ -0,0 +1,167 @@
+/* scrypt-bench: where the time of derivations goes, per phase and with hardware counters.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "scrypt.h"
+
+void display_help () {
+  puts(
+    "scrypt-bench [options ...] [N r p]\n"
+    "options\n"
+    "  -c|--counters  read hardware counters with perf_event_open\n"
+    "  -g|--generic  use the generic smix loops, not those unrolled for r 1, 8 and 16.\n"
+    "                without, they are compared for these r\n"
+    "  -h|--help  display this text and exit\n"
+    "  -i|--iterations n  number of derivations, default 10");
+}
+
+void add_counts (struct scrypt_perf_counts* a, const struct scrypt_perf_counts* b) {
+  a->cycles += b->cycles;
+  a->instructions += b->instructions;
+  a->cache_misses += b->cache_misses;
+  a->dtlb_misses += b->dtlb_misses;
+  a->stalled_cycles += b->stalled_cycles;
+}
+
+/** counters per derivation, and per block of V (128 * r bytes) for the smix loops */
+void display_counts (const char* name, const struct scrypt_perf_counts* a, uint32_t count, uint64_t blocks) {
+  printf("%-8s %14.0f %14.0f %6.2f %12.0f %12.0f %14.0f", name, (double)a->cycles / count, (double)a->instructions / count,
+    a->cycles ? (double)a->instructions / a->cycles : 0.0, (double)a->cache_misses / count, (double)a->dtlb_misses / count,
+    (double)a->stalled_cycles / count);
+  if (blocks) { printf("  %.2f llc %.3f dtlb misses/block", (double)a->cache_misses / count / blocks, (double)a->dtlb_misses / count / blocks); }
+  printf("\n");
+}
+
+/** mean milliseconds of the smix loops and in total of a kernel */
+void display_loops (const char* name, const struct scrypt_timing* a, uint32_t iterations) {
+  printf("%-12s mean ms: loop1 %.3f, loop2 %.3f, total %.3f\n", name, a->loop1_ns / 1e6 / iterations,
+    a->loop2_ns / 1e6 / iterations, a->total_ns / 1e6 / iterations);
+}
+
+/** sum the timings of iterations derivations. returns 1 if one failed */
+uint32_t run (uint64_t N, uint32_t r, uint32_t p, uint32_t iterations, struct scrypt_timing* sum, uint32_t* counted) {
+  struct scrypt_timing timing;
+  uint8_t res[64];
+  uint32_t index;
+  for (index = 0; index < iterations; index += 1) {
+    memset(&timing, 0, sizeof(timing));
+    if (scrypt_timed((const uint8_t*)"password", 8, (const uint8_t*)"salt", 4, N, r, p, res, sizeof(res), &timing)) { return(1); }
+    sum->alloc_ns += timing.alloc_ns;
+    sum->pbkdf2_in_ns += timing.pbkdf2_in_ns;
+    sum->loop1_ns += timing.loop1_ns;
+    sum->loop2_ns += timing.loop2_ns;
+    sum->pbkdf2_out_ns += timing.pbkdf2_out_ns;
+    sum->free_ns += timing.free_ns;
+    sum->total_ns += timing.total_ns;
+    sum->kernel = timing.kernel;
+    sum->v_allocation = timing.v_allocation;
+    if (timing.perf) {
+      add_counts(&sum->loop1_perf, &timing.loop1_perf);
+      add_counts(&sum->loop2_perf, &timing.loop2_perf);
+      add_counts(&sum->pbkdf2_perf, &timing.pbkdf2_perf);
+      *counted += 1;
+    }
+  }
+  return(0);
+}
+
+int main (int argc, char** argv) {
+  struct scrypt_config config = {0};
+  uint32_t iterations = 10;
+  uint64_t N = 16384;
+  uint32_t r = 8;
+  uint32_t p = 1;
+  int opt;
+  struct option longopts[5] = {
+    {"counters", no_argument, 0, 'c'},
+    {"generic", no_argument, 0, 'g'},
+    {"help", no_argument, 0, 'h'},
+    {"iterations", required_argument, 0, 'i'},
+    {0, 0, 0, 0}
+  };
+  while ((opt = getopt_long(argc, argv, "cghi:", longopts, 0)) != -1) {
+    switch (opt) {
+    case 'c': config.perf_counters = 1; break;
+    case 'g': config.generic_smix = 1; break;
+    case 'i': iterations = atoi(optarg); break;
+    case 'h':
+    default:
+      display_help();
+      return(0);
+    }
+  }
+  if (optind < argc) { N = atol(argv[optind]); optind += 1; }
+  if (optind < argc) { r = atoi(argv[optind]); optind += 1; }
+  if (optind < argc) { p = atoi(argv[optind]); optind += 1; }
+  if (!iterations) { iterations = 1; }
+
+  if (scrypt_init(&config)) {
+    puts("initialisation failed");
+    return(1);
+  }
+  struct scrypt_timing sum = {0};
+  uint32_t counted = 0;
+  if (run(N, r, p, iterations, &sum, &counted)) {
+    puts("derivation failed");
+    return(1);
+  }
+
+  printf("N %lu, r %u, p %u, %u derivations, kernel %s, V from %s\n", (unsigned long)N, r, p, iterations, sum.kernel, sum.v_allocation);
+  printf("mean ms: alloc %.3f, pbkdf2 %.3f, loop1 %.3f, loop2 %.3f, pbkdf2 %.3f, free %.3f, total %.3f\n",
+    sum.alloc_ns / 1e6 / iterations, sum.pbkdf2_in_ns / 1e6 / iterations, sum.loop1_ns / 1e6 / iterations,
+    sum.loop2_ns / 1e6 / iterations, sum.pbkdf2_out_ns / 1e6 / iterations, sum.free_ns / 1e6 / iterations,
+    sum.total_ns / 1e6 / iterations);
+  if (config.perf_counters) {
+    if (!counted) {
+      puts("hardware counters not available, see /proc/sys/kernel/perf_event_paranoid");
+    }
+    else {
+      printf("mean     %14s %14s %6s %12s %12s %14s\n", "cycles", "instructions", "ipc", "llc misses", "dtlb misses", "stalled cycles");
+      display_counts("loop1", &sum.loop1_perf, counted, N * p);
+      display_counts("loop2", &sum.loop2_perf, counted, N * p);
+      display_counts("pbkdf2", &sum.pbkdf2_perf, counted, 0);
+    }
+  }
+  scrypt_deinit();
+  if (config.generic_smix || ((1 != r) && (8 != r) && (16 != r))) { return(0); }
+
+  // the generic kernel, once with its loops unrolled for r and once without. the selected kernel may be another
+  struct scrypt_timing unrolled = {0};
+  struct scrypt_timing generic = {0};
+  struct scrypt_tuning tuning = {"generic", 1, 0, 0, 0};
+  config.perf_counters = 0;
+  if (scrypt_set_tuning(&tuning) || scrypt_init(&config) || run(N, r, p, iterations, &unrolled, &counted)) {
+    puts("derivation failed");
+    return(1);
+  }
+  scrypt_deinit();
+  config.generic_smix = 1;
+  if (scrypt_init(&config) || run(N, r, p, iterations, &generic, &counted)) {
+    puts("derivation failed");
+    return(1);
+  }
+  scrypt_deinit();
+  display_loops(unrolled.kernel, &unrolled, iterations);
+  display_loops(generic.kernel, &generic, iterations);
+  printf("%s takes %.1f%% less time than %s\n", unrolled.kernel,
+    generic.total_ns ? 100.0 * ((double)generic.total_ns - (double)unrolled.total_ns) / generic.total_ns : 0.0, generic.kernel);
+  return(0);
+}
@@ -35,49 +35,200 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cpusupport.h"
+#include "pickparams/memlimit.h"
 #include "sha256.c"
 #include "warnp.c"
 
 #include "crypto_scrypt_smix.c"
 #include "crypto_scrypt_smix_sse2.c"
+#include "crypto_scrypt_vpool.c"
+#include "crypto_scrypt_shm.c"
+#include "crypto_scrypt_vfile.c"
+#include "crypto_scrypt_perf.c"
+#include "crypto_scrypt_probes.h"
 
 #include "crypto_scrypt.h"
 
-static void (*smix_func)(uint8_t *, size_t, uint64_t, void *, void *) = NULL;
+static void (*smix_func)(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *) = NULL;
+static int (*slice_func)(uint8_t *, size_t, uint64_t, void *, void *,
+    uint64_t *, uint64_t) = NULL;
+static void (*multi_func)(uint8_t **, size_t, size_t, uint64_t, void **,
+    void **, int) = NULL;
+static const char * smix_name = NULL;
+
+/*
+ * Settings of crypto_scrypt_set_tuning besides the kernel.  The multi-buffer
+ * smix is off until a tuning measured it to be faster on this CPU.
+ */
+static const char * smix_want = NULL;
+static size_t multi_width = 1;
+static int multi_prefetch = 1;
+static int vhugepages = 0;
+
+/* Use the generic kernel for every r, see crypto_scrypt_set_generic. */
+static int smix_generic = 0;
+
+/* The kernels unrolled for some r failed their test, see usekernel. */
+static int fixed_broken = 0;
+
+/* How the V region of a computation was obtained. */
+#define VALLOC_HEAP	0	/* posix_memalign or malloc. */
+#define VALLOC_MMAP	1	/* Fresh anonymous mapping. */
+#define VALLOC_POOL	2	/* Pre-faulted region from crypto_scrypt_vpool. */
+#define VALLOC_ARENA	3	/* Arena of the calling thread. */
+#define VALLOC_SHM	4	/* Slab leased from the host-wide segment. */
+
+/* Names of the VALLOC_* values for crypto_scrypt_timing. */
+static const char * valloc_names[] = { "heap", "mmap", "pool", "arena", "shm" };
+
+struct vregion {
+	void * base;	/* What to free. */
+	void * V;	/* 64-byte aligned start of V. */
+	size_t len;
+	int how;
+	int lease;	/* Host-wide lease, or CRYPTO_SCRYPT_SHM_NONE. */
+};
+
+/* Arena of the calling thread, see crypto_scrypt_set_arena. */
+static __thread void * arena_V = NULL;
+static __thread size_t arena_len = 0;
+static __thread int arena_inuse = 0;
 
 /**
- * _crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, smix):
- * Perform the requested scrypt computation, using ${smix} as the smix routine.
+ * v_alloc(v, len, usearena):
+ * Obtain a 64-byte aligned region of ${len} bytes to be used as V, preferring
+ * the arena of the calling thread if ${usearena} is nonzero, then a pre-faulted region from the V
+ * pool, and then a slab shared by all processes on the host.  Memory mapped
+ * otherwise counts against the host-wide budget if there is one.
  */
 static int
-_crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
-    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
-    uint8_t * buf, size_t buflen,
-    void (*smix)(uint8_t *, size_t, uint64_t, void *, void *))
+v_alloc(struct vregion * v, size_t len, int usearena)
+{
+
+	v->len = len;
+	v->lease = CRYPTO_SCRYPT_SHM_NONE;
+
+	/* Use the thread's own arena if it is large enough. */
+	if (usearena && (arena_V != NULL) && !arena_inuse &&
+	    (len <= arena_len)) {
+		arena_inuse = 1;
+		v->base = v->V = arena_V;
+		v->how = VALLOC_ARENA;
+		return (0);
+	}
+
+	/* Borrow a region from the pool if possible. */
+	if ((v->base = crypto_scrypt_vpool_get(len)) != NULL) {
+		v->V = v->base;
+		v->how = VALLOC_POOL;
+		return (0);
+	}
+
+	/* Lease a shared slab, or wait for budget to map V ourselves. */
+	if ((v->lease = crypto_scrypt_shm_lease(len, &v->base)) == -1)
+		return (-1);
+	if ((v->lease >= 0) && (v->base != NULL)) {
+		v->V = v->base;
+		v->how = VALLOC_SHM;
+		return (0);
+	}
+
+#if defined(MAP_ANON) && defined(HAVE_MMAP)
+	if ((v->base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+#ifdef MAP_NOCORE
+	    MAP_ANON | MAP_PRIVATE | MAP_NOCORE,
+#else
+	    MAP_ANON | MAP_PRIVATE,
+#endif
+	    -1, 0)) == MAP_FAILED)
+		goto err0;
+	v->V = v->base;
+	v->how = VALLOC_MMAP;
+#ifdef MADV_HUGEPAGE
+	/* Fewer TLB misses for the random reads of the second loop. */
+	if (vhugepages)
+		(void)madvise(v->base, len, MADV_HUGEPAGE);
+#endif
+#elif defined(HAVE_POSIX_MEMALIGN)
+	if ((errno = posix_memalign(&v->base, 64, len)) != 0)
+		goto err0;
+	v->V = v->base;
+	v->how = VALLOC_HEAP;
+#else
+	if ((v->base = malloc(len + 63)) == NULL)
+		goto err0;
+	v->V = (void *)(((uintptr_t)(v->base) + 63) & ~ (uintptr_t)(63));
+	v->how = VALLOC_HEAP;
+#endif
+
+	/* Success! */
+	return (0);
+
+err0:
+	crypto_scrypt_shm_release(v->lease);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * v_free(v):
+ * Release the region ${v} obtained from v_alloc.
+ */
+static int
+v_free(struct vregion * v)
+{
+
+	switch (v->how) {
+	case VALLOC_ARENA:
+		arena_inuse = 0;
+		break;
+	case VALLOC_POOL:
+		crypto_scrypt_vpool_put(v->base);
+		break;
+	case VALLOC_SHM:
+		break;
+#if defined(MAP_ANON) && defined(HAVE_MMAP)
+	case VALLOC_MMAP:
+		if (munmap(v->base, v->len))
+			return (-1);
+		break;
+#endif
+	default:
+		free(v->base);
+	}
+	crypto_scrypt_shm_release(v->lease);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * checkparams(N, r, p, buflen):
+ * Return 0 if a derivation with these parameters can be attempted; or set
+ * errno and return -1.
+ */
+static int
+checkparams(uint64_t N, size_t r, size_t p, size_t buflen)
 {
-	void * B0, * V0, * XY0;
-	uint8_t * B;
-	uint32_t * V;
-	uint32_t * XY;
-	size_t r = _r, p = _p;
-	uint32_t i;
 
-	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
 	if (buflen > (((uint64_t)(1) << 32) - 1) * 32) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
 #endif
 	if ((uint64_t)(r) * (uint64_t)(p) >= (1 << 30)) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
 	if (((N & (N - 1)) != 0) || (N < 2)) {
 		errno = EINVAL;
-		goto err0;
+		return (-1);
 	}
 	if ((r > SIZE_MAX / 128 / p) ||
 #if SIZE_MAX / 256 <= UINT32_MAX
@@ -85,76 +236,481 @@ _crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 	    (N > SIZE_MAX / 128 / r)) {
 		errno = ENOMEM;
-		goto err0;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Both PBKDF2 computations of a derivation whose lanes B_i are produced and
+ * absorbed one at a time, so that only one lane is held in memory.
+ */
+struct pbkdf2_stream {
+	HMAC_SHA256_CTX PS;	/* HMAC state after P and S, for step 1. */
+	HMAC_SHA256_CTX * out;	/* HMAC state of each output block of step 5. */
+	size_t nout;
+};
+
+/**
+ * stream_init(s, passwd, passwdlen, salt, saltlen, buflen):
+ * Prepare ${s} for a derivation with a result of ${buflen} bytes.
+ */
+static int
+stream_init(struct pbkdf2_stream * s, const uint8_t * passwd,
+    size_t passwdlen, const uint8_t * salt, size_t saltlen, size_t buflen)
+{
+	size_t i;
+
+	HMAC_SHA256_Init(&s->PS, passwd, passwdlen);
+	s->nout = (buflen + 31) / 32;
+	if ((s->out = malloc(s->nout * sizeof(HMAC_SHA256_CTX))) == NULL)
+		return (-1);
+	for (i = 0; i < s->nout; i++)
+		memcpy(&s->out[i], &s->PS, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&s->PS, salt, saltlen);
+
+	return (0);
+}
+
+/**
+ * stream_free(s):
+ * Clean and free ${s}.
+ */
+static void
+stream_free(struct pbkdf2_stream * s)
+{
+
+	insecure_memzero(&s->PS, sizeof(HMAC_SHA256_CTX));
+	insecure_memzero(s->out, s->nout * sizeof(HMAC_SHA256_CTX));
+	free(s->out);
+}
+
+/**
+ * stream_lane(s, i, Bi, len):
+ * Write the ${len} bytes of B_i from step 1 into ${Bi}; ${len} is a multiple
+ * of 32.
+ */
+static void
+stream_lane(struct pbkdf2_stream * s, uint32_t i, uint8_t * Bi, size_t len)
+{
+	HMAC_SHA256_CTX hctx;
+	uint8_t ivec[4];
+	size_t j;
+
+	/* B_i consists of the output blocks i * len / 32 + 1 onwards. */
+	for (j = 0; j < len / 32; j++) {
+		be32enc(ivec, (uint32_t)(i * (len / 32) + j + 1));
+		memcpy(&hctx, &s->PS, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, ivec, 4);
+		HMAC_SHA256_Final(&Bi[j * 32], &hctx);
+	}
+}
+
+/**
+ * stream_absorb(s, Bi, len):
+ * Feed the mixed lane ${Bi} to step 5; lanes must be absorbed in order.
+ */
+static void
+stream_absorb(struct pbkdf2_stream * s, const uint8_t * Bi, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < s->nout; i++)
+		HMAC_SHA256_Update(&s->out[i], Bi, len);
+}
+
+/**
+ * stream_final(s, buf, buflen):
+ * Finish step 5, write the result into ${buf} and free ${s}.
+ */
+static void
+stream_final(struct pbkdf2_stream * s, uint8_t * buf, size_t buflen)
+{
+	uint8_t ivec[4];
+	uint8_t T[32];
+	size_t i, clen;
+
+	for (i = 0; i < s->nout; i++) {
+		be32enc(ivec, (uint32_t)(i + 1));
+		HMAC_SHA256_Update(&s->out[i], ivec, 4);
+		HMAC_SHA256_Final(T, &s->out[i]);
+		clen = buflen - i * 32;
+		if (clen > 32)
+			clen = 32;
+		memcpy(&buf[i * 32], T, clen);
+	}
+	stream_free(s);
+	insecure_memzero(T, 32);
+}
+
+/* Called with the timings of every derivation; see crypto_scrypt_set_timing. */
+static void (*timing_hook)(const struct crypto_scrypt_timing *) = NULL;
+
+/* Called around every derivation; see crypto_scrypt_set_observer. */
+static void (*observer_begin)(void) = NULL;
+static void (*observer_end)(uint64_t, uint32_t, uint32_t,
+    const struct crypto_scrypt_timing *, int) = NULL;
+
+/**
+ * timing_now(void):
+ * Return CLOCK_MONOTONIC in nanoseconds.
+ */
+static uint64_t
+timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/* A point in time, and the hardware counters then. */
+struct timing_mark {
+	uint64_t ns;
+	struct crypto_scrypt_perf_counts pc;
+};
+
+/**
+ * timing_read(t, m):
+ * Record the current time in ${m}, and the counters if ${t}->perf is set.
+ * Do nothing if ${t} is NULL.
+ */
+static void
+timing_read(const struct crypto_scrypt_timing * t, struct timing_mark * m)
+{
+
+	if (t == NULL)
+		return;
+	m->ns = timing_now();
+	if (t->perf)
+		crypto_scrypt_perf_read(&m->pc);
+}
+
+/**
+ * timing_pbkdf2(t, m, out):
+ * Account the PBKDF2 work since ${m} to step 5 if ${out} is nonzero, or to
+ * step 1 otherwise.  Do nothing if ${t} is NULL.
+ */
+static void
+timing_pbkdf2(struct crypto_scrypt_timing * t, const struct timing_mark * m,
+    int out)
+{
+	struct timing_mark now;
+
+	if (t == NULL)
+		return;
+	timing_read(t, &now);
+	if (out)
+		t->pbkdf2_out += now.ns - m->ns;
+	else
+		t->pbkdf2_in += now.ns - m->ns;
+	if (t->perf)
+		crypto_scrypt_perf_add(&t->perf_pbkdf2, &m->pc, &now.pc);
+}
+
+/* Timing of the smix loops, chained in front of the hooks of V storage. */
+struct timing_ctl {
+	struct crypto_scrypt_timing * t;
+	size_t lane;
+	struct timing_mark start;	/* Start of the current loop. */
+	struct crypto_scrypt_smix_ctl next;
+};
+
+/**
+ * timing_phase(ctl, phase):
+ * Account the loop which just ended to ${ctl}->cookie, then pass ${phase} on.
+ */
+static void
+timing_phase(struct crypto_scrypt_smix_ctl * ctl, int phase)
+{
+	struct timing_ctl * tc = ctl->cookie;
+	struct crypto_scrypt_timing * t = tc->t;
+	struct timing_mark now;
+	uint64_t d;
+	size_t slot = 0;
+
+	/* Not timing_read, as ${t} is never NULL here. */
+	now.ns = timing_now();
+	if (t->perf)
+		crypto_scrypt_perf_read(&now.pc);
+	d = now.ns - tc->start.ns;
+	if (phase == CRYPTO_SCRYPT_SMIX_LOOP2) {
+		t->loop1 += d;
+		if (t->perf)
+			crypto_scrypt_perf_add(&t->perf_loop1, &tc->start.pc,
+			    &now.pc);
+	} else if (phase == CRYPTO_SCRYPT_SMIX_DONE) {
+		t->loop2 += d;
+		if (t->perf)
+			crypto_scrypt_perf_add(&t->perf_loop2, &tc->start.pc,
+			    &now.pc);
+		slot = 1;
 	}
+	if ((phase != CRYPTO_SCRYPT_SMIX_LOOP1) && (t->lanes != NULL) &&
+	    (tc->lane < t->nlanes))
+		t->lanes[2 * tc->lane + slot] = d;
+
+	CRYPTO_SCRYPT_SMIX_PHASE(&tc->next, phase);
+	tc->start = now;
+}
+
+/**
+ * fixedsmix(smix, r):
+ * Replace the generic kernel in ${smix} by the one unrolled for ${r}, if
+ * there is one, it works and crypto_scrypt_set_generic allows it.
+ */
+static void
+fixedsmix(void (**smix)(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *), size_t r)
+{
+
+#ifdef CRYPTO_SCRYPT_SMIX_FIXED
+	if ((*smix != crypto_scrypt_smix) || smix_generic || fixed_broken)
+		return;
+	if (r == 1)
+		*smix = crypto_scrypt_smix_1;
+	else if (r == 8)
+		*smix = crypto_scrypt_smix_8;
+	else if (r == 16)
+		*smix = crypto_scrypt_smix_16;
+#else
+	(void)smix;
+	(void)r;
+#endif
+}
+
+/**
+ * smixname(smix):
+ * Return the name of the kernel ${smix}, which fixedsmix may have replaced
+ * by one unrolled for its r.
+ */
+static const char *
+smixname(void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *))
+{
+
+#ifdef CRYPTO_SCRYPT_SMIX_FIXED
+	if (smix == crypto_scrypt_smix_1)
+		return ("generic-r1");
+	if (smix == crypto_scrypt_smix_8)
+		return ("generic-r8");
+	if (smix == crypto_scrypt_smix_16)
+		return ("generic-r16");
+#else
+	(void)smix;
+#endif
+	return (smix_name);
+}
+
+/* B larger than this many bytes is streamed; 0 selects BLIMIT_DEFAULT. */
+#define BLIMIT_DEFAULT	(16 * 1024 * 1024)
+static size_t blimit = 0;
+
+/**
+ * _crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, smix,
+ *     k, cancel, deadline, timing):
+ * Perform the requested scrypt computation, using ${smix} as the smix routine.
+ * If ${k} is greater than 1, store only every k-th V_i and use the generic
+ * time-memory trade-off smix instead.  If crypto_scrypt_vfile_wanted says so,
+ * keep V in a temporary file.  If B is larger than crypto_scrypt_set_blimit
+ * allows, produce and absorb the lanes one at a time.  Give up as described
+ * for crypto_scrypt_cancel.  If ${timing} is not NULL, record where the time
+ * went, with the hardware counters if crypto_scrypt_perf_enable says so.
+ */
+static int
+_crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
+    uint8_t * buf, size_t buflen,
+    void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+	struct crypto_scrypt_smix_ctl *), uint64_t k,
+    const volatile int * cancel, uint64_t deadline,
+    struct crypto_scrypt_timing * timing)
+{
+	struct crypto_scrypt_smix_ctl ctl0 = { NULL };
+	struct crypto_scrypt_smix_ctl * ctl = &ctl0;
+	struct timing_ctl tc;
+	struct timing_mark tm;
+	uint64_t t0 = 0, t1 = 0;
+	void * B0, * XY0;
+	struct vregion V0;
+	struct crypto_scrypt_vfile vf;
+	struct pbkdf2_stream ps;
+	int usefile, stream;
+	const char * vhow;
+	uint8_t * B, * Bi;
+	uint32_t * V;
+	uint32_t * XY;
+	size_t r = _r, p = _p;
+	uint32_t i;
+
+	/* Sanity-check parameters. */
+	if (checkparams(N, r, p, buflen))
+		goto err0;
+
+	/* Hold all of B, or one lane when streaming. */
+	stream = (p > 1) &&
+	    (128 * r * p > ((blimit > 0) ? blimit : BLIMIT_DEFAULT));
+	if (stream && stream_init(&ps, passwd, passwdlen, salt, saltlen, buflen))
+		goto err0;
 
 	/* Allocate memory. */
+	if (timing != NULL)
+		t0 = timing_now();
 #ifdef HAVE_POSIX_MEMALIGN
-	if ((errno = posix_memalign(&B0, 64, 128 * r * p)) != 0)
-		goto err0;
+	if ((errno = posix_memalign(&B0, 64, 128 * r * (stream ? 1 : p))) != 0)
+		goto err0s;
 	B = (uint8_t *)(B0);
-	if ((errno = posix_memalign(&XY0, 64, 256 * r + 64)) != 0)
+	if ((errno = posix_memalign(&XY0, 64,
+	    ((k > 1) ? 512 : 256) * r + 64)) != 0)
 		goto err1;
 	XY = (uint32_t *)(XY0);
-#if !defined(MAP_ANON) || !defined(HAVE_MMAP)
-	if ((errno = posix_memalign(&V0, 64, (size_t)(128 * r * N))) != 0)
-		goto err2;
-	V = (uint32_t *)(V0);
-#endif
 #else
-	if ((B0 = malloc(128 * r * p + 63)) == NULL)
-		goto err0;
+	if ((B0 = malloc(128 * r * (stream ? 1 : p) + 63)) == NULL)
+		goto err0s;
 	B = (uint8_t *)(((uintptr_t)(B0) + 63) & ~ (uintptr_t)(63));
-	if ((XY0 = malloc(256 * r + 64 + 63)) == NULL)
+	if ((XY0 = malloc(((k > 1) ? 512 : 256) * r + 64 + 63)) == NULL)
 		goto err1;
 	XY = (uint32_t *)(((uintptr_t)(XY0) + 63) & ~ (uintptr_t)(63));
-#if !defined(MAP_ANON) || !defined(HAVE_MMAP)
-	if ((V0 = malloc(128 * r * N + 63)) == NULL)
-		goto err2;
-	V = (uint32_t *)(((uintptr_t)(V0) + 63) & ~ (uintptr_t)(63));
-#endif
-#endif
-#if defined(MAP_ANON) && defined(HAVE_MMAP)
-	if ((V0 = mmap(NULL, 128 * r * N, PROT_READ | PROT_WRITE,
-#ifdef MAP_NOCORE
-	    MAP_ANON | MAP_PRIVATE | MAP_NOCORE,
-#else
-	    MAP_ANON | MAP_PRIVATE,
-#endif
-	    -1, 0)) == MAP_FAILED)
-		goto err2;
-	V = (uint32_t *)(V0);
 #endif
+	usefile = (k == 1) && crypto_scrypt_vfile_wanted(128 * r * N);
+	if (usefile) {
+		if (crypto_scrypt_vfile_open(&vf, 128 * r * N, 128 * r))
+			goto err2;
+		V = (uint32_t *)(vf.V);
+		ctl->phase = vf.ctl.phase;
+		ctl->cookie = vf.ctl.cookie;
+	} else {
+		if (v_alloc(&V0, 128 * r * (N / k), 1))
+			goto err2;
+		V = (uint32_t *)(V0.V);
+	}
+	vhow = usefile ? ((V == NULL) ? "file-direct" : "file") :
+	    valloc_names[V0.how];
+	CRYPTO_SCRYPT_PROBE2(v_alloc, 128 * r * (N / k), vhow);
+
+	ctl->cancel = cancel;
+	ctl->deadline = deadline;
+
+	if (timing != NULL) {
+		t1 = timing_now();
+		timing->alloc = t1 - t0;
+		timing->pbkdf2_in = timing->pbkdf2_out = 0;
+		timing->loop1 = timing->loop2 = 0;
+		memset(&timing->perf_loop1, 0, sizeof(timing->perf_loop1));
+		memset(&timing->perf_loop2, 0, sizeof(timing->perf_loop2));
+		memset(&timing->perf_pbkdf2, 0, sizeof(timing->perf_pbkdf2));
+		timing->perf = crypto_scrypt_perf_enabled() &&
+		    (crypto_scrypt_perf_read(&tc.start.pc) == 0);
+		timing->vlen = 128 * r * (N / k);
+		timing->kernel = (k > 1) ? "tmto" :
+		    (usefile && (V == NULL)) ? "io" : smixname(smix);
+		timing->valloc = vhow;
+
+		/* Put the loop timing in front of the hooks of V. */
+		tc.t = timing;
+		tc.lane = 0;
+		tc.start.ns = t1;
+		tc.next = *ctl;
+		ctl->phase = timing_phase;
+		ctl->cookie = &tc;
+	}
 
 	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
-	PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B, p * 128 * r);
+	if (!stream) {
+		timing_read(timing, &tm);
+		PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B,
+		    p * 128 * r);
+		timing_pbkdf2(timing, &tm, 0);
+	}
 
 	/* 2: for i = 0 to p - 1 do */
 	for (i = 0; i < p; i++) {
+		/* Give up between lanes too. */
+		if (crypto_scrypt_smix_stop(ctl))
+			goto stopped;
+
+		if (stream) {
+			Bi = B;
+			timing_read(timing, &tm);
+			stream_lane(&ps, i, Bi, 128 * r);
+			timing_pbkdf2(timing, &tm, 0);
+		} else {
+			Bi = &B[i * 128 * r];
+		}
+		if (timing != NULL)
+			tc.lane = i;
+
 		/* 3: B_i <-- MF(B_i, N) */
-		(smix)(&B[i * 128 * r], r, N, V, XY);
+		if (k > 1) {
+			crypto_scrypt_smix_tmto(Bi, r, N, V, XY, ctl, k);
+		} else if (usefile && (V == NULL)) {
+			/* Direct I/O: V is not addressable. */
+			if (crypto_scrypt_smix_io(Bi, r, N, XY, &vf.vio, ctl)) {
+				if (ctl->stopped)
+					goto stopped;
+				errno = EIO;
+				goto err3;
+			}
+		} else {
+			(smix)(Bi, r, N, V, XY, ctl);
+		}
+		if (ctl->stopped)
+			goto stopped;
+
+		if (stream) {
+			timing_read(timing, &tm);
+			stream_absorb(&ps, Bi, 128 * r);
+			timing_pbkdf2(timing, &tm, 1);
+		}
 	}
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
-	PBKDF2_SHA256(passwd, passwdlen, B, p * 128 * r, 1, buf, buflen);
+	timing_read(timing, &tm);
+	if (stream) {
+		/* This frees ${ps}, which the error path must not again. */
+		stream_final(&ps, buf, buflen);
+		stream = 0;
+	} else {
+		PBKDF2_SHA256(passwd, passwdlen, B, p * 128 * r, 1, buf,
+		    buflen);
+	}
+	if (timing != NULL) {
+		timing_pbkdf2(timing, &tm, 1);
+		t1 = timing_now();
+	}
 
 	/* Free memory. */
-#if defined(MAP_ANON) && defined(HAVE_MMAP)
-	if (munmap(V0, 128 * r * N))
+	if (usefile)
+		crypto_scrypt_vfile_close(&vf);
+	else if (v_free(&V0))
 		goto err2;
-#else
-	free(V0);
-#endif
+	CRYPTO_SCRYPT_PROBE2(v_free, 128 * r * (N / k), vhow);
 	free(XY0);
 	free(B0);
+	if (timing != NULL) {
+		timing->free = timing_now() - t1;
+		timing->total = timing_now() - t0;
+	}
 
 	/* Success! */
 	return (0);
 
+stopped:
+	errno = ctl->stopped;
+err3:
+	if (usefile)
+		crypto_scrypt_vfile_close(&vf);
+	else
+		v_free(&V0);
+	CRYPTO_SCRYPT_PROBE2(v_free, 128 * r * (N / k), vhow);
 err2:
 	free(XY0);
 err1:
 	free(B0);
+err0s:
+	if (stream)
+		stream_free(&ps);
 err0:
 	/* Failure! */
 	return (-1);
@@ -187,7 +743,8 @@ static struct scrypt_test {
 };
 
 static int
-testsmix(void (*smix)(uint8_t *, size_t, uint64_t, void *, void *))
+testsmix(void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *))
 {
 	uint8_t hbuf[TESTLEN];
 
@@ -195,43 +752,926 @@ testsmix(void (*smix)(uint8_t *, size_t, uint64_t, void *, void *))
 	if (_crypto_scrypt(
 	    (const uint8_t *)testcase.passwd, strlen(testcase.passwd),
 	    (const uint8_t *)testcase.salt, strlen(testcase.salt),
-	    testcase.N, testcase.r, testcase.p, hbuf, TESTLEN, smix))
+	    testcase.N, testcase.r, testcase.p, hbuf, TESTLEN, smix, 1, NULL, 0,
+	    NULL))
 		return (-1);
 
 	/* Does it match? */
 	return (memcmp(testcase.result, hbuf, TESTLEN));
 }
 
-static void
-selectsmix(void)
+#ifdef CPUSUPPORT_X86_SSE2
+static int
+sse2_supported(void)
 {
 
+	return (cpusupport_x86_sse2());
+}
+#endif
+
+/* The smix kernels, fastest first. */
+static const struct smix_kernel {
+	const char * name;
+	int (*supported)(void);
+	void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+	    struct crypto_scrypt_smix_ctl *);
+	int (*slice)(uint8_t *, size_t, uint64_t, void *, void *,
+	    uint64_t *, uint64_t);
+	void (*multi)(uint8_t **, size_t, size_t, uint64_t, void **,
+	    void **, int);
+} smix_kernels[] = {
 #ifdef CPUSUPPORT_X86_SSE2
-	/* If we're running on an SSE2-capable CPU, try that code. */
-	if (cpusupport_x86_sse2()) {
-		/* If SSE2ized smix works, use it. */
-		if (!testsmix(crypto_scrypt_smix_sse2)) {
-			smix_func = crypto_scrypt_smix_sse2;
-			return;
-		}
-		warn0("Disabling broken SSE2 scrypt support - please report bug!");
-	}
+	{ "sse2", sse2_supported, crypto_scrypt_smix_sse2,
+	    crypto_scrypt_smix_slice_sse2, crypto_scrypt_smix_multi_sse2 },
 #endif
+	{ "generic", NULL, crypto_scrypt_smix, crypto_scrypt_smix_slice,
+	    crypto_scrypt_smix_multi }
+};
+#define NKERNELS (sizeof(smix_kernels) / sizeof(smix_kernels[0]))
 
-	/* If generic smix works, use it. */
-	if (!testsmix(crypto_scrypt_smix)) {
-		smix_func = crypto_scrypt_smix;
-		return;
-	}
-	warn0("Generic scrypt code is broken - please report bug!");
+/**
+ * usekernel(k):
+ * Use the kernel ${k} if this CPU supports it and it computes the test
+ * vector correctly.  Return 0 on success; or -1 otherwise.
+ */
+static int
+usekernel(const struct smix_kernel * k)
+{
 
-	/* If we get here, something really bad happened. */
-	abort();
+	if ((k->supported != NULL) && !(k->supported)())
+		return (-1);
+	if (testsmix(k->smix)) {
+		warn0("Disabling broken %s scrypt support - please report bug!",
+		    k->name);
+		return (-1);
+	}
+#ifdef CRYPTO_SCRYPT_SMIX_FIXED
+	/* The test vector has r = 8; the other r share its template. */
+	fixed_broken = (k->smix == crypto_scrypt_smix) &&
+	    testsmix(crypto_scrypt_smix_8);
+	if (fixed_broken)
+		warn0("Disabling broken unrolled scrypt support - please report bug!");
+#endif
+	smix_func = k->smix;
+	slice_func = k->slice;
+	multi_func = k->multi;
+	smix_name = k->name;
+	CRYPTO_SCRYPT_PROBE1(kernel, smix_name);
+	return (0);
 }
 
-/**
- * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
- * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
+static void
+selectsmix(void)
+{
+	size_t i;
+
+	/* The kernel chosen by crypto_scrypt_set_tuning, if it still works. */
+	for (i = 0; (smix_want != NULL) && (i < NKERNELS); i++) {
+		if (!strcmp(smix_kernels[i].name, smix_want) &&
+		    !usekernel(&smix_kernels[i]))
+			return;
+	}
+
+	/* Otherwise the fastest kernel which works. */
+	for (i = 0; i < NKERNELS; i++) {
+		if (!usekernel(&smix_kernels[i]))
+			return;
+	}
+
+	/* If we get here, something really bad happened. */
+	abort();
+}
+
+/* Most memory V may use; 0 until determined by getvlimit. */
+static size_t vlimit = 0;
+
+/**
+ * getvlimit(void):
+ * Return the largest V which crypto_scrypt stores in full: the limit set
+ * by crypto_scrypt_set_vlimit, or else the memory memtouse allows us.
+ */
+static size_t
+getvlimit(void)
+{
+	size_t memlimit;
+
+	if ((vlimit == 0) && (memtouse(0, 0.5, &memlimit) == 0))
+		vlimit = memlimit;
+
+	return ((vlimit == 0) ? SIZE_MAX : vlimit);
+}
+
+/**
+ * vstride(N, r):
+ * Return k such that storing only every k-th V_i lets V fit into the memory
+ * we may use: slower, but better than failing.  Oversized r and N are left
+ * to _crypto_scrypt to reject, and V which goes into a file is always stored
+ * in full.
+ */
+static uint64_t
+vstride(uint64_t N, uint32_t r)
+{
+	uint64_t k = 1;
+
+	if ((r > 0) && (N <= SIZE_MAX / 128 / r) &&
+	    !crypto_scrypt_vfile_wanted(128 * (size_t)(r) * N)) {
+		while ((k < N) && (128 * (size_t)(r) * (N / k) > getvlimit()))
+			k <<= 1;
+	}
+
+	return (k);
+}
+
+/**
+ * crypto_scrypt_set_vlimit(len):
+ * Store only part of V and recompute the rest on demand if V would be larger
+ * than ${len} bytes.  The value 0 selects the memory which memtouse allows.
+ */
+void
+crypto_scrypt_set_vlimit(size_t len)
+{
+
+	vlimit = len;
+}
+
+/* A derivation performed in slices, see crypto_scrypt_state_new. */
+struct crypto_scrypt_state {
+	uint8_t * passwd;	/* Copy of the password for step 5. */
+	size_t passwdlen;
+	void * B0, * XY0;
+	uint8_t * B;
+	void * XY;
+	struct vregion V0;
+	int vheld;		/* V0 is allocated. */
+	uint64_t N;
+	size_t r, p;
+	uint8_t * buf;
+	size_t buflen;
+	size_t lane;		/* Lane being mixed... */
+	uint64_t pos;		/* ... and its next iteration. */
+	int (*slice)(uint8_t *, size_t, uint64_t, void *, void *,
+	    uint64_t *, uint64_t);	/* Kernel, whose layout X keeps. */
+};
+
+/**
+ * crypto_scrypt_state_new(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * Start the computation of crypto_scrypt with the same arguments, to be
+ * performed by calls to crypto_scrypt_state_step which may happen on any
+ * thread.  V is always held in full.  ${buf} must remain valid until the
+ * computation is done.
+ *
+ * Return the state; or NULL on error.
+ */
+struct crypto_scrypt_state *
+crypto_scrypt_state_new(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r,
+    uint32_t _p, uint8_t * buf, size_t buflen)
+{
+	struct crypto_scrypt_state * s;
+	size_t r = _r, p = _p;
+
+	if (smix_func == NULL)
+		selectsmix();
+	if (checkparams(N, r, p, buflen))
+		goto err0;
+
+	if ((s = calloc(1, sizeof(struct crypto_scrypt_state))) == NULL)
+		goto err0;
+	s->N = N;
+	s->r = r;
+	s->p = p;
+	s->slice = slice_func;
+	s->buf = buf;
+	s->buflen = buflen;
+	if ((s->passwd = malloc(passwdlen + 1)) == NULL)
+		goto err1;
+	memcpy(s->passwd, passwd, passwdlen);
+	s->passwdlen = passwdlen;
+
+	/* Allocate memory; the arena belongs to the calling thread only. */
+#ifdef HAVE_POSIX_MEMALIGN
+	if ((errno = posix_memalign(&s->B0, 64, 128 * r * p)) != 0)
+		goto err1;
+	s->B = (uint8_t *)(s->B0);
+	if ((errno = posix_memalign(&s->XY0, 64, 256 * r + 64)) != 0)
+		goto err1;
+	s->XY = s->XY0;
+#else
+	if ((s->B0 = malloc(128 * r * p + 63)) == NULL)
+		goto err1;
+	s->B = (uint8_t *)(((uintptr_t)(s->B0) + 63) & ~ (uintptr_t)(63));
+	if ((s->XY0 = malloc(256 * r + 64 + 63)) == NULL)
+		goto err1;
+	s->XY = (void *)(((uintptr_t)(s->XY0) + 63) & ~ (uintptr_t)(63));
+#endif
+	if (v_alloc(&s->V0, 128 * r * N, 0))
+		goto err1;
+	s->vheld = 1;
+
+	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+	PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, s->B, p * 128 * r);
+
+	/* Success! */
+	return (s);
+
+err1:
+	crypto_scrypt_state_free(s);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * crypto_scrypt_state_step(s, n):
+ * Perform about ${n} more iterations of the computation ${s}; a lane takes
+ * 2N iterations.  When the last lane is done, write the result and release
+ * V.  Return 1 if the result has been written; or 0 if work remains.
+ */
+int
+crypto_scrypt_state_step(struct crypto_scrypt_state * s, uint64_t n)
+{
+	uint64_t pos0, used;
+	int done;
+
+	/* 2: for i = 0 to p - 1 do */
+	while (s->lane < s->p) {
+		/* 3: B_i <-- MF(B_i, N) */
+		pos0 = s->pos;
+		done = (s->slice)(&s->B[s->lane * 128 * s->r], s->r, s->N,
+		    s->V0.V, s->XY, &s->pos, n);
+		used = s->pos - pos0;
+		n = (n > used) ? n - used : 0;
+		if (!done)
+			return (0);
+		s->pos = 0;
+
+		if (++s->lane == s->p) {
+			/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+			PBKDF2_SHA256(s->passwd, s->passwdlen, s->B,
+			    s->p * 128 * s->r, 1, s->buf, s->buflen);
+			v_free(&s->V0);
+			s->vheld = 0;
+			break;
+		}
+		if (n == 0)
+			return (0);
+	}
+
+	return (1);
+}
+
+/**
+ * crypto_scrypt_state_free(s):
+ * Free the computation ${s}, which may be unfinished.
+ */
+void
+crypto_scrypt_state_free(struct crypto_scrypt_state * s)
+{
+
+	if (s == NULL)
+		return;
+	if (s->vheld)
+		v_free(&s->V0);
+	if (s->B0 != NULL)
+		insecure_memzero(s->B, 128 * s->r * s->p);
+	if (s->passwd != NULL)
+		insecure_memzero(s->passwd, s->passwdlen);
+	free(s->XY0);
+	free(s->B0);
+	free(s->passwd);
+	free(s);
+}
+
+/**
+ * crypto_scrypt_set_blimit(len):
+ * Produce, mix and absorb the lanes B_i one at a time if B would be larger
+ * than ${len} bytes, so that only 128r bytes of B are held.  The value 0
+ * selects 16 MiB; SIZE_MAX always holds all of B.
+ */
+void
+crypto_scrypt_set_blimit(size_t len)
+{
+
+	blimit = len;
+}
+
+/**
+ * crypto_scrypt_set_generic(generic):
+ * Use the generic smix kernel for every r if ${generic} is nonzero, instead
+ * of the ones unrolled for r = 1, 8 and 16; for comparing them.
+ */
+void
+crypto_scrypt_set_generic(int generic)
+{
+
+	smix_generic = generic;
+}
+
+/**
+ * crypto_scrypt_kernels(names, max):
+ * Store the names of up to ${max} smix kernels which this CPU supports in
+ * ${names}, fastest first, and return how many there are.
+ */
+size_t
+crypto_scrypt_kernels(const char ** names, size_t max)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < NKERNELS; i++) {
+		if ((smix_kernels[i].supported != NULL) &&
+		    !(smix_kernels[i].supported)())
+			continue;
+		if (n < max)
+			names[n] = smix_kernels[i].name;
+		n++;
+	}
+	return (n);
+}
+
+/**
+ * crypto_scrypt_set_tuning(tuning):
+ * Use the smix kernel ${tuning}->kernel in place of the fastest one which
+ * works, or that one again if it is NULL, and the other settings of
+ * ${tuning}.  Derivations in progress finish with the kernel they started
+ * with.
+ *
+ * Return 0 on success; or -1 if the kernel does not work on this CPU, the
+ * interleave is not between 1 and CRYPTO_SCRYPT_SMIX_MULTI, or huge pages
+ * are not supported.
+ */
+int
+crypto_scrypt_set_tuning(const struct crypto_scrypt_tuning * tuning)
+{
+	size_t i;
+
+	if ((tuning->interleave < 1) ||
+	    (tuning->interleave > CRYPTO_SCRYPT_SMIX_MULTI))
+		goto err0;
+#ifndef MADV_HUGEPAGE
+	if (tuning->hugepages)
+		goto err0;
+#endif
+
+	/* Find the kernel and check that it works. */
+	for (i = 0; (tuning->kernel != NULL) && (i < NKERNELS); i++) {
+		if (!strcmp(smix_kernels[i].name, tuning->kernel))
+			break;
+	}
+	if ((tuning->kernel != NULL) &&
+	    ((i == NKERNELS) || usekernel(&smix_kernels[i])))
+		goto err0;
+	smix_want = (tuning->kernel != NULL) ? smix_kernels[i].name : NULL;
+	if (smix_want == NULL)
+		selectsmix();
+
+	multi_width = tuning->interleave;
+	multi_prefetch = tuning->prefetch;
+	vhugepages = tuning->hugepages;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_scrypt_get_tuning(tuning):
+ * Store the settings in use in ${tuning}, with the kernel that was selected.
+ */
+void
+crypto_scrypt_get_tuning(struct crypto_scrypt_tuning * tuning)
+{
+
+	if (smix_func == NULL)
+		selectsmix();
+	tuning->kernel = smix_name;
+	tuning->interleave = multi_width;
+	tuning->prefetch = multi_prefetch;
+	tuning->hugepages = vhugepages;
+}
+
+/**
+ * crypto_scrypt_set_arena(V, len):
+ * Use the ${len} bytes at ${V} as V for the derivations of the calling thread
+ * which fit into them, e.g. memory which the thread allocated on its own NUMA
+ * node.  Pass NULL to stop doing so.
+ */
+void
+crypto_scrypt_set_arena(void * V, size_t len)
+{
+
+	arena_V = V;
+	arena_len = len;
+	arena_inuse = 0;
+}
+
+/**
+ * crypto_scrypt_run(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+ *     cancel, deadline, timing):
+ * Choose how to store V and perform the computation; see crypto_scrypt_cancel
+ * and crypto_scrypt_timed.
+ */
+static int
+crypto_scrypt_run(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
+    uint8_t * buf, size_t buflen, const volatile int * cancel,
+    uint64_t deadline, struct crypto_scrypt_timing * timing)
+{
+	void (*hook)(const struct crypto_scrypt_timing *) = timing_hook;
+	void (*end)(uint64_t, uint32_t, uint32_t,
+	    const struct crypto_scrypt_timing *, int) = observer_end;
+	void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+	    struct crypto_scrypt_smix_ctl *);
+	struct crypto_scrypt_timing t;
+	uint64_t lanes[2 * CRYPTO_SCRYPT_TIMING_LANES];
+	uint64_t k;
+	int rc, err;
+
+	if (smix_func == NULL)
+		selectsmix();
+	smix = smix_func;
+	fixedsmix(&smix, _r);
+	k = vstride(N, _r);
+
+	CRYPTO_SCRYPT_PROBE4(derive_start, N, _r, _p, k);
+	if ((end == NULL) && ((timing != NULL) || (hook == NULL))) {
+		rc = _crypto_scrypt(passwd, passwdlen, salt, saltlen, N, _r,
+		    _p, buf, buflen, smix, k, cancel, deadline, timing);
+		CRYPTO_SCRYPT_PROBE4(derive_done, N, _r, _p, rc ? errno : 0);
+		return (rc);
+	}
+
+	/* Time the derivation for the hook or the observer. */
+	if (timing == NULL) {
+		memset(&t, 0, sizeof(t));
+		if (hook != NULL) {
+			t.lanes = lanes;
+			t.nlanes = CRYPTO_SCRYPT_TIMING_LANES;
+		}
+		timing = &t;
+	}
+	if (end != NULL)
+		(observer_begin)();
+	rc = _crypto_scrypt(passwd, passwdlen, salt, saltlen, N, _r, _p, buf,
+	    buflen, smix, k, cancel, deadline, timing);
+	err = rc ? errno : 0;
+	if (end != NULL)
+		(end)(N, _r, _p, timing, err);
+	if ((rc == 0) && (timing == &t) && (hook != NULL))
+		(hook)(&t);
+	CRYPTO_SCRYPT_PROBE4(derive_done, N, _r, _p, err);
+	errno = err;
+
+	return (rc);
+}
+
+/* A derivation whose lanes are mixed separately, see crypto_scrypt_lanes_new. */
+struct crypto_scrypt_lanes {
+	uint8_t * passwd;	/* Copy of the password for step 5. */
+	size_t passwdlen;
+	void * B0;
+	uint8_t * B;
+	uint64_t N, k;
+	size_t r, p;
+	uint8_t * buf;
+	size_t buflen;
+	const volatile int * cancel;
+	uint64_t deadline;
+	size_t left;		/* Lanes not mixed yet. */
+	int err;		/* errno of the first lane which failed, or 0. */
+	const char * vhow;	/* How V of lane 0 was obtained. */
+	const char * kernel;	/* Which smix lane 0 used. */
+	int observed;		/* The observer saw the derivation begin. */
+	uint64_t t0;
+};
+
+/**
+ * crypto_scrypt_lanes_usable(N, r, p):
+ * Return nonzero if a derivation with these parameters can be performed
+ * with crypto_scrypt_lanes_new: they are valid, and B is held in full and
+ * V is not backed by a file in crypto_scrypt.
+ */
+int
+crypto_scrypt_lanes_usable(uint64_t N, uint32_t _r, uint32_t _p)
+{
+	size_t r = _r, p = _p;
+	int errno_save = errno;
+
+	if ((p == 0) || checkparams(N, r, p, 0)) {
+		errno = errno_save;
+		return (0);
+	}
+
+	return ((128 * r * p <= ((blimit > 0) ? blimit : BLIMIT_DEFAULT)) &&
+	    !crypto_scrypt_vfile_wanted(128 * r * N));
+}
+
+/**
+ * crypto_scrypt_lanes_wanted(N, r, p):
+ * Return nonzero if a derivation with these parameters has several lanes
+ * whose V of at least CRYPTO_SCRYPT_LANES_MIN bytes is worth mixing
+ * separately, and B which crypto_scrypt would hold in full.
+ */
+int
+crypto_scrypt_lanes_wanted(uint64_t N, uint32_t r, uint32_t p)
+{
+
+	/* Valid parameters keep 128 * r * N within SIZE_MAX. */
+	return ((p >= 2) && crypto_scrypt_lanes_usable(N, r, p) &&
+	    (128 * (size_t)r * N >= CRYPTO_SCRYPT_LANES_MIN));
+}
+
+/**
+ * crypto_scrypt_lanes_new(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen, cancel, deadline):
+ * Start the computation of crypto_scrypt_cancel with the same arguments, up
+ * to and including step 1.  Each of the ${p} lanes is then mixed by one call
+ * to crypto_scrypt_lanes_mix, on any thread and in any order, and the result
+ * written by crypto_scrypt_lanes_finish.  Every lane holds its own V while it
+ * is being mixed.  ${buf} must remain valid until the computation is done.
+ *
+ * Return the computation; or NULL on error.
+ */
+struct crypto_scrypt_lanes *
+crypto_scrypt_lanes_new(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r,
+    uint32_t _p, uint8_t * buf, size_t buflen, const volatile int * cancel,
+    uint64_t deadline)
+{
+	struct crypto_scrypt_lanes * l;
+	size_t r = _r, p = _p;
+
+	if (smix_func == NULL)
+		selectsmix();
+	if (checkparams(N, r, p, buflen))
+		goto err0;
+
+	if ((l = calloc(1, sizeof(struct crypto_scrypt_lanes))) == NULL)
+		goto err0;
+	l->N = N;
+	l->k = vstride(N, _r);
+	l->r = r;
+	l->p = p;
+	l->buf = buf;
+	l->buflen = buflen;
+	l->cancel = cancel;
+	l->deadline = deadline;
+	l->left = p;
+	l->t0 = timing_now();
+	if ((l->passwd = malloc(passwdlen + 1)) == NULL)
+		goto err1;
+	memcpy(l->passwd, passwd, passwdlen);
+	l->passwdlen = passwdlen;
+#ifdef HAVE_POSIX_MEMALIGN
+	if ((errno = posix_memalign(&l->B0, 64, 128 * r * p)) != 0)
+		goto err1;
+	l->B = (uint8_t *)(l->B0);
+#else
+	if ((l->B0 = malloc(128 * r * p + 63)) == NULL)
+		goto err1;
+	l->B = (uint8_t *)(((uintptr_t)(l->B0) + 63) & ~ (uintptr_t)(63));
+#endif
+
+	/* The observer may be set meanwhile; it only sees both ends. */
+	if ((l->observed = (observer_end != NULL)) != 0)
+		(observer_begin)();
+	CRYPTO_SCRYPT_PROBE4(derive_start, N, _r, _p, l->k);
+
+	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+	PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, l->B, p * 128 * r);
+
+	/* Success! */
+	return (l);
+
+err1:
+	free(l->passwd);
+	free(l);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * lanes_fail(l, err):
+ * Record ${err} as the reason the computation ${l} failed, unless a lane
+ * failed before.
+ */
+static void
+lanes_fail(struct crypto_scrypt_lanes * l, int err)
+{
+	int none = 0;
+
+	__atomic_compare_exchange_n(&l->err, &none, err, 0, __ATOMIC_RELAXED,
+	    __ATOMIC_RELAXED);
+}
+
+/**
+ * crypto_scrypt_lanes_mix(l, i):
+ * Perform steps 2 and 3 for lane ${i} of the computation ${l}, using the
+ * arena of the calling thread for V if it fits.  Lanes are skipped once one
+ * of them failed.  Return 1 if this was the last lane to be mixed, after
+ * which crypto_scrypt_lanes_finish must be called; or 0 otherwise.
+ */
+int
+crypto_scrypt_lanes_mix(struct crypto_scrypt_lanes * l, size_t i)
+{
+	struct crypto_scrypt_smix_ctl ctl = { NULL };
+	void (*smix)(uint8_t *, size_t, uint64_t, void *, void *,
+	    struct crypto_scrypt_smix_ctl *) = smix_func;
+	void * XY0;
+	void * XY;
+	struct vregion V0;
+	size_t r = l->r;
+	uint64_t N = l->N, k = l->k;
+	const char * vhow;
+
+	if (__atomic_load_n(&l->err, __ATOMIC_RELAXED) != 0)
+		goto done;
+	ctl.cancel = l->cancel;
+	ctl.deadline = l->deadline;
+	if (crypto_scrypt_smix_stop(&ctl)) {
+		lanes_fail(l, ctl.stopped);
+		goto done;
+	}
+	fixedsmix(&smix, r);
+
+	/* Allocate memory. */
+#ifdef HAVE_POSIX_MEMALIGN
+	if ((errno = posix_memalign(&XY0, 64,
+	    ((k > 1) ? 512 : 256) * r + 64)) != 0)
+		goto err0;
+	XY = XY0;
+#else
+	if ((XY0 = malloc(((k > 1) ? 512 : 256) * r + 64 + 63)) == NULL)
+		goto err0;
+	XY = (void *)(((uintptr_t)(XY0) + 63) & ~ (uintptr_t)(63));
+#endif
+	if (v_alloc(&V0, 128 * r * (N / k), 1))
+		goto err1;
+	vhow = valloc_names[V0.how];
+	if (i == 0) {
+		l->vhow = vhow;
+		l->kernel = smixname(smix);
+	}
+	CRYPTO_SCRYPT_PROBE2(v_alloc, 128 * r * (N / k), vhow);
+
+	/* 3: B_i <-- MF(B_i, N) */
+	if (k > 1)
+		crypto_scrypt_smix_tmto(&l->B[i * 128 * r], r, N, V0.V, XY,
+		    &ctl, k);
+	else
+		(smix)(&l->B[i * 128 * r], r, N, V0.V, XY, &ctl);
+	if (ctl.stopped)
+		lanes_fail(l, ctl.stopped);
+
+	/* Free memory. */
+	v_free(&V0);
+	CRYPTO_SCRYPT_PROBE2(v_free, 128 * r * (N / k), vhow);
+	free(XY0);
+
+done:
+	return (__atomic_sub_fetch(&l->left, 1, __ATOMIC_ACQ_REL) == 0);
+
+err1:
+	free(XY0);
+err0:
+	lanes_fail(l, errno ? errno : ENOMEM);
+	goto done;
+}
+
+/**
+ * crypto_scrypt_lanes_finish(l):
+ * Perform step 5 of the computation ${l} once all of its lanes have been
+ * mixed, and free it.
+ *
+ * Return 0 on success; or -1 on error, with errno set as for
+ * crypto_scrypt_cancel.
+ */
+int
+crypto_scrypt_lanes_finish(struct crypto_scrypt_lanes * l)
+{
+	void (*hook)(const struct crypto_scrypt_timing *) = timing_hook;
+	void (*end)(uint64_t, uint32_t, uint32_t,
+	    const struct crypto_scrypt_timing *, int) =
+	    l->observed ? observer_end : NULL;
+	struct crypto_scrypt_timing t;
+	int err = l->err;
+
+	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+	if (err == 0)
+		PBKDF2_SHA256(l->passwd, l->passwdlen, l->B,
+		    l->p * 128 * l->r, 1, l->buf, l->buflen);
+
+	if ((end != NULL) || (hook != NULL)) {
+		memset(&t, 0, sizeof(t));
+		t.total = timing_now() - l->t0;
+		t.vlen = 128 * l->r * (l->N / l->k);
+		t.kernel = (l->k > 1) ? "tmto" : l->kernel;
+		t.valloc = l->vhow;
+		if (end != NULL)
+			(end)(l->N, (uint32_t)l->r, (uint32_t)l->p, &t, err);
+		if ((err == 0) && (hook != NULL))
+			(hook)(&t);
+	}
+	CRYPTO_SCRYPT_PROBE4(derive_done, l->N, (uint32_t)l->r,
+	    (uint32_t)l->p, err);
+
+	insecure_memzero(l->B, 128 * l->r * l->p);
+	insecure_memzero(l->passwd, l->passwdlen);
+	free(l->B0);
+	free(l->passwd);
+	free(l);
+
+	errno = err;
+	return ((err == 0) ? 0 : -1);
+}
+
+/**
+ * crypto_scrypt_multi_wanted(N, r):
+ * Return nonzero if derivations with these parameters can be performed
+ * together by crypto_scrypt_multi: V is stored in full and in memory, and
+ * crypto_scrypt_set_tuning allows more than one lane at a time.
+ */
+int
+crypto_scrypt_multi_wanted(uint64_t N, uint32_t r)
+{
+
+	return ((multi_width > 1) && (r > 0) && (N >= 2) &&
+	    (N <= SIZE_MAX / 128 / r) && (vstride(N, r) == 1) &&
+	    !crypto_scrypt_vfile_wanted(128 * (size_t)(r) * N));
+}
+
+/**
+ * crypto_scrypt_multi(jobs, count, N, r):
+ * Perform the ${count} derivations ${jobs}, which share N and r, like
+ * crypto_scrypt.  Their lanes are mixed by the multi-buffer smix as many at
+ * a time as crypto_scrypt_set_tuning allows, each with its own V.  crypto_scrypt_multi_wanted
+ * must hold for N and r.
+ *
+ * Return 0 on success; or -1 on error, in which case no result is written.
+ */
+int
+crypto_scrypt_multi(struct crypto_scrypt_multi_job * jobs, size_t count,
+    uint64_t N, uint32_t _r)
+{
+	void (*hook)(const struct crypto_scrypt_timing *) = timing_hook;
+	void (*end)(uint64_t, uint32_t, uint32_t,
+	    const struct crypto_scrypt_timing *, int) = observer_end;
+	struct crypto_scrypt_timing t;
+	struct vregion V0[CRYPTO_SCRYPT_SMIX_MULTI];
+	void * XY0[CRYPTO_SCRYPT_SMIX_MULTI];
+	void * V[CRYPTO_SCRYPT_SMIX_MULTI];
+	void * XY[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint8_t * Bl[CRYPTO_SCRYPT_SMIX_MULTI];
+	void ** B0;
+	uint8_t ** B;
+	size_t r = _r;
+	size_t lanes = 0, nv, nxy, n, i, l;
+	uint64_t t0;
+	uint32_t lane;
+	const char * vhow;
+
+	if (smix_func == NULL)
+		selectsmix();
+
+	/* Sanity-check parameters. */
+	for (i = 0; i < count; i++) {
+		if (jobs[i].p == 0) {
+			errno = EINVAL;
+			goto err0;
+		}
+		if (checkparams(N, r, jobs[i].p, jobs[i].buflen))
+			goto err0;
+		lanes += jobs[i].p;
+	}
+	nv = (lanes < multi_width) ? lanes : multi_width;
+
+	/* Allocate memory. */
+	t0 = timing_now();
+	if ((B0 = calloc(count, sizeof(void *))) == NULL)
+		goto err0;
+	if ((B = calloc(count, sizeof(uint8_t *))) == NULL)
+		goto err1;
+	for (i = 0; i < count; i++) {
+#ifdef HAVE_POSIX_MEMALIGN
+		if ((errno = posix_memalign(&B0[i], 64,
+		    128 * r * jobs[i].p)) != 0)
+			goto err2;
+		B[i] = (uint8_t *)(B0[i]);
+#else
+		if ((B0[i] = malloc(128 * r * jobs[i].p + 63)) == NULL)
+			goto err2;
+		B[i] = (uint8_t *)(((uintptr_t)(B0[i]) + 63) &
+		    ~ (uintptr_t)(63));
+#endif
+	}
+	for (nxy = 0; nxy < nv; nxy++) {
+#ifdef HAVE_POSIX_MEMALIGN
+		if ((errno = posix_memalign(&XY0[nxy], 64, 256 * r + 64)) != 0)
+			goto err3;
+		XY[nxy] = XY0[nxy];
+#else
+		if ((XY0[nxy] = malloc(256 * r + 64 + 63)) == NULL)
+			goto err3;
+		XY[nxy] = (void *)(((uintptr_t)(XY0[nxy]) + 63) &
+		    ~ (uintptr_t)(63));
+#endif
+	}
+	for (n = 0; n < nv; n++) {
+		if (v_alloc(&V0[n], 128 * r * N, 1))
+			goto err4;
+		V[n] = V0[n].V;
+		CRYPTO_SCRYPT_PROBE2(v_alloc, 128 * r * N,
+		    valloc_names[V0[n].how]);
+	}
+	vhow = valloc_names[V0[0].how];
+
+	for (i = 0; i < count; i++) {
+		if (end != NULL)
+			(observer_begin)();
+		CRYPTO_SCRYPT_PROBE4(derive_start, N, _r, jobs[i].p, 1);
+
+		/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+		PBKDF2_SHA256(jobs[i].passwd, jobs[i].passwdlen, jobs[i].salt,
+		    jobs[i].saltlen, 1, B[i], jobs[i].p * 128 * r);
+	}
+
+	/* 2: for i = 0 to p - 1 do, over the lanes of all derivations */
+	n = 0;
+	for (i = 0; i < count; i++) {
+		for (lane = 0; lane < jobs[i].p; lane++) {
+			Bl[n++] = &B[i][lane * 128 * r];
+			lanes--;
+			if ((n < nv) && (lanes > 0))
+				continue;
+
+			/* 3: B_i <-- MF(B_i, N) */
+			(multi_func)(Bl, n, r, N, V, XY, multi_prefetch);
+			n = 0;
+		}
+	}
+
+	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+	for (i = 0; i < count; i++)
+		PBKDF2_SHA256(jobs[i].passwd, jobs[i].passwdlen, B[i],
+		    jobs[i].p * 128 * r, 1, jobs[i].buf, jobs[i].buflen);
+
+	/* Free memory. */
+	for (l = 0; l < nv; l++) {
+		v_free(&V0[l]);
+		CRYPTO_SCRYPT_PROBE2(v_free, 128 * r * N,
+		    valloc_names[V0[l].how]);
+		free(XY0[l]);
+	}
+	for (i = 0; i < count; i++) {
+		insecure_memzero(B[i], 128 * r * jobs[i].p);
+		free(B0[i]);
+	}
+	free(B);
+	free(B0);
+
+	/* All derivations took as long as the group. */
+	if ((end != NULL) || (hook != NULL)) {
+		memset(&t, 0, sizeof(t));
+		t.total = timing_now() - t0;
+		t.vlen = 128 * r * N;
+		t.kernel = smix_name;
+		t.valloc = vhow;
+	}
+	for (i = 0; i < count; i++) {
+		if (end != NULL)
+			(end)(N, _r, jobs[i].p, &t, 0);
+		if (hook != NULL)
+			(hook)(&t);
+		CRYPTO_SCRYPT_PROBE4(derive_done, N, _r, jobs[i].p, 0);
+	}
+
+	/* Success! */
+	return (0);
+
+err4:
+	while (n > 0)
+		v_free(&V0[--n]);
+err3:
+	while (nxy > 0)
+		free(XY0[--nxy]);
+err2:
+	for (i = 0; i < count; i++)
+		free(B0[i]);
+	free(B);
+err1:
+	free(B0);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
+ * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
  * p, buflen) and write the result into buf.  The parameters r, p, and buflen
  * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
  * must be a power of 2 greater than 1.
@@ -244,9 +1684,80 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
     uint8_t * buf, size_t buflen)
 {
 
-	if (smix_func == NULL)
-		selectsmix();
+	return (crypto_scrypt_run(passwd, passwdlen, salt, saltlen, N, _r, _p,
+	    buf, buflen, NULL, 0, NULL));
+}
+
+/**
+ * crypto_scrypt_cancel(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+ *     cancel, deadline):
+ * Compute scrypt like crypto_scrypt, but give up with errno set to ECANCELED
+ * once *${cancel} is nonzero, or with errno set to ETIMEDOUT once
+ * CLOCK_MONOTONIC reaches ${deadline} nanoseconds.  This is checked between
+ * lanes and every CRYPTO_SCRYPT_SMIX_CHECK iterations.  ${cancel} may be
+ * NULL and ${deadline} 0.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt_cancel(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
+    uint8_t * buf, size_t buflen, const volatile int * cancel,
+    uint64_t deadline)
+{
+
+	return (crypto_scrypt_run(passwd, passwdlen, salt, saltlen, N, _r, _p,
+	    buf, buflen, cancel, deadline, NULL));
+}
+
+/**
+ * crypto_scrypt_timed(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+ *     timing):
+ * Compute scrypt like crypto_scrypt and record in ${timing} how long each
+ * phase took, which smix kernel ran and where V came from.  The caller sets
+ * ${timing}->lanes and ${timing}->nlanes.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt_timed(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
+    uint8_t * buf, size_t buflen, struct crypto_scrypt_timing * timing)
+{
+
+	return (crypto_scrypt_run(passwd, passwdlen, salt, saltlen, N, _r, _p,
+	    buf, buflen, NULL, 0, timing));
+}
+
+/**
+ * crypto_scrypt_set_timing(hook):
+ * Call ${hook} with the timings of every successful derivation which is not
+ * timed by crypto_scrypt_timed, recording the first CRYPTO_SCRYPT_TIMING_LANES
+ * lanes.  Those of crypto_scrypt_lanes_new and crypto_scrypt_multi have only
+ * the total time.  Pass NULL to stop.
+ */
+void
+crypto_scrypt_set_timing(void (*hook)(const struct crypto_scrypt_timing *))
+{
+
+	timing_hook = hook;
+}
+
+/**
+ * crypto_scrypt_set_observer(begin, end):
+ * Call ${begin} when any derivation except those of crypto_scrypt_state_new
+ * starts, and ${end} with N, r, p, the timings and 0 or the errno of the
+ * failure when it ends.  The kernel of the timings is NULL if the
+ * derivation failed before it was chosen; those of crypto_scrypt_lanes_new
+ * have only the total time.  Pass NULL to stop.  Derivations running
+ * when it is set are not observed.
+ */
+void
+crypto_scrypt_set_observer(void (*begin)(void), void (*end)(uint64_t,
+    uint32_t, uint32_t, const struct crypto_scrypt_timing *, int))
+{
 
-	return (_crypto_scrypt(passwd, passwdlen, salt, saltlen, N, _r, _p,
-	    buf, buflen, smix_func));
+	/* A derivation which sees ${end} also sees ${begin}. */
+	observer_begin = begin;
+	__atomic_store_n(&observer_end, end, __ATOMIC_RELEASE);
 }
@@ -32,6 +32,8 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include "crypto_scrypt_perf.h"
+
 /**
  * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
  * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
@@ -44,4 +46,259 @@
 int crypto_scrypt(const uint8_t *, size_t, const uint8_t *, size_t, uint64_t,
     uint32_t, uint32_t, uint8_t *, size_t);
 
+/* Where the time of a derivation went, in nanoseconds. */
+struct crypto_scrypt_timing {
+	uint64_t alloc;		/* Allocating B, XY and V. */
+	uint64_t pbkdf2_in;	/* PBKDF2 of step 1. */
+	uint64_t loop1;		/* First smix loop of all lanes. */
+	uint64_t loop2;		/* Second smix loop of all lanes. */
+	uint64_t pbkdf2_out;	/* PBKDF2 of step 5. */
+	uint64_t free;		/* Releasing memory, e.g. munmap. */
+	uint64_t total;
+	size_t vlen;		/* Bytes of V. */
+	uint64_t * lanes;	/* Loops 1 and 2 of lane i at 2i and 2i + 1... */
+	size_t nlanes;		/* ... for lanes below nlanes; may be NULL. */
+	const char * kernel;	/* "generic[-r1|-r8|-r16]", "sse2", "tmto", "io". */
+	const char * valloc;	/* "heap", "mmap", "pool", "arena", "shm",
+				   "file" or "file-direct". */
+	int perf;		/* Nonzero if these counters were read; see
+				   crypto_scrypt_perf_enable. */
+	struct crypto_scrypt_perf_counts perf_loop1;
+	struct crypto_scrypt_perf_counts perf_loop2;
+	struct crypto_scrypt_perf_counts perf_pbkdf2;	/* Steps 1 and 5. */
+};
+
+/* Lanes recorded for crypto_scrypt_set_timing. */
+#define CRYPTO_SCRYPT_TIMING_LANES	16
+
+/**
+ * crypto_scrypt_cancel(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+ *     cancel, deadline):
+ * Compute scrypt like crypto_scrypt, but give up with errno set to ECANCELED
+ * once *${cancel} is nonzero, or with errno set to ETIMEDOUT once
+ * CLOCK_MONOTONIC reaches ${deadline} nanoseconds.  This is checked between
+ * lanes and every CRYPTO_SCRYPT_SMIX_CHECK iterations.  ${cancel} may be
+ * NULL and ${deadline} 0.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int crypto_scrypt_cancel(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t, const volatile int *,
+    uint64_t);
+
+/**
+ * crypto_scrypt_timed(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+ *     timing):
+ * Compute scrypt like crypto_scrypt and record in ${timing} how long each
+ * phase took, which smix kernel ran and where V came from.  The caller sets
+ * ${timing}->lanes and ${timing}->nlanes.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int crypto_scrypt_timed(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t,
+    struct crypto_scrypt_timing *);
+
+/**
+ * crypto_scrypt_set_timing(hook):
+ * Call ${hook} with the timings of every successful derivation which is not
+ * timed by crypto_scrypt_timed, recording the first CRYPTO_SCRYPT_TIMING_LANES
+ * lanes.  Those of crypto_scrypt_lanes_new and crypto_scrypt_multi have only
+ * the total time.  Pass NULL to stop.
+ */
+void crypto_scrypt_set_timing(void (*)(const struct crypto_scrypt_timing *));
+
+/* A derivation performed in slices. */
+struct crypto_scrypt_state;
+
+/**
+ * crypto_scrypt_state_new(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * Start the computation of crypto_scrypt with the same arguments, to be
+ * performed by calls to crypto_scrypt_state_step which may happen on any
+ * thread.  V is always held in full.  ${buf} must remain valid until the
+ * computation is done.
+ *
+ * Return the state; or NULL on error.
+ */
+struct crypto_scrypt_state * crypto_scrypt_state_new(const uint8_t *, size_t,
+    const uint8_t *, size_t, uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
+/**
+ * crypto_scrypt_state_step(s, n):
+ * Perform about ${n} more iterations of the computation ${s}; a lane takes
+ * 2N iterations.  When the last lane is done, write the result and release
+ * V.  Return 1 if the result has been written; or 0 if work remains.
+ */
+int crypto_scrypt_state_step(struct crypto_scrypt_state *, uint64_t);
+
+/**
+ * crypto_scrypt_state_free(s):
+ * Free the computation ${s}, which may be unfinished.
+ */
+void crypto_scrypt_state_free(struct crypto_scrypt_state *);
+
+/* Smallest V for which crypto_scrypt_lanes_wanted splits a derivation. */
+#define CRYPTO_SCRYPT_LANES_MIN	(1024 * 1024)
+
+struct crypto_scrypt_lanes;
+
+/**
+ * crypto_scrypt_lanes_usable(N, r, p):
+ * Return nonzero if a derivation with these parameters can be performed
+ * with crypto_scrypt_lanes_new: they are valid, and B is held in full and
+ * V is not backed by a file in crypto_scrypt.
+ */
+int crypto_scrypt_lanes_usable(uint64_t, uint32_t, uint32_t);
+
+/**
+ * crypto_scrypt_lanes_wanted(N, r, p):
+ * Return nonzero if a derivation with these parameters has several lanes
+ * whose V of at least CRYPTO_SCRYPT_LANES_MIN bytes is worth mixing
+ * separately, and B which crypto_scrypt would hold in full.
+ */
+int crypto_scrypt_lanes_wanted(uint64_t, uint32_t, uint32_t);
+
+/**
+ * crypto_scrypt_lanes_new(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen, cancel, deadline):
+ * Start the computation of crypto_scrypt_cancel with the same arguments, up
+ * to and including step 1.  Each of the ${p} lanes is then mixed by one call
+ * to crypto_scrypt_lanes_mix, on any thread and in any order, and the result
+ * written by crypto_scrypt_lanes_finish.  Every lane holds its own V while it
+ * is being mixed.  ${buf} must remain valid until the computation is done.
+ *
+ * Return the computation; or NULL on error.
+ */
+struct crypto_scrypt_lanes * crypto_scrypt_lanes_new(const uint8_t *, size_t,
+    const uint8_t *, size_t, uint64_t, uint32_t, uint32_t, uint8_t *, size_t,
+    const volatile int *, uint64_t);
+
+/**
+ * crypto_scrypt_lanes_mix(l, i):
+ * Perform steps 2 and 3 for lane ${i} of the computation ${l}, using the
+ * arena of the calling thread for V if it fits.  Lanes are skipped once one
+ * of them failed.  Return 1 if this was the last lane to be mixed, after
+ * which crypto_scrypt_lanes_finish must be called; or 0 otherwise.
+ */
+int crypto_scrypt_lanes_mix(struct crypto_scrypt_lanes *, size_t);
+
+/**
+ * crypto_scrypt_lanes_finish(l):
+ * Perform step 5 of the computation ${l} once all of its lanes have been
+ * mixed, and free it.
+ *
+ * Return 0 on success; or -1 on error, with errno set as for
+ * crypto_scrypt_cancel.
+ */
+int crypto_scrypt_lanes_finish(struct crypto_scrypt_lanes *);
+
+/* One derivation of crypto_scrypt_multi. */
+struct crypto_scrypt_multi_job {
+	const uint8_t * passwd;
+	size_t passwdlen;
+	const uint8_t * salt;
+	size_t saltlen;
+	uint32_t p;
+	uint8_t * buf;
+	size_t buflen;
+};
+
+/**
+ * crypto_scrypt_multi_wanted(N, r):
+ * Return nonzero if derivations with these parameters can be performed
+ * together by crypto_scrypt_multi: V is stored in full and in memory, and
+ * crypto_scrypt_set_tuning allows more than one lane at a time.
+ */
+int crypto_scrypt_multi_wanted(uint64_t, uint32_t);
+
+/**
+ * crypto_scrypt_multi(jobs, count, N, r):
+ * Perform the ${count} derivations ${jobs}, which share N and r, like
+ * crypto_scrypt.  Their lanes are mixed by the multi-buffer smix as many at
+ * a time as crypto_scrypt_set_tuning allows, each with its own V.  crypto_scrypt_multi_wanted
+ * must hold for N and r.
+ *
+ * Return 0 on success; or -1 on error, in which case no result is written.
+ */
+int crypto_scrypt_multi(struct crypto_scrypt_multi_job *, size_t, uint64_t,
+    uint32_t);
+
+/**
+ * crypto_scrypt_set_vlimit(len):
+ * Store only part of V and recompute the rest on demand if V would be larger
+ * than ${len} bytes.  The value 0 selects the memory which memtouse allows.
+ */
+void crypto_scrypt_set_vlimit(size_t);
+
+/**
+ * crypto_scrypt_set_blimit(len):
+ * Produce, mix and absorb the lanes B_i one at a time if B would be larger
+ * than ${len} bytes, so that only 128r bytes of B are held.  The value 0
+ * selects 16 MiB; SIZE_MAX always holds all of B.
+ */
+void crypto_scrypt_set_blimit(size_t);
+
+/**
+ * crypto_scrypt_set_generic(generic):
+ * Use the generic smix kernel for every r if ${generic} is nonzero, instead
+ * of the ones unrolled for r = 1, 8 and 16; for comparing them.
+ */
+void crypto_scrypt_set_generic(int);
+
+/* Settings of the smix kernels, see crypto_scrypt_set_tuning. */
+struct crypto_scrypt_tuning {
+	const char * kernel;	/* Name of the smix kernel, or NULL. */
+	size_t interleave;	/* Lanes crypto_scrypt_multi mixes at once;
+				   1 by default. */
+	int prefetch;		/* crypto_scrypt_multi prefetches V_j. */
+	int hugepages;		/* Mapped V uses transparent huge pages. */
+};
+
+/**
+ * crypto_scrypt_kernels(names, max):
+ * Store the names of up to ${max} smix kernels which this CPU supports in
+ * ${names}, fastest first, and return how many there are.
+ */
+size_t crypto_scrypt_kernels(const char **, size_t);
+
+/**
+ * crypto_scrypt_set_tuning(tuning):
+ * Use the smix kernel ${tuning}->kernel in place of the fastest one which
+ * works, or that one again if it is NULL, and the other settings of
+ * ${tuning}.  Derivations in progress finish with the kernel they started
+ * with.
+ *
+ * Return 0 on success; or -1 if the kernel does not work on this CPU, the
+ * interleave is not between 1 and CRYPTO_SCRYPT_SMIX_MULTI, or huge pages
+ * are not supported.
+ */
+int crypto_scrypt_set_tuning(const struct crypto_scrypt_tuning *);
+
+/**
+ * crypto_scrypt_get_tuning(tuning):
+ * Store the settings in use in ${tuning}, with the kernel that was selected.
+ */
+void crypto_scrypt_get_tuning(struct crypto_scrypt_tuning *);
+
+/**
+ * crypto_scrypt_set_arena(V, len):
+ * Use the ${len} bytes at ${V} as V for the derivations of the calling thread
+ * which fit into them, e.g. memory which the thread allocated on its own NUMA
+ * node.  Pass NULL to stop doing so.
+ */
+void crypto_scrypt_set_arena(void *, size_t);
+
+/**
+ * crypto_scrypt_set_observer(begin, end):
+ * Call ${begin} when any derivation except those of crypto_scrypt_state_new
+ * starts, and ${end} with N, r, p, the timings and 0 or the errno of the
+ * failure when it ends.  The kernel of the timings is NULL if the
+ * derivation failed before it was chosen; those of crypto_scrypt_lanes_new
+ * have only the total time.  Pass NULL to stop.  Derivations running
+ * when it is set are not observed.
+ */
+void crypto_scrypt_set_observer(void (*)(void), void (*)(uint64_t, uint32_t,
+    uint32_t, const struct crypto_scrypt_timing *, int));
+
 #endif /* !_CRYPTO_SCRYPT_H_ */
@@ -0,0 +1,194 @@
+#include "scrypt_platform.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "crypto_scrypt_perf.h"
+
+#define PERF_NEVENTS	5
+
+/* Counter group of one thread. */
+struct perf_thread {
+	int fd[PERF_NEVENTS];	/* -1 if the event could not be opened. */
+	int n;			/* Number of events in the group. */
+	int slot[PERF_NEVENTS];	/* Position of the event in a group read. */
+};
+
+static int perf_on = 0;
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+static int perf_keyok = 0;
+
+/* Marks threads for which perf_event_open failed. */
+static struct perf_thread perf_none;
+
+/* Close the counters of an exiting thread. */
+static void
+perf_thread_free(void * cookie)
+{
+	struct perf_thread * t = cookie;
+	int i;
+
+	if (t == &perf_none)
+		return;
+	for (i = PERF_NEVENTS - 1; i >= 0; i--) {
+		if (t->fd[i] != -1)
+			close(t->fd[i]);
+	}
+	free(t);
+}
+
+static void
+perf_init(void)
+{
+
+	perf_keyok = (pthread_key_create(&perf_key, perf_thread_free) == 0);
+}
+
+/**
+ * crypto_scrypt_perf_enable(on):
+ * Turn reading the hardware counters on or off for all threads.
+ */
+void
+crypto_scrypt_perf_enable(int on)
+{
+
+	perf_on = on;
+}
+
+/**
+ * crypto_scrypt_perf_enabled(void):
+ * Return nonzero if the counters are to be read.
+ */
+int
+crypto_scrypt_perf_enabled(void)
+{
+
+	return (perf_on);
+}
+
+#ifdef __linux__
+/* The events, in the order of struct crypto_scrypt_perf_counts. */
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_NEVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+};
+
+/* Open the counter group of the calling thread, led by the cycle counter. */
+static struct perf_thread *
+perf_open(void)
+{
+	struct perf_event_attr attr;
+	struct perf_thread * t;
+	int i;
+
+	if ((t = malloc(sizeof(struct perf_thread))) == NULL)
+		return (NULL);
+	t->n = 0;
+	for (i = 0; i < PERF_NEVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		t->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+		    (i == 0) ? -1 : t->fd[0], PERF_FLAG_FD_CLOEXEC);
+		if (t->fd[i] == -1) {
+			/* Without the leader there is no group. */
+			if (i == 0) {
+				free(t);
+				return (NULL);
+			}
+			t->slot[i] = -1;
+			continue;
+		}
+		t->slot[i] = t->n++;
+	}
+
+	return (t);
+}
+#endif
+
+/**
+ * crypto_scrypt_perf_read(counts):
+ * Read the counters of the calling thread into ${counts}, opening them on
+ * first use.  Return 0 on success; or -1 if perf_event_open is not available
+ * to this thread, e.g. because of perf_event_paranoid or a seccomp policy,
+ * in which case it is not tried again by this thread.
+ */
+int
+crypto_scrypt_perf_read(struct crypto_scrypt_perf_counts * counts)
+{
+#ifdef __linux__
+	struct perf_thread * t;
+	uint64_t buf[1 + PERF_NEVENTS];
+	uint64_t v[PERF_NEVENTS];
+	int i;
+
+	memset(counts, 0, sizeof(*counts));
+	pthread_once(&perf_once, perf_init);
+	if (!perf_keyok)
+		return (-1);
+	if ((t = pthread_getspecific(perf_key)) == NULL) {
+		if ((t = perf_open()) == NULL)
+			t = &perf_none;
+		pthread_setspecific(perf_key, t);
+	}
+	if (t == &perf_none)
+		return (-1);
+
+	/* A group read returns the number of events and their values. */
+	if (read(t->fd[0], buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) *
+	    (1 + t->n)))
+		return (-1);
+	for (i = 0; i < PERF_NEVENTS; i++)
+		v[i] = (t->slot[i] == -1) ? 0 : buf[1 + t->slot[i]];
+	counts->cycles = v[0];
+	counts->instructions = v[1];
+	counts->cache_misses = v[2];
+	counts->dtlb_misses = v[3];
+	counts->stalls = v[4];
+
+	return (0);
+#else
+	memset(counts, 0, sizeof(*counts));
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+/**
+ * crypto_scrypt_perf_add(sum, start, end):
+ * Add the counts between the readings ${start} and ${end} to ${sum}.
+ */
+void
+crypto_scrypt_perf_add(struct crypto_scrypt_perf_counts * sum,
+    const struct crypto_scrypt_perf_counts * start,
+    const struct crypto_scrypt_perf_counts * end)
+{
+
+	sum->cycles += end->cycles - start->cycles;
+	sum->instructions += end->instructions - start->instructions;
+	sum->cache_misses += end->cache_misses - start->cache_misses;
+	sum->dtlb_misses += end->dtlb_misses - start->dtlb_misses;
+	sum->stalls += end->stalls - start->stalls;
+}
@@ -0,0 +1,44 @@
+#ifndef _CRYPTO_SCRYPT_PERF_H_
+#define _CRYPTO_SCRYPT_PERF_H_
+
+#include <stdint.h>
+
+/* Hardware counters of the calling thread; 0 where not available. */
+struct crypto_scrypt_perf_counts {
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t cache_misses;	/* Last level cache. */
+	uint64_t dtlb_misses;	/* dTLB load misses. */
+	uint64_t stalls;	/* Cycles stalled in the back end. */
+};
+
+/**
+ * crypto_scrypt_perf_enable(on):
+ * Turn reading the hardware counters on or off for all threads.
+ */
+void crypto_scrypt_perf_enable(int);
+
+/**
+ * crypto_scrypt_perf_enabled(void):
+ * Return nonzero if the counters are to be read.
+ */
+int crypto_scrypt_perf_enabled(void);
+
+/**
+ * crypto_scrypt_perf_read(counts):
+ * Read the counters of the calling thread into ${counts}, opening them on
+ * first use.  Return 0 on success; or -1 if perf_event_open is not available
+ * to this thread, e.g. because of perf_event_paranoid or a seccomp policy,
+ * in which case it is not tried again by this thread.
+ */
+int crypto_scrypt_perf_read(struct crypto_scrypt_perf_counts *);
+
+/**
+ * crypto_scrypt_perf_add(sum, start, end):
+ * Add the counts between the readings ${start} and ${end} to ${sum}.
+ */
+void crypto_scrypt_perf_add(struct crypto_scrypt_perf_counts *,
+    const struct crypto_scrypt_perf_counts *,
+    const struct crypto_scrypt_perf_counts *);
+
+#endif /* !_CRYPTO_SCRYPT_PERF_H_ */
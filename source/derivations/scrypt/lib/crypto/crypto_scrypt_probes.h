@@ -0,0 +1,37 @@
+#ifndef _CRYPTO_SCRYPT_PROBES_H_
+#define _CRYPTO_SCRYPT_PROBES_H_
+
+/*
+ * USDT probes of the provider "scrypt", for example
+ *   bpftrace -e 'usdt:/usr/lib/libscrypt.so:scrypt:derive_done { ... }'
+ *
+ * derive_start(N, r, p, k)	A derivation starts; V holds every k-th block.
+ * derive_done(N, r, p, errno)	It ended; errno is 0 on success.
+ * kernel(name)			The smix kernel was selected.
+ * v_alloc(len, how)		V of len bytes came from how, e.g. "mmap".
+ * v_free(len, how)		V was released.
+ * parse(format, status)	A hash string was parsed.
+ * verify(format, status)	A password was checked against a hash string.
+ *
+ * A probe is a single nop while nothing is attached.  Without <sys/sdt.h>,
+ * or with CRYPTO_SCRYPT_NO_PROBES defined, the probes compile to nothing.
+ */
+#if defined(__has_include) && !defined(CRYPTO_SCRYPT_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CRYPTO_SCRYPT_HAVE_PROBES
+#endif
+#endif
+
+#ifdef CRYPTO_SCRYPT_HAVE_PROBES
+#define CRYPTO_SCRYPT_PROBE1(name, a)	DTRACE_PROBE1(scrypt, name, a)
+#define CRYPTO_SCRYPT_PROBE2(name, a, b)	DTRACE_PROBE2(scrypt, name, a, b)
+#define CRYPTO_SCRYPT_PROBE4(name, a, b, c, d)				\
+	DTRACE_PROBE4(scrypt, name, a, b, c, d)
+#else
+#define CRYPTO_SCRYPT_PROBE1(name, a)	do { } while (0)
+#define CRYPTO_SCRYPT_PROBE2(name, a, b)	do { } while (0)
+#define CRYPTO_SCRYPT_PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif /* !_CRYPTO_SCRYPT_PROBES_H_ */
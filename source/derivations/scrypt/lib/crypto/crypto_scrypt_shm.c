@@ -0,0 +1,354 @@
+#include "scrypt_platform.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto_scrypt_shm.h"
+
+#define SHM_MAGIC	0x73637279	/* "scry" */
+#define SHM_MAXLEASES	1024
+#define SHM_MAXSLABS	1024
+#define SHM_PAGE	4096
+
+/* A derivation holding a slab or part of the budget. */
+struct shm_lease {
+	pid_t pid;		/* 0 if the entry is free. */
+	int slab;		/* Slab number, or -1 for budget. */
+	uint64_t len;
+};
+
+/* Start of the segment; the slabs follow at slaboff. */
+struct shm_header {
+	uint32_t magic;		/* Set last by the creator. */
+	pthread_mutex_t mtx;	/* Process-shared and robust. */
+	pthread_cond_t cv;	/* Signalled when a lease is released. */
+	uint64_t budget;
+	uint64_t used;
+	uint64_t nslabs;
+	uint64_t slablen;
+	uint64_t slaboff;
+	uint64_t seglen;
+	uint8_t slabinuse[SHM_MAXSLABS];
+	struct shm_lease leases[SHM_MAXLEASES];
+};
+
+static struct shm_header * shm = NULL;
+static size_t shm_len = 0;
+
+/* Round ${len} up to whole pages. */
+static uint64_t
+shm_pages(uint64_t len)
+{
+
+	return ((len + SHM_PAGE - 1) & ~(uint64_t)(SHM_PAGE - 1));
+}
+
+/* Initialize a segment which we have just created and sized. */
+static int
+shm_create(struct shm_header * h, size_t budget, size_t nslabs,
+    size_t slablen)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+
+	if (pthread_mutexattr_init(&mattr))
+		goto err0;
+	if (pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST) ||
+	    pthread_mutex_init(&h->mtx, &mattr))
+		goto err1;
+	if (pthread_condattr_init(&cattr))
+		goto err1;
+	if (pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_cond_init(&h->cv, &cattr))
+		goto err2;
+	pthread_condattr_destroy(&cattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	h->budget = budget;
+	h->used = 0;
+	h->nslabs = nslabs;
+	h->slablen = slablen;
+	h->slaboff = shm_pages(sizeof(struct shm_header));
+
+	/* Publish the segment. */
+	__atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	/* Success! */
+	return (0);
+
+err2:
+	pthread_condattr_destroy(&cattr);
+err1:
+	pthread_mutexattr_destroy(&mattr);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_scrypt_shm_open(name, budget, nslabs, slablen):
+ * Attach to the POSIX shared memory segment ${name} which coordinates the V
+ * memory of all processes on the host, creating it if it does not exist.  A
+ * new segment allows ${budget} bytes of V to be mapped on demand at any time,
+ * host-wide, and holds ${nslabs} pre-faulted slabs of ${slablen} bytes which
+ * are leased to derivations in any process.  The parameters are ignored when
+ * attaching to an existing segment.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt_shm_open(const char * name, size_t budget, size_t nslabs,
+    size_t slablen)
+{
+	struct stat sb;
+	void * seg;
+	uint64_t seglen;
+	int fd;
+	int creator = 1;
+	int mapflags = MAP_SHARED;
+	int i;
+
+#ifdef MAP_POPULATE
+	/* Fault in the slabs now rather than inside derivations. */
+	mapflags |= MAP_POPULATE;
+#endif
+
+	crypto_scrypt_shm_close();
+	if (nslabs > SHM_MAXSLABS) {
+		errno = EINVAL;
+		goto err0;
+	}
+	slablen = shm_pages(slablen);
+
+	/* Create the segment, or open the one another process created. */
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+		if ((errno != EEXIST) ||
+		    ((fd = shm_open(name, O_RDWR, 0)) == -1))
+			goto err0;
+		creator = 0;
+	}
+
+	if (creator) {
+		seglen = shm_pages(sizeof(struct shm_header)) +
+		    (uint64_t)nslabs * slablen;
+		if (ftruncate(fd, (off_t)seglen))
+			goto err2;
+	} else {
+		/* Wait for the creator to size the segment. */
+		for (i = 0; i < 1000; i++) {
+			if (fstat(fd, &sb))
+				goto err1;
+			if ((uint64_t)sb.st_size >= sizeof(struct shm_header))
+				break;
+			usleep(1000);
+		}
+		seglen = (uint64_t)sb.st_size;
+		if (seglen < sizeof(struct shm_header)) {
+			errno = ETIMEDOUT;
+			goto err1;
+		}
+	}
+
+	if ((seg = mmap(NULL, seglen, PROT_READ | PROT_WRITE, mapflags,
+	    fd, 0)) == MAP_FAILED)
+		goto err2;
+	close(fd);
+	shm = seg;
+	shm_len = seglen;
+
+	if (creator) {
+		shm->seglen = seglen;
+		if (shm_create(shm, budget, nslabs, slablen))
+			goto err3;
+	} else {
+		/* Wait for the creator to initialize the segment. */
+		for (i = 0; i < 1000; i++) {
+			if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) ==
+			    SHM_MAGIC)
+				break;
+			usleep(1000);
+		}
+		if ((shm->magic != SHM_MAGIC) || (shm->seglen != seglen)) {
+			errno = EINVAL;
+			goto err3;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err3:
+	munmap(seg, seglen);
+	shm = NULL;
+	shm_len = 0;
+	if (creator)
+		shm_unlink(name);
+
+	/* Failure! */
+	return (-1);
+
+err2:
+	if (creator)
+		shm_unlink(name);
+err1:
+	close(fd);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Lock the segment, recovering from a holder which died. */
+static int
+shm_lock(void)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_lock(&shm->mtx)) == EOWNERDEAD)
+		rc = pthread_mutex_consistent(&shm->mtx);
+
+	return (rc);
+}
+
+/* Release the lease ${i}; the caller holds the lock. */
+static void
+shm_drop(int i)
+{
+	struct shm_lease * l = &shm->leases[i];
+
+	if (l->slab >= 0)
+		shm->slabinuse[l->slab] = 0;
+	else
+		shm->used -= l->len;
+	l->pid = 0;
+	pthread_cond_broadcast(&shm->cv);
+}
+
+/* Release the leases of processes which exited without doing so. */
+static void
+shm_reclaim(void)
+{
+	int i;
+
+	for (i = 0; i < SHM_MAXLEASES; i++) {
+		if ((shm->leases[i].pid != 0) &&
+		    (kill(shm->leases[i].pid, 0) == -1) && (errno == ESRCH))
+			shm_drop(i);
+	}
+}
+
+/**
+ * crypto_scrypt_shm_lease(len, V):
+ * Reserve ${len} bytes of V.  If a slab of at least ${len} bytes is free,
+ * lease it and return it via ${V}; otherwise take ${len} bytes from the
+ * budget, waiting until other derivations release enough, and set ${V} to
+ * NULL so that the caller maps the memory itself.  Return a lease number for
+ * crypto_scrypt_shm_release; CRYPTO_SCRYPT_SHM_NONE if no segment is attached;
+ * or -1 on error.
+ */
+int
+crypto_scrypt_shm_lease(size_t len, void ** V)
+{
+	struct timespec ts;
+	uint64_t s;
+	int i, slot;
+
+	if (shm == NULL)
+		return (CRYPTO_SCRYPT_SHM_NONE);
+
+	/* Requests which can never be satisfied fail right away. */
+	if ((len > shm->budget) && ((len > shm->slablen) ||
+	    (shm->nslabs == 0))) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	if ((errno = shm_lock()) != 0)
+		return (-1);
+	do {
+		shm_reclaim();
+
+		/* Find a free lease entry. */
+		for (slot = 0; slot < SHM_MAXLEASES; slot++)
+			if (shm->leases[slot].pid == 0)
+				break;
+
+		if (slot < SHM_MAXLEASES) {
+			/* Prefer a pre-faulted slab... */
+			for (s = 0; (len <= shm->slablen) &&
+			    (s < shm->nslabs); s++) {
+				if (shm->slabinuse[s])
+					continue;
+				shm->slabinuse[s] = 1;
+				shm->leases[slot].slab = (int)s;
+				*V = (uint8_t *)shm + shm->slaboff +
+				    s * shm->slablen;
+				goto leased;
+			}
+
+			/* ... otherwise take memory from the budget. */
+			if (shm->used + len <= shm->budget) {
+				shm->used += len;
+				shm->leases[slot].slab = -1;
+				*V = NULL;
+				goto leased;
+			}
+		}
+
+		/* Wait, but look for dead lease holders now and then. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000;
+		}
+		i = pthread_cond_timedwait(&shm->cv, &shm->mtx, &ts);
+		if (i == EOWNERDEAD)
+			pthread_mutex_consistent(&shm->mtx);
+	} while (1);
+
+leased:
+	shm->leases[slot].len = len;
+	shm->leases[slot].pid = getpid();
+	pthread_mutex_unlock(&shm->mtx);
+
+	return (slot);
+}
+
+/**
+ * crypto_scrypt_shm_release(lease):
+ * Return the slab or budget reserved by crypto_scrypt_shm_lease.
+ */
+void
+crypto_scrypt_shm_release(int lease)
+{
+
+	if ((shm == NULL) || (lease < 0) || shm_lock())
+		return;
+	shm_drop(lease);
+	pthread_mutex_unlock(&shm->mtx);
+}
+
+/**
+ * crypto_scrypt_shm_close(void):
+ * Detach from the segment.  No lease may be held at this time.
+ */
+void
+crypto_scrypt_shm_close(void)
+{
+
+	if (shm == NULL)
+		return;
+	munmap(shm, shm_len);
+	shm = NULL;
+	shm_len = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _CRYPTO_SCRYPT_SHM_H_
+#define _CRYPTO_SCRYPT_SHM_H_
+
+#include <stddef.h>
+
+/**
+ * crypto_scrypt_shm_open(name, budget, nslabs, slablen):
+ * Attach to the POSIX shared memory segment ${name} which coordinates the V
+ * memory of all processes on the host, creating it if it does not exist.  A
+ * new segment allows ${budget} bytes of V to be mapped on demand at any time,
+ * host-wide, and holds ${nslabs} pre-faulted slabs of ${slablen} bytes which
+ * are leased to derivations in any process.  The parameters are ignored when
+ * attaching to an existing segment.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int crypto_scrypt_shm_open(const char *, size_t, size_t, size_t);
+
+/**
+ * crypto_scrypt_shm_lease(len, V):
+ * Reserve ${len} bytes of V.  If a slab of at least ${len} bytes is free,
+ * lease it and return it via ${V}; otherwise take ${len} bytes from the
+ * budget, waiting until other derivations release enough, and set ${V} to
+ * NULL so that the caller maps the memory itself.  Return a lease number for
+ * crypto_scrypt_shm_release; CRYPTO_SCRYPT_SHM_NONE if no segment is attached;
+ * or -1 on error.
+ */
+#define CRYPTO_SCRYPT_SHM_NONE	(-2)
+int crypto_scrypt_shm_lease(size_t, void **);
+
+/**
+ * crypto_scrypt_shm_release(lease):
+ * Return the slab or budget reserved by crypto_scrypt_shm_lease.
+ */
+void crypto_scrypt_shm_release(int);
+
+/**
+ * crypto_scrypt_shm_close(void):
+ * Detach from the segment.  No lease may be held at this time.
+ */
+void crypto_scrypt_shm_close(void);
+
+#endif /* !_CRYPTO_SCRYPT_SHM_H_ */
@@ -26,7 +26,9 @@
  * This file was originally written by Colin Percival as part of the Tarsnap
  * online backup system.
  */
+#include <errno.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "sysendian.h"
 
@@ -41,9 +43,9 @@ static uint64_t integerify(const void *, size_t);
 static void
 blkcpy(void * dest, const void * src, size_t len)
 {
-	size_t * D = dest;
-	const size_t * S = src;
-	size_t L = len / sizeof(size_t);
+	uint32_t * D = dest;
+	const uint32_t * S = src;
+	size_t L = len / sizeof(uint32_t);
 	size_t i;
 
 	for (i = 0; i < L; i++)
@@ -53,9 +55,9 @@ blkcpy(void * dest, const void * src, size_t len)
 static void
 blkxor(void * dest, const void * src, size_t len)
 {
-	size_t * D = dest;
-	const size_t * S = src;
-	size_t L = len / sizeof(size_t);
+	uint32_t * D = dest;
+	const uint32_t * S = src;
+	size_t L = len / sizeof(uint32_t);
 	size_t i;
 
 	for (i = 0; i < L; i++)
@@ -153,15 +155,37 @@ integerify(const void * B, size_t r)
 }
 
 /**
- * crypto_scrypt_smix(B, r, N, V, XY):
+ * crypto_scrypt_smix_stop(ctl):
+ * Return nonzero and set ${ctl}->stopped to ECANCELED or ETIMEDOUT if the
+ * computation should be abandoned.
+ */
+int
+crypto_scrypt_smix_stop(struct crypto_scrypt_smix_ctl * ctl)
+{
+	struct timespec ts;
+
+	if ((ctl->cancel != NULL) && *ctl->cancel)
+		ctl->stopped = ECANCELED;
+	else if ((ctl->deadline != 0) &&
+	    (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) &&
+	    ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec >=
+	    ctl->deadline))
+		ctl->stopped = ETIMEDOUT;
+
+	return (ctl->stopped);
+}
+
+/**
+ * crypto_scrypt_smix(B, r, N, V, XY, ctl):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length;
  * the temporary storage V must be 128rN bytes in length; the temporary
  * storage XY must be 256r + 64 bytes in length.  The value N must be a
  * power of 2 greater than 1.  The arrays B, V, and XY must be aligned to a
- * multiple of 64 bytes.
+ * multiple of 64 bytes.  The hooks ${ctl} may be NULL.
  */
 void
-crypto_scrypt_smix(uint8_t * B, size_t r, uint64_t N, void * _V, void * XY)
+crypto_scrypt_smix(uint8_t * B, size_t r, uint64_t N, void * _V, void * XY,
+    struct crypto_scrypt_smix_ctl * ctl)
 {
 	uint32_t * X = XY;
 	uint32_t * Y = (void *)((uint8_t *)(XY) + 128 * r);
@@ -176,7 +200,12 @@ crypto_scrypt_smix(uint8_t * B, size_t r, uint64_t N, void * _V, void * XY)
 		X[k] = le32dec(&B[4 * k]);
 
 	/* 2: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP1);
 	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
 		/* 3: V_i <-- X */
 		blkcpy(&V[i * (32 * r)], X, 128 * r);
 
@@ -191,7 +220,12 @@ crypto_scrypt_smix(uint8_t * B, size_t r, uint64_t N, void * _V, void * XY)
 	}
 
 	/* 6: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP2);
 	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
 		/* 7: j <-- Integerify(X) mod N */
 		j = integerify(X, r) & (N - 1);
 
@@ -208,6 +242,551 @@ crypto_scrypt_smix(uint8_t * B, size_t r, uint64_t N, void * _V, void * XY)
 	}
 
 	/* 10: B' <-- X */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_DONE);
 	for (k = 0; k < 32 * r; k++)
 		le32enc(&B[4 * k], X[k]);
 }
+
+#ifdef CRYPTO_SCRYPT_SMIX_FIXED
+/*
+ * Four words of a block.  The words of each block are permuted as by
+ * crypto_scrypt_smix_sse2, so that salsa20_8_v computes the columns and the
+ * rows four at a time.
+ */
+typedef uint32_t smix_v __attribute__((vector_size(16), aligned(16)));
+
+#ifdef __clang__
+#define SHUFFLE(v, a, b, c, d)	__builtin_shufflevector(v, v, a, b, c, d)
+#define UNROLL			_Pragma("unroll")
+#else
+#define SHUFFLE(v, a, b, c, d)	__builtin_shuffle(v, (smix_v){ a, b, c, d })
+#if __GNUC__ >= 8
+#define UNROLL			_Pragma("GCC unroll 32")
+#else
+#define UNROLL
+#endif
+#endif
+
+/**
+ * salsa20_8_v(X):
+ * Apply the salsa20/8 core to the permuted block ${X}.
+ */
+static inline __attribute__((always_inline)) void
+salsa20_8_v(smix_v X[4])
+{
+	smix_v X0 = X[0], X1 = X[1], X2 = X[2], X3 = X[3];
+	smix_v T;
+	size_t i;
+
+	for (i = 0; i < 8; i += 2) {
+#define R(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
+		/* Operate on "columns". */
+		T = X0 + X3;
+		X1 ^= R(T, 7);
+		T = X1 + X0;
+		X2 ^= R(T, 9);
+		T = X2 + X1;
+		X3 ^= R(T, 13);
+		T = X3 + X2;
+		X0 ^= R(T, 18);
+
+		/* Rearrange data. */
+		X1 = SHUFFLE(X1, 3, 0, 1, 2);
+		X2 = SHUFFLE(X2, 2, 3, 0, 1);
+		X3 = SHUFFLE(X3, 1, 2, 3, 0);
+
+		/* Operate on "rows". */
+		T = X0 + X1;
+		X3 ^= R(T, 7);
+		T = X3 + X0;
+		X2 ^= R(T, 9);
+		T = X2 + X3;
+		X1 ^= R(T, 13);
+		T = X1 + X2;
+		X0 ^= R(T, 18);
+
+		/* Rearrange data. */
+		X1 = SHUFFLE(X1, 1, 2, 3, 0);
+		X2 = SHUFFLE(X2, 2, 3, 0, 1);
+		X3 = SHUFFLE(X3, 3, 0, 1, 2);
+#undef R
+	}
+
+	X[0] += X0;
+	X[1] += X1;
+	X[2] += X2;
+	X[3] += X3;
+}
+
+/*
+ * SMIX_FIXED(R):
+ * Define crypto_scrypt_smix_R, which is crypto_scrypt_smix for r = R.  With
+ * r known at compile time the loop of BlockMix is unrolled, X stays in vector
+ * registers from one salsa20/8 core to the next, and the second loop XORs V_j
+ * into BlockMix as it reads it instead of into X first.
+ */
+#define SMIX_FIXED(R)							\
+static void								\
+blockmix_salsa8_##R(const smix_v * Bin, const smix_v * Bxor,		\
+    smix_v * Bout)							\
+{									\
+	smix_v X[4];							\
+	size_t i, k;							\
+									\
+	/* 1: X <-- B_{2r - 1} */					\
+	for (k = 0; k < 4; k++)						\
+		X[k] = Bin[8 * R - 4 + k];				\
+	if (Bxor != NULL) {						\
+		for (k = 0; k < 4; k++)					\
+			X[k] ^= Bxor[8 * R - 4 + k];			\
+	}								\
+									\
+	/* 2: for i = 0 to 2r - 1 do */					\
+	UNROLL								\
+	for (i = 0; i < R; i++) {					\
+		/* 3: X <-- H(X \xor B_i) */				\
+		for (k = 0; k < 4; k++)					\
+			X[k] ^= Bin[i * 8 + k];				\
+		if (Bxor != NULL) {					\
+			for (k = 0; k < 4; k++)				\
+				X[k] ^= Bxor[i * 8 + k];		\
+		}							\
+		salsa20_8_v(X);						\
+									\
+		/* 4: Y_i <-- X */					\
+		for (k = 0; k < 4; k++)					\
+			Bout[i * 4 + k] = X[k];				\
+									\
+		/* 3: X <-- H(X \xor B_i) */				\
+		for (k = 0; k < 4; k++)					\
+			X[k] ^= Bin[i * 8 + 4 + k];			\
+		if (Bxor != NULL) {					\
+			for (k = 0; k < 4; k++)				\
+				X[k] ^= Bxor[i * 8 + 4 + k];		\
+		}							\
+		salsa20_8_v(X);						\
+									\
+		/* 4: Y_i <-- X */					\
+		for (k = 0; k < 4; k++)					\
+			Bout[(R + i) * 4 + k] = X[k];			\
+	}								\
+}									\
+									\
+void									\
+crypto_scrypt_smix_##R(uint8_t * B, size_t r, uint64_t N, void * _V,	\
+    void * XY, struct crypto_scrypt_smix_ctl * ctl)			\
+{									\
+	smix_v * X = XY;						\
+	smix_v * Y = (void *)((uint8_t *)(XY) + 128 * R);		\
+	smix_v * V = _V;						\
+	uint32_t * X32 = XY;						\
+	uint32_t * Y32 = (void *)Y;					\
+	uint64_t i;							\
+	uint64_t j;							\
+	size_t k;							\
+									\
+	(void)r;							\
+									\
+	/* 1: X <-- B */						\
+	for (k = 0; k < 2 * R; k++) {					\
+		for (i = 0; i < 16; i++) {				\
+			X32[k * 16 + i] =				\
+			    le32dec(&B[(k * 16 + (i * 5 % 16)) * 4]);	\
+		}							\
+	}								\
+									\
+	/* 2: for i = 0 to N - 1 do */					\
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP1);	\
+	for (i = 0; i < N; i += 2) {					\
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))			\
+			return;						\
+									\
+		/* 3: V_i <-- X; 4: X <-- H(X) */			\
+		for (k = 0; k < 8 * R; k++)				\
+			V[i * 8 * R + k] = X[k];			\
+		blockmix_salsa8_##R(X, NULL, Y);			\
+		for (k = 0; k < 8 * R; k++)				\
+			V[(i + 1) * 8 * R + k] = Y[k];			\
+		blockmix_salsa8_##R(Y, NULL, X);			\
+	}								\
+									\
+	/* 6: for i = 0 to N - 1 do */					\
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP2);	\
+	for (i = 0; i < N; i += 2) {					\
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))			\
+			return;						\
+									\
+		/* 7: j <-- Integerify(X) mod N, in permuted order */	\
+		j = (((uint64_t)(X32[(2 * R - 1) * 16 + 13]) << 32) +	\
+		    X32[(2 * R - 1) * 16]) & (N - 1);			\
+									\
+		/* 8: X <-- H(X \xor V_j) */				\
+		blockmix_salsa8_##R(X, &V[j * 8 * R], Y);		\
+									\
+		/* 7: j <-- Integerify(X) mod N, in permuted order */	\
+		j = (((uint64_t)(Y32[(2 * R - 1) * 16 + 13]) << 32) +	\
+		    Y32[(2 * R - 1) * 16]) & (N - 1);			\
+									\
+		/* 8: X <-- H(X \xor V_j) */				\
+		blockmix_salsa8_##R(Y, &V[j * 8 * R], X);		\
+	}								\
+									\
+	/* 10: B' <-- X */						\
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_DONE);		\
+	for (k = 0; k < 2 * R; k++) {					\
+		for (i = 0; i < 16; i++) {				\
+			le32enc(&B[(k * 16 + (i * 5 % 16)) * 4],	\
+			    X32[k * 16 + i]);				\
+		}							\
+	}								\
+}
+
+SMIX_FIXED(1)
+SMIX_FIXED(8)
+SMIX_FIXED(16)
+#endif /* CRYPTO_SCRYPT_SMIX_FIXED */
+
+/**
+ * crypto_scrypt_smix_slice(B, r, N, V, XY, pos, n):
+ * Perform the next ${n} (rounded up to an even number) of the 2N iterations
+ * of SMix_r(B, N), starting at iteration *${pos}, and advance *${pos}.  X
+ * is kept in XY between calls; B is read when *${pos} is 0 and B' written
+ * after the last iteration.  The buffers are as for crypto_scrypt_smix.
+ * Return 1 if B' was written; or 0 if iterations remain.
+ */
+int
+crypto_scrypt_smix_slice(uint8_t * B, size_t r, uint64_t N, void * _V,
+    void * XY, uint64_t * pos, uint64_t n)
+{
+	uint32_t * X = XY;
+	uint32_t * Y = (void *)((uint8_t *)(XY) + 128 * r);
+	uint32_t * Z = (void *)((uint8_t *)(XY) + 256 * r);
+	uint32_t * V = _V;
+	uint64_t i = *pos;
+	uint64_t end;
+	uint64_t j;
+	size_t k;
+
+	/* Iterations are done in pairs. */
+	n = (n < 2) ? 2 : ((n + 1) & ~(uint64_t)(1));
+	end = (2 * N - i > n) ? i + n : 2 * N;
+
+	/* 1: X <-- B */
+	if (i == 0) {
+		for (k = 0; k < 32 * r; k++)
+			X[k] = le32dec(&B[4 * k]);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (; (i < N) && (i < end); i += 2) {
+		/* 3: V_i <-- X */
+		blkcpy(&V[i * (32 * r)], X, 128 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 3: V_i <-- X */
+		blkcpy(&V[(i + 1) * (32 * r)], Y, 128 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (; i < end; i += 2) {
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(X, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(X, &V[j * (32 * r)], 128 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(Y, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(Y, &V[j * (32 * r)], 128 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	*pos = i;
+	if (i < 2 * N)
+		return (0);
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 32 * r; k++)
+		le32enc(&B[4 * k], X[k]);
+
+	return (1);
+}
+
+/**
+ * prefetch(p, len):
+ * Hint that the ${len} bytes at ${p} will be read soon.
+ */
+static void
+prefetch(const void * p, size_t len)
+{
+#ifdef __GNUC__
+	size_t i;
+
+	for (i = 0; i < len; i += 64)
+		__builtin_prefetch((const uint8_t *)(p) + i);
+#else
+	(void)p;
+	(void)len;
+#endif
+}
+
+/**
+ * crypto_scrypt_smix_multi(B, n, r, N, V, XY, pf):
+ * Compute B[l] = SMix_r(B[l], N) for the ${n} lanes l < ${n}, at most
+ * CRYPTO_SCRYPT_SMIX_MULTI, with the buffers V[l] and XY[l] as for
+ * crypto_scrypt_smix.  The lanes are computed in step, so that the reads of
+ * V_j by the second loop of all lanes are in flight at the same time, and
+ * if ${pf} is nonzero they are requested by prefetch instructions.
+ */
+void
+crypto_scrypt_smix_multi(uint8_t ** B, size_t n, size_t r, uint64_t N,
+    void ** _V, void ** XY, int pf)
+{
+	uint32_t * X[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint32_t * Y[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint32_t * Z[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint32_t * V[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint64_t j[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint64_t i;
+	size_t k, l;
+
+	/* 1: X <-- B */
+	for (l = 0; l < n; l++) {
+		X[l] = XY[l];
+		Y[l] = (void *)((uint8_t *)(XY[l]) + 128 * r);
+		Z[l] = (void *)((uint8_t *)(XY[l]) + 256 * r);
+		V[l] = _V[l];
+		for (k = 0; k < 32 * r; k++)
+			X[l][k] = le32dec(&B[l][4 * k]);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		for (l = 0; l < n; l++) {
+			/* 3: V_i <-- X */
+			blkcpy(&V[l][i * (32 * r)], X[l], 128 * r);
+
+			/* 4: X <-- H(X) */
+			blockmix_salsa8(X[l], Y[l], Z[l], r);
+
+			/* 3: V_i <-- X */
+			blkcpy(&V[l][(i + 1) * (32 * r)], Y[l], 128 * r);
+
+			/* 4: X <-- H(X) */
+			blockmix_salsa8(Y[l], X[l], Z[l], r);
+		}
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 7: j <-- Integerify(X) mod N, for all lanes first */
+		for (l = 0; l < n; l++) {
+			j[l] = integerify(X[l], r) & (N - 1);
+			if (pf)
+				prefetch(&V[l][j[l] * (32 * r)], 128 * r);
+		}
+
+		/* 8: X <-- H(X \xor V_j) */
+		for (l = 0; l < n; l++) {
+			blkxor(X[l], &V[l][j[l] * (32 * r)], 128 * r);
+			blockmix_salsa8(X[l], Y[l], Z[l], r);
+			j[l] = integerify(Y[l], r) & (N - 1);
+			if (pf)
+				prefetch(&V[l][j[l] * (32 * r)], 128 * r);
+		}
+
+		/* 8: X <-- H(X \xor V_j) */
+		for (l = 0; l < n; l++) {
+			blkxor(Y[l], &V[l][j[l] * (32 * r)], 128 * r);
+			blockmix_salsa8(Y[l], X[l], Z[l], r);
+		}
+	}
+
+	/* 10: B' <-- X */
+	for (l = 0; l < n; l++) {
+		for (k = 0; k < 32 * r; k++)
+			le32enc(&B[l][4 * k], X[l][k]);
+	}
+}
+
+/**
+ * tmto_block(V, j, k, r, T, U, Z):
+ * Return V_j, given that V holds only every ${k}-th block: start from the
+ * stored block preceding it and apply H the missing number of times, using
+ * the 128r-byte buffers T and U and the 64-byte buffer Z.
+ */
+static const uint32_t *
+tmto_block(const uint32_t * V, uint64_t j, uint64_t k, size_t r,
+    uint32_t * T, uint32_t * U, uint32_t * Z)
+{
+	const uint32_t * S = &V[(j / k) * (32 * r)];
+	uint32_t * D = T;
+	uint64_t m;
+
+	for (m = j & (k - 1); m > 0; m--) {
+		blockmix_salsa8(S, D, Z, r);
+		S = D;
+		D = (D == T) ? U : T;
+	}
+
+	return (S);
+}
+
+/**
+ * crypto_scrypt_smix_tmto(B, r, N, V, XY, ctl, k):
+ * Compute B = SMix_r(B, N) like crypto_scrypt_smix, but store only every
+ * k-th V_i and recompute the others when the second loop needs them.  The
+ * temporary storage V must be 128rN/k bytes in length; the temporary storage
+ * XY must be 512r + 64 bytes in length.  The value k must be a power of 2
+ * greater than 1 and no greater than N.
+ */
+void
+crypto_scrypt_smix_tmto(uint8_t * B, size_t r, uint64_t N, void * _V,
+    void * XY, struct crypto_scrypt_smix_ctl * ctl, uint64_t k)
+{
+	uint32_t * X = XY;
+	uint32_t * Y = (void *)((uint8_t *)(XY) + 128 * r);
+	uint32_t * T = (void *)((uint8_t *)(XY) + 256 * r);
+	uint32_t * U = (void *)((uint8_t *)(XY) + 384 * r);
+	uint32_t * Z = (void *)((uint8_t *)(XY) + 512 * r);
+	uint32_t * V = _V;
+	uint64_t i;
+	uint64_t j;
+	size_t m;
+
+	/* 1: X <-- B */
+	for (m = 0; m < 32 * r; m++)
+		X[m] = le32dec(&B[4 * m]);
+
+	/* 2: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP1);
+	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
+		/* 3: V_i <-- X, for every k-th i; k is even. */
+		if ((i & (k - 1)) == 0)
+			blkcpy(&V[(i / k) * (32 * r)], X, 128 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP2);
+	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(X, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(X, tmto_block(V, j, k, r, T, U, Z), 128 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(Y, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(Y, tmto_block(V, j, k, r, T, U, Z), 128 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 10: B' <-- X */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_DONE);
+	for (m = 0; m < 32 * r; m++)
+		le32enc(&B[4 * m], X[m]);
+}
+
+/**
+ * crypto_scrypt_smix_io(B, r, N, XY, vio, ctl):
+ * Compute B = SMix_r(B, N) like crypto_scrypt_smix, but store V through
+ * ${vio} instead of in memory.  Return 0 on success; or -1 if storing or
+ * loading a block of V failed.
+ */
+int
+crypto_scrypt_smix_io(uint8_t * B, size_t r, uint64_t N, void * XY,
+    struct crypto_scrypt_smix_vio * vio, struct crypto_scrypt_smix_ctl * ctl)
+{
+	uint32_t * X = XY;
+	uint32_t * Y = (void *)((uint8_t *)(XY) + 128 * r);
+	uint32_t * Z = (void *)((uint8_t *)(XY) + 256 * r);
+	const uint32_t * W;
+	uint64_t i;
+	uint64_t j;
+	size_t k;
+
+	/* 1: X <-- B */
+	for (k = 0; k < 32 * r; k++)
+		X[k] = le32dec(&B[4 * k]);
+
+	/* 2: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP1);
+	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return (-1);
+
+		/* 3: V_i <-- X */
+		if (vio->put(vio->cookie, i, X))
+			return (-1);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 3: V_i <-- X */
+		if (vio->put(vio->cookie, i + 1, Y))
+			return (-1);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP2);
+	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return (-1);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(X, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		if (vio->get(vio->cookie, j, &W))
+			return (-1);
+		blkxor(X, W, 128 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(Y, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		if (vio->get(vio->cookie, j, &W))
+			return (-1);
+		blkxor(Y, W, 128 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 10: B' <-- X */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_DONE);
+	for (k = 0; k < 32 * r; k++)
+		le32enc(&B[4 * k], X[k]);
+
+	/* Success! */
+	return (0);
+}
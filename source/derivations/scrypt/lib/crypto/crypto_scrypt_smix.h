@@ -4,14 +4,131 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Phases reported through crypto_scrypt_smix_ctl.phase. */
+#define CRYPTO_SCRYPT_SMIX_LOOP1	1	/* Before the first loop. */
+#define CRYPTO_SCRYPT_SMIX_LOOP2	2	/* Before the second loop. */
+#define CRYPTO_SCRYPT_SMIX_DONE		3	/* After the second loop. */
+
+/*
+ * Hooks into a running smix; every smix routine takes a pointer to one,
+ * which may be NULL.  The phase callback lets callers e.g. change how V is
+ * accessed between the two loops.  The loops return early, leaving B
+ * undefined, once *cancel is nonzero or CLOCK_MONOTONIC passes deadline.
+ */
+struct crypto_scrypt_smix_ctl {
+	void (* phase)(struct crypto_scrypt_smix_ctl *, int);
+	void * cookie;
+	const volatile int * cancel;	/* May be NULL. */
+	uint64_t deadline;		/* Nanoseconds, or 0 for none. */
+	int stopped;			/* Why smix returned early, or 0. */
+};
+
+#define CRYPTO_SCRYPT_SMIX_PHASE(ctl, ph) do {		\
+	if (((ctl) != NULL) && ((ctl)->phase != NULL))	\
+		(ctl)->phase((ctl), (ph));		\
+} while (0)
+
+/* Iterations between checks for cancellation; a power of 2. */
+#define CRYPTO_SCRYPT_SMIX_CHECK	4096
+
+#define CRYPTO_SCRYPT_SMIX_STOP(ctl, i)				\
+	((((i) & (CRYPTO_SCRYPT_SMIX_CHECK - 1)) == 0) &&	\
+	((ctl) != NULL) && crypto_scrypt_smix_stop(ctl))
+
+/**
+ * crypto_scrypt_smix_stop(ctl):
+ * Return nonzero and set ${ctl}->stopped to ECANCELED or ETIMEDOUT if the
+ * computation should be abandoned.
+ */
+int crypto_scrypt_smix_stop(struct crypto_scrypt_smix_ctl *);
+
+/*
+ * Storage for V outside of addressable memory, see crypto_scrypt_smix_io.
+ * put stores V_i for i = 0 to N - 1 in order; get returns a pointer to V_j,
+ * valid until the next call.  Both return 0 on success or -1 on error.
+ */
+struct crypto_scrypt_smix_vio {
+	int (* put)(void *, uint64_t, const uint32_t *);
+	int (* get)(void *, uint64_t, const uint32_t **);
+	void * cookie;
+};
+
 /**
- * crypto_scrypt_smix(B, r, N, V, XY):
+ * crypto_scrypt_smix(B, r, N, V, XY, ctl):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length;
  * the temporary storage V must be 128rN bytes in length; the temporary
  * storage XY must be 256r + 64 bytes in length.  The value N must be a
  * power of 2 greater than 1.  The arrays B, V, and XY must be aligned to a
- * multiple of 64 bytes.
+ * multiple of 64 bytes.  The hooks ${ctl} may be NULL.
+ */
+void crypto_scrypt_smix(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *);
+
+/* The kernels unrolled for some r use the vector extensions of GCC and clang. */
+#ifdef __GNUC__
+#define CRYPTO_SCRYPT_SMIX_FIXED
+#endif
+
+#ifdef CRYPTO_SCRYPT_SMIX_FIXED
+/**
+ * crypto_scrypt_smix_1(B, r, N, V, XY, ctl):
+ * crypto_scrypt_smix_8(B, r, N, V, XY, ctl):
+ * crypto_scrypt_smix_16(B, r, N, V, XY, ctl):
+ * Compute B = SMix_r(B, N) like crypto_scrypt_smix, with BlockMix unrolled
+ * for r = 1, 8 and 16 respectively and computed on four words at a time.  The
+ * argument ${r} must be that value.
+ */
+void crypto_scrypt_smix_1(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *);
+void crypto_scrypt_smix_8(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *);
+void crypto_scrypt_smix_16(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *);
+#endif
+
+/**
+ * crypto_scrypt_smix_slice(B, r, N, V, XY, pos, n):
+ * Perform the next ${n} (rounded up to an even number) of the 2N iterations
+ * of SMix_r(B, N), starting at iteration *${pos}, and advance *${pos}.  X
+ * is kept in XY between calls; B is read when *${pos} is 0 and B' written
+ * after the last iteration.  The buffers are as for crypto_scrypt_smix.
+ * Return 1 if B' was written; or 0 if iterations remain.
+ */
+int crypto_scrypt_smix_slice(uint8_t *, size_t, uint64_t, void *, void *,
+    uint64_t *, uint64_t);
+
+/* Most lanes crypto_scrypt_smix_multi computes together. */
+#define CRYPTO_SCRYPT_SMIX_MULTI	4
+
+/**
+ * crypto_scrypt_smix_multi(B, n, r, N, V, XY, pf):
+ * Compute B[l] = SMix_r(B[l], N) for the ${n} lanes l < ${n}, at most
+ * CRYPTO_SCRYPT_SMIX_MULTI, with the buffers V[l] and XY[l] as for
+ * crypto_scrypt_smix.  The lanes are computed in step, so that the reads of
+ * V_j by the second loop of all lanes are in flight at the same time, and
+ * if ${pf} is nonzero they are requested by prefetch instructions.
+ */
+void crypto_scrypt_smix_multi(uint8_t **, size_t, size_t, uint64_t, void **,
+    void **, int);
+
+/**
+ * crypto_scrypt_smix_tmto(B, r, N, V, XY, ctl, k):
+ * Compute B = SMix_r(B, N) like crypto_scrypt_smix, but store only every
+ * k-th V_i and recompute the others when the second loop needs them.  The
+ * temporary storage V must be 128rN/k bytes in length; the temporary storage
+ * XY must be 512r + 64 bytes in length.  The value k must be a power of 2
+ * greater than 1 and no greater than N.
+ */
+void crypto_scrypt_smix_tmto(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *, uint64_t);
+
+/**
+ * crypto_scrypt_smix_io(B, r, N, XY, vio, ctl):
+ * Compute B = SMix_r(B, N) like crypto_scrypt_smix, but store V through
+ * ${vio} instead of in memory.  Return 0 on success; or -1 if storing or
+ * loading a block of V failed.
  */
-void crypto_scrypt_smix(uint8_t *, size_t, uint64_t, void *, void *);
+int crypto_scrypt_smix_io(uint8_t *, size_t, uint64_t, void *,
+    struct crypto_scrypt_smix_vio *, struct crypto_scrypt_smix_ctl *);
 
 #endif /* !_CRYPTO_SCRYPT_SMIX_H_ */
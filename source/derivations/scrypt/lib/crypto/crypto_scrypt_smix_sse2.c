@@ -176,17 +176,18 @@ integerify(const void * B, size_t r)
 }
 
 /**
- * crypto_scrypt_smix_sse2(B, r, N, V, XY):
+ * crypto_scrypt_smix_sse2(B, r, N, V, XY, ctl):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length;
  * the temporary storage V must be 128rN bytes in length; the temporary
  * storage XY must be 256r + 64 bytes in length.  The value N must be a
  * power of 2 greater than 1.  The arrays B, V, and XY must be aligned to a
- * multiple of 64 bytes.
+ * multiple of 64 bytes.  The hooks ${ctl} may be NULL.
  *
  * Use SSE2 instructions.
  */
 void
-crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
+crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY,
+    struct crypto_scrypt_smix_ctl * ctl)
 {
 	__m128i * X = XY;
 	__m128i * Y = (void *)((uintptr_t)(XY) + 128 * r);
@@ -204,7 +205,12 @@ crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
 	}
 
 	/* 2: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP1);
 	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
 		/* 3: V_i <-- X */
 		blkcpy((void *)((uintptr_t)(V) + i * 128 * r), X, 128 * r);
 
@@ -220,7 +226,12 @@ crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
 	}
 
 	/* 6: for i = 0 to N - 1 do */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_LOOP2);
 	for (i = 0; i < N; i += 2) {
+		/* Give up if asked to. */
+		if (CRYPTO_SCRYPT_SMIX_STOP(ctl, i))
+			return;
+
 		/* 7: j <-- Integerify(X) mod N */
 		j = integerify(X, r) & (N - 1);
 
@@ -237,6 +248,7 @@ crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
 	}
 
 	/* 10: B' <-- X */
+	CRYPTO_SCRYPT_SMIX_PHASE(ctl, CRYPTO_SCRYPT_SMIX_DONE);
 	for (k = 0; k < 2 * r; k++) {
 		for (i = 0; i < 16; i++) {
 			le32enc(&B[(k * 16 + (i * 5 % 16)) * 4],
@@ -245,4 +257,184 @@ crypto_scrypt_smix_sse2(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
 	}
 }
 
+/**
+ * crypto_scrypt_smix_slice_sse2(B, r, N, V, XY, pos, n):
+ * Perform the next ${n} (rounded up to an even number) of the 2N iterations
+ * of SMix_r(B, N), starting at iteration *${pos}, and advance *${pos}.  X
+ * is kept in XY between calls; B is read when *${pos} is 0 and B' written
+ * after the last iteration.  The buffers are as for crypto_scrypt_smix.
+ * Return 1 if B' was written; or 0 if iterations remain.
+ *
+ * Use SSE2 instructions.
+ */
+int
+crypto_scrypt_smix_slice_sse2(uint8_t * B, size_t r, uint64_t N, void * V,
+    void * XY, uint64_t * pos, uint64_t n)
+{
+	__m128i * X = XY;
+	__m128i * Y = (void *)((uintptr_t)(XY) + 128 * r);
+	__m128i * Z = (void *)((uintptr_t)(XY) + 256 * r);
+	uint32_t * X32 = (void *)X;
+	uint64_t i = *pos;
+	uint64_t end, j, m;
+	size_t k;
+
+	/* Iterations are done in pairs. */
+	n = (n < 2) ? 2 : ((n + 1) & ~(uint64_t)(1));
+	end = (2 * N - i > n) ? i + n : 2 * N;
+
+	/* 1: X <-- B */
+	if (i == 0) {
+		for (k = 0; k < 2 * r; k++) {
+			for (m = 0; m < 16; m++) {
+				X32[k * 16 + m] =
+				    le32dec(&B[(k * 16 + (m * 5 % 16)) * 4]);
+			}
+		}
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (; (i < N) && (i < end); i += 2) {
+		/* 3: V_i <-- X */
+		blkcpy((void *)((uintptr_t)(V) + i * 128 * r), X, 128 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 3: V_i <-- X */
+		blkcpy((void *)((uintptr_t)(V) + (i + 1) * 128 * r),
+		    Y, 128 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (; i < end; i += 2) {
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(X, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(X, (void *)((uintptr_t)(V) + j * 128 * r), 128 * r);
+		blockmix_salsa8(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify(Y, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		blkxor(Y, (void *)((uintptr_t)(V) + j * 128 * r), 128 * r);
+		blockmix_salsa8(Y, X, Z, r);
+	}
+
+	*pos = i;
+	if (i < 2 * N)
+		return (0);
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 2 * r; k++) {
+		for (m = 0; m < 16; m++) {
+			le32enc(&B[(k * 16 + (m * 5 % 16)) * 4],
+			    X32[k * 16 + m]);
+		}
+	}
+
+	return (1);
+}
+
+/**
+ * crypto_scrypt_smix_multi_sse2(B, n, r, N, V, XY, pf):
+ * Compute B[l] = SMix_r(B[l], N) for the ${n} lanes l < ${n}, at most
+ * CRYPTO_SCRYPT_SMIX_MULTI, with the buffers V[l] and XY[l] as for
+ * crypto_scrypt_smix.  The lanes are computed in step, so that the reads of
+ * V_j by the second loop of all lanes are in flight at the same time, and
+ * if ${pf} is nonzero they are requested by prefetch instructions.
+ *
+ * Use SSE2 instructions.
+ */
+void
+crypto_scrypt_smix_multi_sse2(uint8_t ** B, size_t n, size_t r, uint64_t N,
+    void ** V, void ** XY, int pf)
+{
+	__m128i * X[CRYPTO_SCRYPT_SMIX_MULTI];
+	__m128i * Y[CRYPTO_SCRYPT_SMIX_MULTI];
+	__m128i * Z[CRYPTO_SCRYPT_SMIX_MULTI];
+	const uint8_t * Vj[CRYPTO_SCRYPT_SMIX_MULTI];
+	uint32_t * X32;
+	uint64_t i;
+	size_t k, l, m;
+
+	/* 1: X <-- B */
+	for (l = 0; l < n; l++) {
+		X[l] = XY[l];
+		Y[l] = (void *)((uintptr_t)(XY[l]) + 128 * r);
+		Z[l] = (void *)((uintptr_t)(XY[l]) + 256 * r);
+		X32 = (void *)X[l];
+		for (k = 0; k < 2 * r; k++) {
+			for (m = 0; m < 16; m++) {
+				X32[k * 16 + m] =
+				    le32dec(&B[l][(k * 16 + (m * 5 % 16)) * 4]);
+			}
+		}
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		for (l = 0; l < n; l++) {
+			/* 3: V_i <-- X */
+			blkcpy((void *)((uintptr_t)(V[l]) + i * 128 * r),
+			    X[l], 128 * r);
+
+			/* 4: X <-- H(X) */
+			blockmix_salsa8(X[l], Y[l], Z[l], r);
+
+			/* 3: V_i <-- X */
+			blkcpy((void *)((uintptr_t)(V[l]) + (i + 1) * 128 * r),
+			    Y[l], 128 * r);
+
+			/* 4: X <-- H(X) */
+			blockmix_salsa8(Y[l], X[l], Z[l], r);
+		}
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 7: j <-- Integerify(X) mod N, for all lanes first */
+		for (l = 0; l < n; l++) {
+			Vj[l] = (const uint8_t *)(V[l]) +
+			    (integerify(X[l], r) & (N - 1)) * 128 * r;
+			for (k = 0; pf && (k < 128 * r); k += 64)
+				_mm_prefetch((const char *)&Vj[l][k],
+				    _MM_HINT_T0);
+		}
+
+		/* 8: X <-- H(X \xor V_j) */
+		for (l = 0; l < n; l++) {
+			blkxor(X[l], Vj[l], 128 * r);
+			blockmix_salsa8(X[l], Y[l], Z[l], r);
+			Vj[l] = (const uint8_t *)(V[l]) +
+			    (integerify(Y[l], r) & (N - 1)) * 128 * r;
+			for (k = 0; pf && (k < 128 * r); k += 64)
+				_mm_prefetch((const char *)&Vj[l][k],
+				    _MM_HINT_T0);
+		}
+
+		/* 8: X <-- H(X \xor V_j) */
+		for (l = 0; l < n; l++) {
+			blkxor(Y[l], Vj[l], 128 * r);
+			blockmix_salsa8(Y[l], X[l], Z[l], r);
+		}
+	}
+
+	/* 10: B' <-- X */
+	for (l = 0; l < n; l++) {
+		X32 = (void *)X[l];
+		for (k = 0; k < 2 * r; k++) {
+			for (m = 0; m < 16; m++) {
+				le32enc(&B[l][(k * 16 + (m * 5 % 16)) * 4],
+				    X32[k * 16 + m]);
+			}
+		}
+	}
+}
+
 #endif /* CPUSUPPORT_X86_SSE2 */
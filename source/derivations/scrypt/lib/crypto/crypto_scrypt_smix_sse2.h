@@ -4,16 +4,45 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "crypto_scrypt_smix.h"
+
 /**
- * crypto_scrypt_smix_sse2(B, r, N, V, XY):
+ * crypto_scrypt_smix_sse2(B, r, N, V, XY, ctl):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length;
  * the temporary storage V must be 128rN bytes in length; the temporary
  * storage XY must be 256r + 64 bytes in length.  The value N must be a
  * power of 2 greater than 1.  The arrays B, V, and XY must be aligned to a
- * multiple of 64 bytes.
+ * multiple of 64 bytes.  The hooks ${ctl} may be NULL.
+ *
+ * Use SSE2 instructions.
+ */
+void crypto_scrypt_smix_sse2(uint8_t *, size_t, uint64_t, void *, void *,
+    struct crypto_scrypt_smix_ctl *);
+
+/**
+ * crypto_scrypt_smix_slice_sse2(B, r, N, V, XY, pos, n):
+ * Perform the next ${n} (rounded up to an even number) of the 2N iterations
+ * of SMix_r(B, N), starting at iteration *${pos}, and advance *${pos}.  X
+ * is kept in XY between calls; B is read when *${pos} is 0 and B' written
+ * after the last iteration.  The buffers are as for crypto_scrypt_smix.
+ * Return 1 if B' was written; or 0 if iterations remain.
+ *
+ * Use SSE2 instructions.
+ */
+int crypto_scrypt_smix_slice_sse2(uint8_t *, size_t, uint64_t, void *, void *,
+    uint64_t *, uint64_t);
+
+/**
+ * crypto_scrypt_smix_multi_sse2(B, n, r, N, V, XY, pf):
+ * Compute B[l] = SMix_r(B[l], N) for the ${n} lanes l < ${n}, at most
+ * CRYPTO_SCRYPT_SMIX_MULTI, with the buffers V[l] and XY[l] as for
+ * crypto_scrypt_smix.  The lanes are computed in step, so that the reads of
+ * V_j by the second loop of all lanes are in flight at the same time, and
+ * if ${pf} is nonzero they are requested by prefetch instructions.
  *
  * Use SSE2 instructions.
  */
-void crypto_scrypt_smix_sse2(uint8_t *, size_t, uint64_t, void *, void *);
+void crypto_scrypt_smix_multi_sse2(uint8_t **, size_t, size_t, uint64_t,
+    void **, void **, int);
 
 #endif /* !_CRYPTO_SCRYPT_SMIX_SSE2_H_ */
@@ -0,0 +1,346 @@
+#include "scrypt_platform.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crypto_scrypt_vfile.h"
+
+/* Direct I/O must be aligned to the logical block size; assume no more. */
+#define VFILE_ALIGN	4096
+
+/* Blocks written in loop 1 are collected into writes of this size. */
+#define VFILE_WBUFLEN	(1024 * 1024)
+
+static char * vfile_dir = NULL;
+static size_t vfile_threshold = 0;
+static int vfile_direct = 0;
+static size_t vfile_cachelen = 0;
+static struct crypto_scrypt_vfile_stats vfile_totals;
+
+/* Round ${len} up to a multiple of VFILE_ALIGN. */
+static uint64_t
+vfile_roundup(uint64_t len)
+{
+
+	return ((len + VFILE_ALIGN - 1) & ~(uint64_t)(VFILE_ALIGN - 1));
+}
+
+/* Return the major page faults taken by the calling thread so far. */
+static uint64_t
+vfile_majflt(void)
+{
+	struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+	if (getrusage(RUSAGE_THREAD, &ru) == 0)
+		return ((uint64_t)ru.ru_majflt);
+#else
+	(void)ru;
+#endif
+	return (0);
+}
+
+/**
+ * crypto_scrypt_vfile_config(dir, threshold, direct, cachelen):
+ * Keep V in an unlinked temporary file in the directory ${dir} when it is
+ * larger than ${threshold} bytes.  If ${direct} is zero the file is mapped;
+ * otherwise it is accessed with O_DIRECT through a cache of ${cachelen}
+ * bytes.  A NULL ${dir} keeps V in memory.
+ */
+void
+crypto_scrypt_vfile_config(const char * dir, size_t threshold, int direct,
+    size_t cachelen)
+{
+
+	free(vfile_dir);
+	vfile_dir = (dir != NULL) ? strdup(dir) : NULL;
+	vfile_threshold = threshold;
+	vfile_direct = direct;
+	vfile_cachelen = cachelen;
+}
+
+/**
+ * crypto_scrypt_vfile_wanted(len):
+ * Return nonzero if a V of ${len} bytes should be kept in a file.
+ */
+int
+crypto_scrypt_vfile_wanted(size_t len)
+{
+
+	return ((vfile_dir != NULL) && (len > vfile_threshold));
+}
+
+/* Write out the collected blocks; only the last write may be partial. */
+static int
+vfile_flush(struct crypto_scrypt_vfile * vf)
+{
+	size_t len = vfile_roundup(vf->wfill);
+
+	if (vf->wfill == 0)
+		return (0);
+	if (pwrite(vf->fd, vf->wbuf, len, (off_t)vf->woff) != (ssize_t)len) {
+		vf->err = 1;
+		return (-1);
+	}
+	vf->stats.writes += 1;
+	vf->stats.bytes_written += len;
+	vf->woff += vf->wfill;
+	vf->wfill = 0;
+
+	return (0);
+}
+
+/* Tell the kernel how V is about to be accessed, or flush our writes. */
+static void
+vfile_phase(struct crypto_scrypt_smix_ctl * ctl, int phase)
+{
+	struct crypto_scrypt_vfile * vf = ctl->cookie;
+
+	if (vf->V != NULL) {
+		/* Loop 1 writes V in order; loop 2 reads it at random. */
+		if (phase == CRYPTO_SCRYPT_SMIX_LOOP1)
+			madvise(vf->V, vf->len, MADV_SEQUENTIAL);
+		else if (phase == CRYPTO_SCRYPT_SMIX_LOOP2)
+			madvise(vf->V, vf->len, MADV_RANDOM);
+		return;
+	}
+
+	if (phase == CRYPTO_SCRYPT_SMIX_LOOP1) {
+		/* Each lane starts over at the beginning of the file. */
+		vf->woff = 0;
+		vf->wfill = 0;
+		memset(vf->tags, 0, vf->nlines * sizeof(uint64_t));
+	} else if (phase == CRYPTO_SCRYPT_SMIX_LOOP2) {
+		vfile_flush(vf);
+	}
+}
+
+/* Store V_i; blocks arrive in order. */
+static int
+vfile_put(void * cookie, uint64_t i, const uint32_t * Vi)
+{
+	struct crypto_scrypt_vfile * vf = cookie;
+	const uint8_t * src = (const uint8_t *)Vi;
+	size_t left = vf->blocklen;
+	size_t n;
+	size_t line = i % vf->nlines;
+
+	/* Keep the block in the cache too. */
+	memcpy(&vf->cache[line * vf->blocklen], Vi, vf->blocklen);
+	vf->tags[line] = i + 1;
+
+	while (left > 0) {
+		n = VFILE_WBUFLEN - vf->wfill;
+		if (n > left)
+			n = left;
+		memcpy(&vf->wbuf[vf->wfill], src, n);
+		vf->wfill += n;
+		src += n;
+		left -= n;
+		if ((vf->wfill == VFILE_WBUFLEN) && vfile_flush(vf))
+			return (-1);
+	}
+
+	return (0);
+}
+
+/* Load V_j through the cache. */
+static int
+vfile_get(void * cookie, uint64_t j, const uint32_t ** Vj)
+{
+	struct crypto_scrypt_vfile * vf = cookie;
+	size_t line = j % vf->nlines;
+	uint8_t * dst = &vf->cache[line * vf->blocklen];
+	uint64_t off, aoff, alen;
+
+	if (vf->err)
+		return (-1);
+	if (vf->tags[line] == j + 1) {
+		vf->stats.cache_hits += 1;
+		*Vj = (const uint32_t *)dst;
+		return (0);
+	}
+
+	/* Read the aligned extent holding the block. */
+	off = j * vf->blocklen;
+	aoff = off & ~(uint64_t)(VFILE_ALIGN - 1);
+	alen = vfile_roundup(off + vf->blocklen - aoff);
+	if (pread(vf->fd, vf->rbuf, alen, (off_t)aoff) != (ssize_t)alen)
+		return (-1);
+	vf->stats.reads += 1;
+	vf->stats.bytes_read += alen;
+	memcpy(dst, &vf->rbuf[off - aoff], vf->blocklen);
+	vf->tags[line] = j + 1;
+	*Vj = (const uint32_t *)dst;
+
+	return (0);
+}
+
+/* Create an unlinked file in vfile_dir. */
+static int
+vfile_create(int flags)
+{
+	char path[4096];
+	int fd;
+
+#ifdef O_TMPFILE
+	if ((fd = open(vfile_dir, O_TMPFILE | O_RDWR | flags, 0600)) != -1)
+		return (fd);
+#endif
+
+	/*
+	 * No O_TMPFILE support here or in the file system, or no direct I/O
+	 * in the file system (e.g. tmpfs), which then gets buffered I/O.
+	 */
+	if (snprintf(path, sizeof(path), "%s/scrypt-XXXXXX", vfile_dir) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if ((fd = mkstemp(path)) == -1)
+		return (-1);
+	unlink(path);
+	if (flags)
+		fcntl(fd, F_SETFL, flags);
+
+	return (fd);
+}
+
+/**
+ * crypto_scrypt_vfile_open(vf, len, blocklen):
+ * Create the file for a V of ${len} bytes made of blocks of ${blocklen}
+ * bytes.  In mmap mode set ${vf}->V; in direct mode set up ${vf}->vio for
+ * crypto_scrypt_smix_io.  In both modes ${vf}->ctl must be passed to smix.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt_vfile_open(struct crypto_scrypt_vfile * vf, size_t len,
+    size_t blocklen)
+{
+	void * p;
+	int flags = 0;
+
+	memset(vf, 0, sizeof(*vf));
+	vf->len = len;
+	vf->blocklen = blocklen;
+	vf->ctl.phase = vfile_phase;
+	vf->ctl.cookie = vf;
+	vf->stats.derivations = 1;
+	vf->stats.majflt = vfile_majflt();
+
+#ifdef O_DIRECT
+	if (vfile_direct)
+		flags = O_DIRECT;
+#endif
+	if ((vf->fd = vfile_create(flags)) == -1)
+		goto err0;
+	if (ftruncate(vf->fd, (off_t)(vfile_direct ? vfile_roundup(len) : len)))
+		goto err1;
+
+	if (!vfile_direct) {
+		/* Let the page cache do the I/O. */
+		if ((vf->V = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, vf->fd, 0)) == MAP_FAILED)
+			goto err1;
+		return (0);
+	}
+
+	/* Aligned buffers for direct I/O, and the block cache. */
+	vf->nlines = vfile_cachelen / blocklen;
+	if (vf->nlines == 0)
+		vf->nlines = 1;
+	if ((errno = posix_memalign(&p, VFILE_ALIGN, VFILE_WBUFLEN)) != 0)
+		goto err2;
+	vf->wbuf = p;
+	if ((errno = posix_memalign(&p, VFILE_ALIGN,
+	    vfile_roundup(blocklen) + VFILE_ALIGN)) != 0)
+		goto err2;
+	vf->rbuf = p;
+	if ((errno = posix_memalign(&p, 64, vf->nlines * blocklen)) != 0)
+		goto err2;
+	vf->cache = p;
+	if ((vf->tags = calloc(vf->nlines, sizeof(uint64_t))) == NULL)
+		goto err2;
+	vf->vio.put = vfile_put;
+	vf->vio.get = vfile_get;
+	vf->vio.cookie = vf;
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(vf->cache);
+	free(vf->rbuf);
+	free(vf->wbuf);
+err1:
+	close(vf->fd);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Add ${n} to a process-wide counter. */
+static void
+vfile_add(uint64_t * total, uint64_t n)
+{
+
+	__atomic_fetch_add(total, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * crypto_scrypt_vfile_close(vf):
+ * Remove the file and account its I/O in the statistics.
+ */
+void
+crypto_scrypt_vfile_close(struct crypto_scrypt_vfile * vf)
+{
+
+	if (vf->V != NULL)
+		munmap(vf->V, vf->len);
+	free(vf->tags);
+	free(vf->cache);
+	free(vf->rbuf);
+	free(vf->wbuf);
+	close(vf->fd);
+
+	vfile_add(&vfile_totals.derivations, vf->stats.derivations);
+	vfile_add(&vfile_totals.majflt, vfile_majflt() - vf->stats.majflt);
+	vfile_add(&vfile_totals.writes, vf->stats.writes);
+	vfile_add(&vfile_totals.bytes_written, vf->stats.bytes_written);
+	vfile_add(&vfile_totals.reads, vf->stats.reads);
+	vfile_add(&vfile_totals.bytes_read, vf->stats.bytes_read);
+	vfile_add(&vfile_totals.cache_hits, vf->stats.cache_hits);
+}
+
+/**
+ * crypto_scrypt_vfile_stats(stats):
+ * Return the I/O statistics of file-backed derivations via ${stats}.
+ */
+void
+crypto_scrypt_vfile_stats(struct crypto_scrypt_vfile_stats * stats)
+{
+
+	stats->derivations = __atomic_load_n(&vfile_totals.derivations,
+	    __ATOMIC_RELAXED);
+	stats->majflt = __atomic_load_n(&vfile_totals.majflt,
+	    __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&vfile_totals.writes,
+	    __ATOMIC_RELAXED);
+	stats->bytes_written = __atomic_load_n(&vfile_totals.bytes_written,
+	    __ATOMIC_RELAXED);
+	stats->reads = __atomic_load_n(&vfile_totals.reads, __ATOMIC_RELAXED);
+	stats->bytes_read = __atomic_load_n(&vfile_totals.bytes_read,
+	    __ATOMIC_RELAXED);
+	stats->cache_hits = __atomic_load_n(&vfile_totals.cache_hits,
+	    __ATOMIC_RELAXED);
+}
@@ -0,0 +1,80 @@
+#ifndef _CRYPTO_SCRYPT_VFILE_H_
+#define _CRYPTO_SCRYPT_VFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypto_scrypt_smix.h"
+
+/* I/O statistics of all file-backed derivations of the process. */
+struct crypto_scrypt_vfile_stats {
+	uint64_t derivations;	/* Derivations with V in a file. */
+	uint64_t majflt;	/* Major page faults in mmap mode. */
+	uint64_t writes;	/* pwrite calls in direct mode... */
+	uint64_t bytes_written;	/* ... and the bytes they wrote. */
+	uint64_t reads;		/* pread calls in direct mode... */
+	uint64_t bytes_read;	/* ... and the bytes they read. */
+	uint64_t cache_hits;	/* Blocks of V found in the cache. */
+};
+
+/* A temporary file holding V during one derivation. */
+struct crypto_scrypt_vfile {
+	int fd;
+	size_t len;		/* Length of V. */
+	size_t blocklen;	/* Length of a block of V, 128r. */
+	void * V;		/* The mapped file in mmap mode, else NULL. */
+	struct crypto_scrypt_smix_ctl ctl;
+	struct crypto_scrypt_smix_vio vio;
+
+	/* Direct mode only. */
+	uint8_t * wbuf;		/* Blocks written but not yet flushed... */
+	size_t wfill;		/* ... this many bytes of them... */
+	uint64_t woff;		/* ... belonging at this file offset. */
+	uint8_t * rbuf;		/* Aligned buffer for reads. */
+	uint8_t * cache;	/* Direct-mapped cache of blocks... */
+	uint64_t * tags;	/* ... holding these block numbers plus 1. */
+	size_t nlines;
+	int err;		/* Nonzero if a write failed. */
+
+	/* Statistics of this derivation. */
+	struct crypto_scrypt_vfile_stats stats;
+};
+
+/**
+ * crypto_scrypt_vfile_config(dir, threshold, direct, cachelen):
+ * Keep V in an unlinked temporary file in the directory ${dir} when it is
+ * larger than ${threshold} bytes.  If ${direct} is zero the file is mapped;
+ * otherwise it is accessed with O_DIRECT through a cache of ${cachelen}
+ * bytes.  A NULL ${dir} keeps V in memory.
+ */
+void crypto_scrypt_vfile_config(const char *, size_t, int, size_t);
+
+/**
+ * crypto_scrypt_vfile_wanted(len):
+ * Return nonzero if a V of ${len} bytes should be kept in a file.
+ */
+int crypto_scrypt_vfile_wanted(size_t);
+
+/**
+ * crypto_scrypt_vfile_open(vf, len, blocklen):
+ * Create the file for a V of ${len} bytes made of blocks of ${blocklen}
+ * bytes.  In mmap mode set ${vf}->V; in direct mode set up ${vf}->vio for
+ * crypto_scrypt_smix_io.  In both modes ${vf}->ctl must be passed to smix.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int crypto_scrypt_vfile_open(struct crypto_scrypt_vfile *, size_t, size_t);
+
+/**
+ * crypto_scrypt_vfile_close(vf):
+ * Remove the file and account its I/O in the statistics.
+ */
+void crypto_scrypt_vfile_close(struct crypto_scrypt_vfile *);
+
+/**
+ * crypto_scrypt_vfile_stats(stats):
+ * Return the I/O statistics of file-backed derivations via ${stats}.
+ */
+void crypto_scrypt_vfile_stats(struct crypto_scrypt_vfile_stats *);
+
+#endif /* !_CRYPTO_SCRYPT_VFILE_H_ */
@@ -0,0 +1,165 @@
+#include "scrypt_platform.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "crypto_scrypt_vpool.h"
+
+struct vpool_region {
+	void * V;
+	int inuse;
+};
+
+static pthread_mutex_t vpool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct vpool_region * vpool_regions = NULL;
+static size_t vpool_count = 0;
+static size_t vpool_size = 0;
+
+/* Unmap the first ${count} regions; the caller holds vpool_mtx. */
+static void
+vpool_unmap(size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		munmap(vpool_regions[i].V, vpool_size);
+	free(vpool_regions);
+	vpool_regions = NULL;
+	vpool_count = 0;
+	vpool_size = 0;
+}
+
+/**
+ * crypto_scrypt_vpool_init(count, size, flags):
+ * Create a process-wide pool of ${count} regions of ${size} bytes each to be
+ * used as V by crypto_scrypt.  The regions are pre-faulted, so that hashes
+ * using them take no page faults.  ${flags} is a combination of the
+ * CRYPTO_SCRYPT_VPOOL_* flags.  An existing pool is freed first.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt_vpool_init(size_t count, size_t size, int flags)
+{
+	void * V;
+	size_t i, o;
+	int mapflags = MAP_ANON | MAP_PRIVATE;
+
+#ifdef MAP_POPULATE
+	mapflags |= MAP_POPULATE;
+#endif
+#ifdef MAP_NOCORE
+	if (flags & CRYPTO_SCRYPT_VPOOL_NODUMP)
+		mapflags |= MAP_NOCORE;
+#endif
+
+	pthread_mutex_lock(&vpool_mtx);
+	if (vpool_regions != NULL)
+		vpool_unmap(vpool_count);
+	if ((count == 0) || (size == 0))
+		goto done;
+	if ((vpool_regions = calloc(count, sizeof(*vpool_regions))) == NULL)
+		goto err0;
+	vpool_size = size;
+
+	for (i = 0; i < count; i++) {
+		if ((V = mmap(NULL, size, PROT_READ | PROT_WRITE, mapflags,
+		    -1, 0)) == MAP_FAILED)
+			goto err1;
+		vpool_regions[i].V = V;
+#ifdef MADV_DONTDUMP
+		if ((flags & CRYPTO_SCRYPT_VPOOL_NODUMP) &&
+		    madvise(V, size, MADV_DONTDUMP))
+			goto err2;
+#endif
+		if ((flags & CRYPTO_SCRYPT_VPOOL_MLOCK) && mlock(V, size))
+			goto err2;
+
+		/* Fault in every page which MAP_POPULATE did not. */
+		for (o = 0; o < size; o += 4096)
+			((volatile uint8_t *)V)[o] = 0;
+	}
+	vpool_count = count;
+
+done:
+	pthread_mutex_unlock(&vpool_mtx);
+
+	/* Success! */
+	return (0);
+
+err2:
+	i++;
+err1:
+	vpool_unmap(i);
+err0:
+	pthread_mutex_unlock(&vpool_mtx);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_scrypt_vpool_get(len):
+ * Borrow a free region of at least ${len} bytes from the pool.  Return NULL
+ * if there is no pool, or if no suitable region is free.
+ */
+void *
+crypto_scrypt_vpool_get(size_t len)
+{
+	void * V = NULL;
+	size_t i;
+
+	/* Don't bother locking if the pool cannot help. */
+	if (len > vpool_size)
+		return (NULL);
+
+	pthread_mutex_lock(&vpool_mtx);
+	for (i = 0; (len <= vpool_size) && (i < vpool_count); i++) {
+		if (!vpool_regions[i].inuse) {
+			vpool_regions[i].inuse = 1;
+			V = vpool_regions[i].V;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vpool_mtx);
+
+	return (V);
+}
+
+/**
+ * crypto_scrypt_vpool_put(V):
+ * Return the region ${V} obtained from crypto_scrypt_vpool_get to the pool.
+ */
+void
+crypto_scrypt_vpool_put(void * V)
+{
+	size_t i;
+
+	pthread_mutex_lock(&vpool_mtx);
+	for (i = 0; i < vpool_count; i++) {
+		if (vpool_regions[i].V == V) {
+			vpool_regions[i].inuse = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vpool_mtx);
+}
+
+/**
+ * crypto_scrypt_vpool_free(void):
+ * Unmap all regions of the pool.  No region may be borrowed at this time.
+ */
+void
+crypto_scrypt_vpool_free(void)
+{
+
+	pthread_mutex_lock(&vpool_mtx);
+	if (vpool_regions != NULL)
+		vpool_unmap(vpool_count);
+	pthread_mutex_unlock(&vpool_mtx);
+}
@@ -0,0 +1,40 @@
+#ifndef _CRYPTO_SCRYPT_VPOOL_H_
+#define _CRYPTO_SCRYPT_VPOOL_H_
+
+#include <stddef.h>
+
+/* Flags for crypto_scrypt_vpool_init. */
+#define CRYPTO_SCRYPT_VPOOL_MLOCK	1	/* mlock the regions. */
+#define CRYPTO_SCRYPT_VPOOL_NODUMP	2	/* Keep them out of core dumps. */
+
+/**
+ * crypto_scrypt_vpool_init(count, size, flags):
+ * Create a process-wide pool of ${count} regions of ${size} bytes each to be
+ * used as V by crypto_scrypt.  The regions are pre-faulted, so that hashes
+ * using them take no page faults.  ${flags} is a combination of the
+ * CRYPTO_SCRYPT_VPOOL_* flags.  An existing pool is freed first.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int crypto_scrypt_vpool_init(size_t, size_t, int);
+
+/**
+ * crypto_scrypt_vpool_get(len):
+ * Borrow a free region of at least ${len} bytes from the pool.  Return NULL
+ * if there is no pool, or if no suitable region is free.
+ */
+void * crypto_scrypt_vpool_get(size_t);
+
+/**
+ * crypto_scrypt_vpool_put(V):
+ * Return the region ${V} obtained from crypto_scrypt_vpool_get to the pool.
+ */
+void crypto_scrypt_vpool_put(void *);
+
+/**
+ * crypto_scrypt_vpool_free(void):
+ * Unmap all regions of the pool.  No region may be borrowed at this time.
+ */
+void crypto_scrypt_vpool_free(void);
+
+#endif /* !_CRYPTO_SCRYPT_VPOOL_H_ */
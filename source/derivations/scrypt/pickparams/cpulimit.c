@@ -0,0 +1,189 @@
+#include "scrypt_platform.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpulimit.h"
+
+/* Where cgroup hierarchies are mounted on linux. */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+static int
+cpulimit_affinity(double * ncpus)
+{
+	long nonline;
+#ifdef CPU_COUNT
+	cpu_set_t set;
+
+	/* Count the CPUs we are allowed to run on. */
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		*ncpus = CPU_COUNT(&set);
+		return (0);
+	}
+#endif
+
+	/*
+	 * Either there is no affinity interface or the mask is larger than
+	 * a cpu_set_t; fall back to the number of online CPUs.
+	 */
+	if ((nonline = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nonline = 1;
+	*ncpus = nonline;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * cpulimit_quota(dir, v2, ncpus):
+ * Read the CPU bandwidth limit of the cgroup directory ${dir} and lower
+ * ${ncpus} to it.  Missing files, paths too long to open and "max" quotas
+ * impose no limit.
+ */
+static void
+cpulimit_quota(const char * dir, int v2, double * ncpus)
+{
+	char path[4096];
+	char buf[64];
+	FILE * f;
+	double quota, period;
+
+	if (v2) {
+		/* cgroup v2: "$MAX $PERIOD" or "max $PERIOD". */
+		if ((snprintf(path, sizeof(path), "%s/cpu.max", dir) >=
+		    (int)sizeof(path)) || ((f = fopen(path, "r")) == NULL))
+			return;
+		if (fgets(buf, sizeof(buf), f) == NULL ||
+		    sscanf(buf, "%lf %lf", &quota, &period) != 2)
+			quota = -1;
+		fclose(f);
+	} else {
+		/* cgroup v1: two files, -1 meaning no quota. */
+		if ((snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir) >=
+		    (int)sizeof(path)) || ((f = fopen(path, "r")) == NULL))
+			return;
+		if (fscanf(f, "%lf", &quota) != 1)
+			quota = -1;
+		fclose(f);
+		if ((snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir) >=
+		    (int)sizeof(path)) || ((f = fopen(path, "r")) == NULL))
+			return;
+		if (fscanf(f, "%lf", &period) != 1)
+			quota = -1;
+		fclose(f);
+	}
+
+	if ((quota > 0) && (period > 0) && (quota / period < *ncpus))
+		*ncpus = quota / period;
+}
+
+/**
+ * cpulimit_hierarchy(root, cgpath, v2, ncpus):
+ * Apply the CPU bandwidth limits of the cgroup ${cgpath} below ${root} and
+ * of all its ancestors, since a quota on any of them throttles us.
+ */
+static void
+cpulimit_hierarchy(const char * root, const char * cgpath, int v2,
+    double * ncpus)
+{
+	char dir[4096];
+	char * slash;
+
+	if (snprintf(dir, sizeof(dir), "%s%s", root, cgpath) >=
+	    (int)sizeof(dir))
+		return;
+	do {
+		cpulimit_quota(dir, v2, ncpus);
+		if ((slash = strrchr(dir, '/')) == NULL ||
+		    (size_t)(slash - dir) < strlen(root))
+			break;
+		*slash = '\0';
+	} while (1);
+}
+
+static int
+cpulimit_cgroup(double * ncpus)
+{
+	char line[4096];
+	char root[4096];
+	char * controllers, * cgpath, * tok, * save;
+	FILE * f;
+
+	/* Not running on linux, or no cgroups: no limit. */
+	if ((f = fopen("/proc/self/cgroup", "r")) == NULL)
+		return (0);
+
+	/* Lines are "hierarchy-ID:controller-list:cgroup-path". */
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((controllers = strchr(line, ':')) == NULL)
+			continue;
+		controllers += 1;
+		if ((cgpath = strchr(controllers, ':')) == NULL)
+			continue;
+		*cgpath++ = '\0';
+
+		if (controllers[0] == '\0') {
+			/* The unified hierarchy; it may live in a subdir. */
+			if (access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0)
+				cpulimit_hierarchy(CGROUP_ROOT, cgpath, 1, ncpus);
+			else
+				cpulimit_hierarchy(CGROUP_ROOT "/unified", cgpath,
+				    1, ncpus);
+			continue;
+		}
+
+		/* A v1 hierarchy is mounted under its controller list. */
+		snprintf(root, sizeof(root), "%s/%s", CGROUP_ROOT, controllers);
+		for (tok = strtok_r(controllers, ",", &save); tok != NULL;
+		    tok = strtok_r(NULL, ",", &save)) {
+			if (strcmp(tok, "cpu") == 0) {
+				cpulimit_hierarchy(root, cgpath, 0, ncpus);
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	/* Success! */
+	return (0);
+}
+
+int
+cputouse(double * ncpus)
+{
+	double affinity_ncpus, cgroup_ncpus;
+
+	/* Get CPU limits. */
+	if (cpulimit_affinity(&affinity_ncpus))
+		return (1);
+	cgroup_ncpus = affinity_ncpus;
+	if (cpulimit_cgroup(&cgroup_ncpus))
+		return (1);
+
+#ifdef DEBUG
+	fprintf(stderr, "CPU limits are %f %f\n",
+	    affinity_ncpus, cgroup_ncpus);
+#endif
+
+	/* Return the smaller of them via the provided pointer. */
+	*ncpus = (cgroup_ncpus < affinity_ncpus) ? cgroup_ncpus :
+	    affinity_ncpus;
+	return (0);
+}
+
+int
+cputouse_workers(size_t * nworkers)
+{
+	double ncpus;
+
+	if (cputouse(&ncpus))
+		return (1);
+
+	/* Round down, so that a fractional quota does not get throttled. */
+	*nworkers = (ncpus < 1.0) ? 1 : (size_t)ncpus;
+	return (0);
+}
@@ -0,0 +1,22 @@
+#ifndef _CPULIMIT_H_
+#define _CPULIMIT_H_
+
+#include <stddef.h>
+
+/**
+ * cputouse(ncpus):
+ * Examine the system and return via ncpus the number of CPUs which this
+ * process can actually keep busy -- the number of CPUs in its affinity mask,
+ * but no more than the cgroup CPU bandwidth quota.  The result may be
+ * fractional, e.g. 0.5 for a cpu.max of "50000 100000".
+ */
+int cputouse(double *);
+
+/**
+ * cputouse_workers(nworkers):
+ * Return via nworkers the default number of worker threads: the number of
+ * CPUs reported by cputouse rounded down, but at least one.
+ */
+int cputouse_workers(size_t *);
+
+#endif /* !_CPULIMIT_H_ */
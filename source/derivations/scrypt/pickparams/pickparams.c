@@ -8,6 +8,7 @@
 
 #include <inttypes.h>
 #include "memlimit.c"
+#include "cpulimit.c"
 #include "scryptenc_cpuperf.c"
 
 static int
@@ -16,6 +17,7 @@ pickparams(size_t maxmem, double maxmemfrac, double maxtime,
 {
 	size_t memlimit;
 	double opps;
+	double ncpus;
 	double opslimit;
 	double maxN, maxrp;
 	int rc;
@@ -27,6 +29,15 @@ pickparams(size_t maxmem, double maxmemfrac, double maxtime,
 	/* Figure out how fast the CPU is. */
 	if ((rc = scryptenc_cpuperf(&opps)) != 0)
 		return (rc);
+
+	/*
+	 * The measurement is too short to be throttled, but a CPU quota
+	 * below one CPU slows down every longer single-threaded scrypt.
+	 */
+	if (cputouse(&ncpus))
+		return (1);
+	if (ncpus < 1.0)
+		opps *= ncpus;
 	opslimit = opps * maxtime;
 
 	/* Allow a minimum of 2^15 salsa20/8 cores. */
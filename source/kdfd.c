@@ -0,0 +1,333 @@
+/* scrypt-kdfd, a local scrypt hashing daemon, serving hash, verify and calibrate requests over a unix domain socket.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scrypt.h"
+#include "scrypt_kdfd.h"
+#include "kdfd_client.c"
+
+#define daemon_version "0.1"
+#define kdfd_calibrations 16
+
+// calibrations are measured once per (memory, milliseconds)
+struct kdfd_calibration {
+  uint64_t memory;
+  uint32_t milliseconds;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+};
+
+struct kdfd {
+  const char* path;
+  uint32_t max_connections;
+  uint32_t connections;
+  uint64_t memory;
+  // largest N * r * p of a request, 0 for that of the defaults
+  uint64_t limit;
+  // defaults for hash requests without parameters
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+  pthread_mutex_t lock;
+  struct kdfd_calibration calibrations[kdfd_calibrations];
+  uint32_t calibration_count;
+};
+
+static struct kdfd kdfd = {.path = scrypt_kdfd_default_socket, .max_connections = 256, .lock = PTHREAD_MUTEX_INITIALIZER};
+static volatile sig_atomic_t kdfd_stop = 0;
+
+void display_help () {
+  puts(
+    "scrypt-kdfd [options ...]\n"
+    "options\n"
+    "  -a|--arena bytes  pre-faulted V arena of each worker, default 16MiB\n"
+    "  -c|--connections n  most concurrent clients, default 256\n"
+    "  -h|--help  display this text and exit\n"
+    "  -l|--limit n  largest N * r * p of hash and verify requests, default that of the calibrated defaults\n"
+    "  -m|--memory bytes  budget for V beyond the arenas of all derivations, default unlimited\n"
+    "  -p|--placement name  none, cores, nosmt or pack, default cores\n"
+    "  -s|--socket path  default " scrypt_kdfd_default_socket "\n"
+    "  -v|--version  output version information and exit\n"
+    "  -w|--workers n  derivations running at once, default the number of usable cpus");
+}
+
+void kdfd_signal (int signal) {
+  (void)signal;
+  kdfd_stop = 1;
+}
+
+/** true if a derivation with these parameters is more work than the daemon allows. one request above the limit
+  would occupy a worker for very long, with tmto even without running out of memory */
+uint8_t kdfd_over_limit (uint64_t N, uint32_t r, uint32_t p) {
+  return(!r || !p || (N > kdfd.limit / r / p));
+}
+
+/** derive on the worker pool */
+uint32_t kdfd_derive (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len) {
+  struct scrypt_job job = {.password = password, .password_len = password_len, .salt = salt, .salt_len = salt_len,
+    .N = N, .r = r, .p = p, .res = res, .res_len = res_len};
+  if (scrypt_submit(&job)) { return(1); }
+  return(scrypt_wait(&job));
+}
+
+uint32_t kdfd_calibrate (uint64_t memory, uint32_t milliseconds, uint64_t* N, uint32_t* r, uint32_t* p) {
+  uint32_t index;
+  uint32_t status;
+  struct kdfd_calibration* a;
+  if (kdfd.memory && (!memory || (memory > kdfd.memory))) { memory = kdfd.memory; }
+  pthread_mutex_lock(&kdfd.lock);
+  for (index = 0; index < kdfd.calibration_count; index += 1) {
+    a = kdfd.calibrations + index;
+    if ((a->memory == memory) && (a->milliseconds == milliseconds)) {
+      *N = a->N;
+      *r = a->r;
+      *p = a->p;
+      pthread_mutex_unlock(&kdfd.lock);
+      return(0);
+    }
+  }
+  pthread_mutex_unlock(&kdfd.lock);
+  status = scrypt_calibrate(memory, milliseconds / 1000.0, N, r, p);
+  if (status) { return(status); }
+  pthread_mutex_lock(&kdfd.lock);
+  if (kdfd.calibration_count < kdfd_calibrations) {
+    a = kdfd.calibrations + kdfd.calibration_count;
+    a->memory = memory;
+    a->milliseconds = milliseconds;
+    a->N = *N;
+    a->r = *r;
+    a->p = *p;
+    kdfd.calibration_count += 1;
+  }
+  pthread_mutex_unlock(&kdfd.lock);
+  return(0);
+}
+
+/** the salt of the crypt format is text. random bytes are mapped to the characters of its base64 alphabet */
+void kdfd_salt_crypt (uint8_t* salt, size_t salt_len) {
+  const char* chars = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  size_t index;
+  for (index = 0; index < salt_len; index += 1) { salt[index] = chars[salt[index] & 63]; }
+}
+
+uint32_t kdfd_hash (struct scrypt_kdfd_request* request, const uint8_t* password, uint8_t* data, uint8_t** res, size_t* res_len) {
+  uint8_t* salt = request->data_len ? data : 0;
+  size_t salt_len = request->data_len;
+  size_t size = (request->format == scrypt_kdfd_format_crypt) ? 32 : request->size;
+  uint64_t N = request->N ? request->N : kdfd.N;
+  uint32_t r = request->r ? request->r : kdfd.r;
+  uint32_t p = request->p ? request->p : kdfd.p;
+  uint32_t status;
+  if (size > scrypt_kdfd_max_data) { return(1); }
+  if (kdfd_over_limit(N, r, p)) { return(scrypt_error_limit); }
+  status = scrypt_set_defaults(&salt, &salt_len, &size, &N, &r, &p); if (status) { return(status); }
+  if (!request->data_len && (request->format == scrypt_kdfd_format_crypt)) { kdfd_salt_crypt(salt, salt_len); }
+  uint8_t* key = malloc(size);
+  status = key ? kdfd_derive(password, request->password_len, salt, salt_len, N, r, p, key, size) : 1;
+  if (!status) {
+    status = (request->format == scrypt_kdfd_format_crypt)
+      ? scrypt_encode_crypt(key, size, salt, salt_len, N, r, p, res, res_len)
+      : scrypt_encode_base91(key, size, salt, salt_len, N, r, p, res, res_len);
+  }
+  if (key) {
+    memset(key, 0, size);
+    free(key);
+  }
+  if (salt != data) { free(salt); }
+  return(status);
+}
+
+/** answer one request. res is set to a string for the response that must be freed */
+void kdfd_serve (struct scrypt_kdfd_request* request, const uint8_t* password, uint8_t* data, struct scrypt_kdfd_response* response, uint8_t** res) {
+  size_t res_len = 0;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+  memset(response, 0, sizeof(*response));
+  *res = 0;
+  if (scrypt_kdfd_op_hash == request->op) {
+    response->status = kdfd_hash(request, password, data, res, &res_len);
+    // the crypt format counts its terminating zero byte
+    if (!response->status && res_len && !(*res)[res_len - 1]) { res_len -= 1; }
+    if (response->status) { *res = 0; res_len = 0; }
+    response->data_len = res_len;
+  }
+  else if (scrypt_kdfd_op_verify == request->op) {
+    response->status = scrypt_hash_parameters(data, request->data_len, &N, &r, &p);
+    if (!response->status && kdfd_over_limit(N, r, p)) { response->status = scrypt_error_limit; }
+    if (!response->status) {
+      response->status = scrypt_verify_pooled(password, request->password_len, data, request->data_len);
+    }
+  }
+  else if (scrypt_kdfd_op_calibrate == request->op) {
+    response->status = kdfd_calibrate(request->N, request->size, &response->N, &response->r, &response->p);
+  }
+  else {
+    response->status = 1;
+  }
+}
+
+void* kdfd_connection (void* arg) {
+  int fd = (int)(intptr_t)arg;
+  struct scrypt_kdfd_request request;
+  struct scrypt_kdfd_response response;
+  uint8_t password[scrypt_kdfd_max_data];
+  uint8_t data[scrypt_kdfd_max_data + 1];
+  uint8_t* res;
+  while (!kdfd_read(fd, &request, sizeof(request))) {
+    if ((request.version != scrypt_kdfd_version)
+      || (request.password_len > scrypt_kdfd_max_data) || (request.data_len > scrypt_kdfd_max_data)
+      || kdfd_read(fd, password, request.password_len) || kdfd_read(fd, data, request.data_len)) { break; }
+    data[request.data_len] = 0;
+    kdfd_serve(&request, password, data, &response, &res);
+    uint32_t status = kdfd_write(fd, &response, sizeof(response)) || kdfd_write(fd, res, response.data_len);
+    free(res);
+    if (status) { break; }
+  }
+  memset(password, 0, sizeof(password));
+  close(fd);
+  __atomic_fetch_sub(&kdfd.connections, 1, __ATOMIC_RELAXED);
+  return(0);
+}
+
+uint32_t kdfd_listen (int* fd) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (strlen(kdfd.path) >= sizeof(address.sun_path)) { return(1); }
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, kdfd.path);
+  *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (*fd < 0) { return(1); }
+  unlink(kdfd.path);
+  if (bind(*fd, (struct sockaddr*)&address, sizeof(address)) || listen(*fd, 128)) {
+    close(*fd);
+    return(1);
+  }
+  return(0);
+}
+
+int main (int argc, char** argv) {
+  struct scrypt_config config = {0};
+  struct sigaction action;
+  pthread_attr_t attributes;
+  pthread_t thread;
+  uint8_t key[32];
+  int opt;
+  int fd;
+  int client;
+  struct option longopts[10] = {
+    {"arena", required_argument, 0, 'a'},
+    {"connections", required_argument, 0, 'c'},
+    {"help", no_argument, 0, 'h'},
+    {"limit", required_argument, 0, 'l'},
+    {"memory", required_argument, 0, 'm'},
+    {"placement", required_argument, 0, 'p'},
+    {"socket", required_argument, 0, 's'},
+    {"version", no_argument, 0, 'v'},
+    {"workers", required_argument, 0, 'w'},
+    {0, 0, 0, 0}
+  };
+  config.placement = scrypt_placement_cores;
+  while ((opt = getopt_long(argc, argv, "a:c:hl:m:p:s:vw:", longopts, 0)) != -1) {
+    switch (opt) {
+    case 'a': config.worker_arena_size = strtoull(optarg, 0, 10); break;
+    case 'c': kdfd.max_connections = strtoul(optarg, 0, 10); break;
+    case 'l': kdfd.limit = strtoull(optarg, 0, 10); break;
+    case 'm': kdfd.memory = strtoull(optarg, 0, 10); break;
+    case 'p':
+      config.placement = !strcmp(optarg, "none") ? scrypt_placement_none
+        : !strcmp(optarg, "nosmt") ? scrypt_placement_nosmt
+        : !strcmp(optarg, "pack") ? scrypt_placement_pack : scrypt_placement_cores;
+      break;
+    case 's': kdfd.path = optarg; break;
+    case 'w': config.workers = strtoul(optarg, 0, 10); break;
+    case 'v':
+      printf("%s\n", daemon_version);
+      return(0);
+    case 'h':
+    default:
+      display_help();
+      return(0);
+    }
+  }
+
+  // the budget bounds V memory through a shared memory segment, larger V is partly recomputed
+  if (kdfd.memory) {
+    config.shm_name = "/scrypt-kdfd";
+    config.shm_budget = kdfd.memory;
+    config.max_v_size = kdfd.memory;
+  }
+  if (scrypt_init(&config)) {
+    puts("initialisation failed");
+    return(1);
+  }
+  // start the workers, fault in their arenas and select the smix kernel before serving
+  if (kdfd_derive((const uint8_t*)"", 0, (const uint8_t*)"", 0, 2, 1, 1, key, sizeof(key))) {
+    puts("starting the workers failed");
+    return(1);
+  }
+  if (kdfd_calibrate(0, 3000, &kdfd.N, &kdfd.r, &kdfd.p)) {
+    puts("calibration failed");
+    return(1);
+  }
+  if (!kdfd.limit) { kdfd.limit = kdfd.N * kdfd.r * kdfd.p; }
+  if (kdfd_listen(&fd)) {
+    perror(kdfd.path);
+    return(1);
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = kdfd_signal;
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+  signal(SIGPIPE, SIG_IGN);
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  while (!kdfd_stop) {
+    client = accept4(fd, 0, 0, SOCK_CLOEXEC);
+    if (client < 0) {
+      // out of file descriptors for example, give connections time to end
+      if (EINTR != errno) { usleep(10000); }
+      continue;
+    }
+    if (__atomic_add_fetch(&kdfd.connections, 1, __ATOMIC_RELAXED) > kdfd.max_connections) {
+      __atomic_fetch_sub(&kdfd.connections, 1, __ATOMIC_RELAXED);
+      close(client);
+      continue;
+    }
+    if (pthread_create(&thread, &attributes, kdfd_connection, (void*)(intptr_t)client)) {
+      __atomic_fetch_sub(&kdfd.connections, 1, __ATOMIC_RELAXED);
+      close(client);
+    }
+  }
+  close(fd);
+  unlink(kdfd.path);
+  return(0);
+}
@@ -0,0 +1,145 @@
+/* client of scrypt-kdfd, the local scrypt hashing daemon.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scrypt_kdfd.h"
+
+uint32_t kdfd_write (int fd, const void* data, size_t len) {
+  const uint8_t* a = data;
+  ssize_t count;
+  while (len) {
+    count = send(fd, a, len, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (EINTR == errno) { continue; }
+      return(1);
+    }
+    a += count;
+    len -= count;
+  }
+  return(0);
+}
+
+/** read exactly len bytes. fails at end of file */
+uint32_t kdfd_read (int fd, void* data, size_t len) {
+  uint8_t* a = data;
+  ssize_t count;
+  while (len) {
+    count = recv(fd, a, len, 0);
+    if (count < 0) {
+      if (EINTR == errno) { continue; }
+      return(1);
+    }
+    if (!count) { return(1); }
+    a += count;
+    len -= count;
+  }
+  return(0);
+}
+
+/** connect to the daemon listening at path, or at scrypt_kdfd_default_socket if path is null.
+  a connection serves one request at a time, threads should use one connection each */
+uint32_t scrypt_kdfd_connect (const char* path, int* fd) {
+  struct sockaddr_un address;
+  if (!path) { path = scrypt_kdfd_default_socket; }
+  memset(&address, 0, sizeof(address));
+  if (strlen(path) >= sizeof(address.sun_path)) { return(1); }
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (*fd < 0) { return(1); }
+  if (connect(*fd, (struct sockaddr*)&address, sizeof(address))) {
+    close(*fd);
+    return(1);
+  }
+  return(0);
+}
+
+void scrypt_kdfd_close (int fd) {
+  close(fd);
+}
+
+/** send a request and receive the response. a returned data string is zero terminated and must be freed */
+uint32_t kdfd_call (int fd, struct scrypt_kdfd_request* request, const uint8_t* password, const uint8_t* data,
+  struct scrypt_kdfd_response* response, uint8_t** res, size_t* res_len) {
+  request->version = scrypt_kdfd_version;
+  request->reserved = 0;
+  if ((request->password_len > scrypt_kdfd_max_data) || (request->data_len > scrypt_kdfd_max_data)) { return(1); }
+  if (kdfd_write(fd, request, sizeof(*request))
+    || kdfd_write(fd, password, request->password_len)
+    || kdfd_write(fd, data, request->data_len)
+    || kdfd_read(fd, response, sizeof(*response))) { return(1); }
+  if (response->data_len > scrypt_kdfd_max_data) { return(1); }
+  if (!res) { return(response->data_len ? 1 : 0); }
+  *res = malloc(response->data_len + 1); if (!*res) { return(1); }
+  if (kdfd_read(fd, *res, response->data_len)) {
+    free(*res);
+    return(1);
+  }
+  (*res)[response->data_len] = 0;
+  *res_len = response->data_len;
+  return(0);
+}
+
+/** like scrypt_to_string_base91, or scrypt_to_string_crypt with format scrypt_kdfd_format_crypt, computed by the daemon.
+  a null salt is replaced by a random one, zero N, r, p and size by the defaults of the daemon */
+uint32_t scrypt_kdfd_hash (int fd, const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, size_t size, uint8_t format, uint8_t** res, size_t* res_len) {
+  struct scrypt_kdfd_request request = {0};
+  struct scrypt_kdfd_response response;
+  request.op = scrypt_kdfd_op_hash;
+  request.format = format;
+  request.password_len = password_len;
+  request.data_len = salt ? salt_len : 0;
+  request.N = N;
+  request.r = r;
+  request.p = p;
+  request.size = size;
+  if (kdfd_call(fd, &request, password, salt, &response, res, res_len)) { return(1); }
+  if (response.status) { free(*res); }
+  return(response.status);
+}
+
+/** like scrypt_verify, computed by the daemon. returns 0 if hash is derived from password and scrypt_error_mismatch if not */
+uint32_t scrypt_kdfd_verify (int fd, const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len) {
+  struct scrypt_kdfd_request request = {0};
+  struct scrypt_kdfd_response response;
+  request.op = scrypt_kdfd_op_verify;
+  request.password_len = password_len;
+  request.data_len = hash_len;
+  if (kdfd_call(fd, &request, password, hash, &response, 0, 0)) { return(1); }
+  return(response.status);
+}
+
+/** like scrypt_calibrate with max_time in milliseconds, measured once by the daemon and then answered from its cache */
+uint32_t scrypt_kdfd_calibrate (int fd, uint64_t max_memory, uint32_t max_time, uint64_t* N, uint32_t* r, uint32_t* p) {
+  struct scrypt_kdfd_request request = {0};
+  struct scrypt_kdfd_response response;
+  request.op = scrypt_kdfd_op_calibrate;
+  request.N = max_memory;
+  request.size = max_time;
+  if (kdfd_call(fd, &request, 0, 0, &response, 0, 0)) { return(1); }
+  *N = response.N;
+  *r = response.r;
+  *p = response.p;
+  return(response.status);
+}
@@ -0,0 +1,949 @@
+/* worker pool for asynchronous and batched derivations.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <sys/mman.h>
+#include "topology.c"
+#include "pressure.c"
+
+#define default_arena_size (128u * 8u * 16384u)
+#define pool_flight_buckets 64
+// share of the speedup of linear scaling that a higher concurrency limit has to bring, see pool_limit_update
+#define pool_limit_gain 0.5
+
+// a lane of a job that was split with crypto_scrypt_lanes_new
+struct pool_task {
+  struct scrypt_job* job;
+  size_t lane;
+};
+
+// lanes of the jobs a worker split. the owner pushes and pops at the bottom, idle workers steal from the top
+struct pool_deque {
+  pthread_mutex_t lock;
+  struct pool_task* tasks;
+  size_t size;
+  size_t top;
+  size_t bottom;
+};
+
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_cond_t stage;
+  // submitted jobs by priority, taken by workers whose own deque is empty
+  struct scrypt_job* head[3];
+  struct scrypt_job* tail[3];
+  // bulk jobs being derived, and how many may be
+  uint32_t bulk_running;
+  uint32_t bulk_workers;
+  // predicted nanoseconds of queued jobs by priority and of running jobs, see pool_cost_ns
+  uint64_t queued_ns[3];
+  uint64_t running_ns;
+  // microseconds a worker waits for jobs to fill a multi-buffer batch
+  uint32_t batch_linger;
+  // salsa20/8 cores per second from scryptenc_cpuperf, 0 if not measured and negative if that failed
+  double opps;
+  // 0 before pool_measure_start, 1 while pool_measure_opps runs and 2 after
+  uint8_t opps_state;
+  // unfinished jobs that identical jobs wait for, by the first byte of their flight key. see pool_flight_join
+  struct scrypt_job* flights[pool_flight_buckets];
+  uint8_t flight_secret[32];
+  uint8_t flight_secret_set;
+  struct pool_deque* deques;
+  // tasks in all deques
+  size_t stealable;
+  // jobs after step 1 for the workers, and jobs before step 5 for the stage workers. see pool_stage_worker
+  struct scrypt_job* ready_head;
+  struct scrypt_job* ready_tail;
+  uint32_t ready_count;
+  uint32_t preparing;
+  struct scrypt_job* finish_head;
+  struct scrypt_job* finish_tail;
+  pthread_t* stage_threads;
+  uint32_t stage_count;
+  uint8_t stage_stop;
+  // workers that took work, and how many may. see pool_limit_update
+  uint32_t busy;
+  uint32_t limit;
+  uint8_t limit_adaptive;
+  uint8_t limit_slow_start;
+  uint8_t limit_raised;
+  uint8_t limit_reached;
+  uint32_t limit_previous;
+  double limit_rate;
+  // jobs started since window_start and finished, their nanoseconds from start to end and their salsa20/8 cores
+  uint64_t window_start;
+  uint64_t window_jobs;
+  uint64_t window_ns;
+  double window_work;
+  // most workers that take work while memory or cpu are under pressure, and the thread that adapts it. see pool_pressure_watch
+  uint32_t pressure_limit;
+  struct pressure pressure[pressure_resources];
+  uint32_t pressure_count;
+  uint32_t pressure_window;
+  int pressure_wake[2];
+  pthread_t pressure_thread;
+  pthread_t* threads;
+  uint32_t thread_count;
+  uint8_t started;
+  uint8_t stop;
+  uint32_t placement;
+  size_t arena_size;
+  struct topology topology;
+};
+
+static struct pool pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER,
+  .stage = PTHREAD_COND_INITIALIZER};
+// set by scrypt_init, used when the pool is started on first use
+static struct scrypt_config pool_config;
+
+/** allocate the workers V arena after pinning, so that the first touch places its pages on the local numa node */
+void* pool_arena_create (size_t size) {
+  uint8_t* arena = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (arena == MAP_FAILED) { return(0); }
+#ifdef MADV_HUGEPAGE
+  struct crypto_scrypt_tuning tuning;
+  crypto_scrypt_get_tuning(&tuning);
+  if (tuning.hugepages) { madvise(arena, size, MADV_HUGEPAGE); }
+#endif
+  size_t offset;
+  for (offset = 0; offset < size; offset += 4096) { arena[offset] = 0; }
+  return(arena);
+}
+
+/** the status of a derivation that failed with errno */
+uint32_t status_from_errno () {
+  return((ECANCELED == errno) ? scrypt_error_canceled : (ETIMEDOUT == errno) ? scrypt_error_deadline : 1);
+}
+
+uint32_t pool_deque_push (struct pool_deque* a, struct scrypt_job* job, size_t lane) {
+  struct pool_task* tasks;
+  if (a->bottom == a->size) {
+    if (a->top) {
+      memmove(a->tasks, a->tasks + a->top, (a->bottom - a->top) * sizeof(struct pool_task));
+      a->bottom -= a->top;
+      a->top = 0;
+    }
+    else {
+      tasks = realloc(a->tasks, (a->size ? 2 * a->size : 16) * sizeof(struct pool_task));
+      if (!tasks) { return(1); }
+      a->tasks = tasks;
+      a->size = a->size ? 2 * a->size : 16;
+    }
+  }
+  a->tasks[a->bottom].job = job;
+  a->tasks[a->bottom].lane = lane;
+  a->bottom += 1;
+  __atomic_fetch_add(&pool.stealable, 1, __ATOMIC_RELAXED);
+  return(0);
+}
+
+/** take a task from the bottom if owner is true, otherwise from the top. returns 1 if there was none */
+uint32_t pool_deque_take (struct pool_deque* a, uint8_t owner, struct pool_task* task) {
+  pthread_mutex_lock(&a->lock);
+  if (a->top == a->bottom) {
+    pthread_mutex_unlock(&a->lock);
+    return(1);
+  }
+  if (owner) {
+    a->bottom -= 1;
+    *task = a->tasks[a->bottom];
+  }
+  else {
+    *task = a->tasks[a->top];
+    a->top += 1;
+  }
+  if (a->top == a->bottom) { a->top = a->bottom = 0; }
+  __atomic_fetch_sub(&pool.stealable, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&a->lock);
+  return(0);
+}
+
+/** take a task from the deque of another worker, starting with the next one */
+uint32_t pool_steal (uint32_t index, struct pool_task* task) {
+  uint32_t offset;
+  for (offset = 1; offset < pool.thread_count; offset += 1) {
+    if (!pool_deque_take(pool.deques + (index + offset) % pool.thread_count, 0, task)) { return(0); }
+  }
+  return(1);
+}
+
+/** the key of a job for finding identical ones. an hmac with a secret of the process, so that the password cannot be
+  recovered from it. the salt and password are length-prefixed so that moving bytes between them changes the key */
+void pool_flight_key (struct scrypt_job* job) {
+  HMAC_SHA256_CTX ctx;
+  uint64_t fields[6] = {job->password_len, job->salt_len, job->N, job->r, job->p, job->res_len};
+  HMAC_SHA256_Init(&ctx, pool.flight_secret, sizeof(pool.flight_secret));
+  HMAC_SHA256_Update(&ctx, fields, sizeof(fields));
+  HMAC_SHA256_Update(&ctx, job->password, job->password_len);
+  HMAC_SHA256_Update(&ctx, job->salt, job->salt_len);
+  HMAC_SHA256_Final(job->flight_key, &ctx);
+}
+
+/** 0 for jobs that start first */
+uint8_t pool_rank (uint8_t priority) {
+  return((scrypt_priority_interactive == priority) ? 0 : (scrypt_priority_normal == priority) ? 1 : 2);
+}
+
+/** with pool.lock held, make job a follower of an identical unfinished job and return 1, or return 0.
+  a job is only followed if it starts no later than the follower and cannot be canceled or stopped by a deadline
+  earlier than that of the follower */
+uint8_t pool_flight_join (struct scrypt_job* job) {
+  struct scrypt_job* a;
+  job->followers = 0;
+  if (!pool.flight_secret_set) { return(0); }
+  pool_flight_key(job);
+  for (a = pool.flights[job->flight_key[0] % pool_flight_buckets]; a; a = a->flight_next) {
+    if (memcmp(a->flight_key, job->flight_key, sizeof(job->flight_key))) { continue; }
+    if (a->cancel || (pool_rank(a->priority) > pool_rank(job->priority))) { continue; }
+    if (a->deadline && (!job->deadline || (a->deadline < job->deadline))) { continue; }
+    job->next = a->followers;
+    a->followers = job;
+    return(1);
+  }
+  return(0);
+}
+
+/** with pool.lock held, let later identical jobs follow a queued job */
+void pool_flight_register (struct scrypt_job* job) {
+  struct scrypt_job** bucket = pool.flights + job->flight_key[0] % pool_flight_buckets;
+  if (!pool.flight_secret_set) { return; }
+  job->flight_next = *bucket;
+  *bucket = job;
+}
+
+/** with pool.lock held, give the result of a finished job to its followers and unregister it */
+void pool_flight_land (struct scrypt_job* job) {
+  struct scrypt_job** a;
+  struct scrypt_job* follower;
+  if (!pool.flight_secret_set) { return; }
+  for (a = pool.flights + job->flight_key[0] % pool_flight_buckets; *a; a = &(*a)->flight_next) {
+    if (*a == job) {
+      *a = job->flight_next;
+      break;
+    }
+  }
+  while (job->followers) {
+    follower = job->followers;
+    job->followers = follower->next;
+    if (!job->status) { memcpy(follower->res, job->res, job->res_len); }
+    follower->status = job->status;
+    follower->done = 1;
+  }
+}
+
+/** append a job to a list linked by next */
+void pool_append (struct scrypt_job** head, struct scrypt_job** tail, struct scrypt_job* job) {
+  job->next = 0;
+  if (*tail) { (*tail)->next = job; } else { *head = job; }
+  *tail = job;
+}
+
+/** remove the first job of a list linked by next, or return 0 if it is empty */
+struct scrypt_job* pool_take (struct scrypt_job** head, struct scrypt_job** tail) {
+  struct scrypt_job* job = *head;
+  if (!job) { return(0); }
+  *head = job->next;
+  if (!*head) { *tail = 0; }
+  return(job);
+}
+
+/** with pool.lock held, adapt the concurrency limit after a job finished. the throughput with the limit is estimated
+  from the latency of the jobs of a window that saw the limit reached: limit / (nanoseconds per salsa20/8 core).
+  a higher limit is kept if the throughput grew by at least pool_limit_gain of linear scaling. starting with 1, the
+  limit doubles until that fails, and the previous limit is the knee after which loop 2 saturates the memory bandwidth.
+  from there it is increased by one per window, and decreased by a quarter when an increase did not pay off */
+void pool_limit_update (struct scrypt_job* job) {
+  uint32_t limit = pool.limit;
+  uint8_t gained;
+  double rate;
+  // jobs that started with an earlier limit would blur its effect
+  if (job->started < pool.window_start) { return; }
+  pool.window_jobs += 1;
+  pool.window_ns += timing_now() - job->started;
+  pool.window_work += 4.0 * job->N * job->r * job->p;
+  if (pool.window_jobs < 2 * limit + 2) { return; }
+  // without enough queued jobs to reach the limit, the latency says nothing about it
+  if (pool.limit_reached && pool.window_ns) {
+    rate = limit * pool.window_work / pool.window_ns;
+    gained = !pool.limit_raised
+      || (rate > pool.limit_rate * (1 + pool_limit_gain * (limit - pool.limit_previous) / pool.limit_previous));
+    if (!gained && pool.limit_slow_start) { limit = pool.limit_previous; }
+    else if (!gained) { limit = (limit * 3 / 4 < limit - 1) ? limit * 3 / 4 : limit - 1; }
+    else if (pool.limit_slow_start) { limit = (2 * limit < pool.thread_count) ? 2 * limit : pool.thread_count; }
+    else if (limit < pool.thread_count) { limit += 1; }
+    if (!limit) { limit = 1; }
+    if (!gained || (limit == pool.thread_count)) { pool.limit_slow_start = 0; }
+    pool.limit_raised = limit > pool.limit;
+    pool.limit_previous = pool.limit;
+    pool.limit_rate = rate;
+  }
+  if (limit > pool.limit) { pthread_cond_broadcast(&pool.work); }
+  pool.limit = limit;
+  stats_concurrency_limit(limit);
+  pool.limit_reached = pool.busy >= limit;
+  pool.window_start = timing_now();
+  pool.window_jobs = 0;
+  pool.window_ns = 0;
+  pool.window_work = 0;
+}
+
+/** how many workers may have taken work, with pool.lock held */
+uint32_t pool_admitted () {
+  return((pool.pressure_limit < pool.limit) ? pool.pressure_limit : pool.limit);
+}
+
+void pool_job_done (struct scrypt_job* job) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.limit_adaptive) { pool_limit_update(job); }
+  pool.running_ns -= job->cost_ns;
+  if (scrypt_priority_bulk == job->priority) {
+    pool.bulk_running -= 1;
+    pthread_cond_signal(&pool.work);
+    if (pool.stage_count) { pthread_cond_signal(&pool.stage); }
+  }
+  pool_flight_land(job);
+  job->done = 1;
+  pthread_cond_broadcast(&pool.done);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// the order in which the queues are served
+static const uint8_t pool_order[3] = {scrypt_priority_interactive, scrypt_priority_normal, scrypt_priority_bulk};
+
+/** remove a job that follows prev, or is the first if prev is null, from the queue of its priority */
+void pool_dequeue (struct scrypt_job* prev, struct scrypt_job* job) {
+  uint8_t priority = job->priority;
+  if (prev) { prev->next = job->next; } else { pool.head[priority] = job->next; }
+  if (pool.tail[priority] == job) { pool.tail[priority] = prev; }
+  if (scrypt_priority_bulk == priority) { pool.bulk_running += 1; }
+  pool.queued_ns[priority] -= job->cost_ns;
+  pool.running_ns += job->cost_ns;
+  if (pool.limit_adaptive) { job->started = timing_now(); }
+}
+
+/** remove the next job to start from the queues, with pool.lock held. interactive jobs go first, then normal jobs,
+  then bulk jobs while fewer than bulk_workers of them run, so that bulk work never takes all workers */
+struct scrypt_job* pool_next_job () {
+  struct scrypt_job* job;
+  uint32_t index;
+  for (index = 0; index < 3; index += 1) {
+    job = pool.head[pool_order[index]];
+    if (!job) { continue; }
+    if ((scrypt_priority_bulk == job->priority) && (pool.bulk_running >= pool.bulk_workers)) { return(0); }
+    pool_dequeue(0, job);
+    return(job);
+  }
+  return(0);
+}
+
+/** true if jobs wait for a worker */
+uint8_t pool_queued () {
+  return(pool.head[0] || pool.head[1] || pool.head[2] || pool.ready_head);
+}
+
+/** with pool.lock held, remove the first job that a stage worker prepared */
+struct scrypt_job* pool_take_ready () {
+  struct scrypt_job* job = pool_take(&pool.ready_head, &pool.ready_tail);
+  if (job) { pool.ready_count -= 1; }
+  return(job);
+}
+
+/** true if stage workers may run the pbkdf2 steps of the job */
+uint8_t pool_staged (struct scrypt_job* job) {
+  return(pool.stage_count && crypto_scrypt_lanes_usable(job->N, job->r, job->p));
+}
+
+/** with pool.lock held, remove the job that pool_next_job would return if a stage worker can prepare it,
+  and as long as fewer prepared jobs than workers wait, so that step 1 runs ahead by about one job per worker */
+struct scrypt_job* pool_next_staged () {
+  struct scrypt_job* job;
+  uint32_t index;
+  if (pool.ready_count + pool.preparing >= pool.thread_count) { return(0); }
+  for (index = 0; index < 3; index += 1) {
+    job = pool.head[pool_order[index]];
+    if (!job) { continue; }
+    if (!pool_staged(job)
+      || ((scrypt_priority_bulk == job->priority) && (pool.bulk_running >= pool.bulk_workers))) { return(0); }
+    pool_dequeue(0, job);
+    return(job);
+  }
+  return(0);
+}
+
+void pool_finish (struct scrypt_job* job) {
+  job->status = crypto_scrypt_lanes_finish(job->lanes) ? status_from_errno() : 0;
+  job->lanes = 0;
+  pool_job_done(job);
+}
+
+/** mix a lane of a prepared job. after the last one, step 5 runs here or without stage workers on a stage worker */
+void pool_run_lane (struct scrypt_job* job, size_t lane) {
+  if (!crypto_scrypt_lanes_mix(job->lanes, lane)) { return; }
+  if (!pool.stage_count) {
+    pool_finish(job);
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool_append(&pool.finish_head, &pool.finish_tail, job);
+  pthread_cond_signal(&pool.stage);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/** true if the lanes of the job are mixed by several workers. bulk jobs are not split, so that they stay within bulk_workers */
+uint8_t pool_splits (struct scrypt_job* job) {
+  return((pool.thread_count > 1) && (scrypt_priority_bulk != job->priority)
+    && crypto_scrypt_lanes_wanted(job->N, job->r, job->p));
+}
+
+/** true if the job can be derived together with others of the same N and r */
+uint8_t pool_batchable (struct scrypt_job* job) {
+  return(!job->cancel && !job->deadline && job->p && !pool_splits(job) && crypto_scrypt_multi_wanted(job->N, job->r));
+}
+
+/** with pool.lock held, true if the queued job a can join a batch started with job */
+uint8_t pool_batch_match (struct scrypt_job* job, struct scrypt_job* a) {
+  return((a->N == job->N) && (a->r == job->r) && pool_batchable(a)
+    && !((scrypt_priority_bulk == a->priority) && (pool.bulk_running >= pool.bulk_workers)));
+}
+
+/** with pool.lock held, how many more jobs a batch started with job should take. a batch mixes its jobs on one
+  worker, which is slower per job than mixing them alone, so it only takes the matching queued jobs that no idle
+  worker could start */
+uint32_t pool_batch_room (struct scrypt_job* job) {
+  struct scrypt_job* a;
+  uint32_t admitted = pool_admitted();
+  uint32_t idle = (admitted > pool.busy) ? admitted - pool.busy : 0;
+  uint32_t matching = 0;
+  uint32_t index;
+  for (index = 0; index < 3; index += 1) {
+    for (a = pool.head[index]; a; a = a->next) { matching += pool_batch_match(job, a); }
+  }
+  return((matching > idle) ? matching - idle : 0);
+}
+
+/** with pool.lock held, add queued jobs with the same N and r as the first one to a batch of count jobs,
+  in the order of pool_next_job and up to CRYPTO_SCRYPT_SMIX_MULTI and pool_batch_room. returns the new count */
+uint32_t pool_batch_fill (struct scrypt_job** batch, uint32_t count) {
+  struct scrypt_job* prev;
+  struct scrypt_job* a;
+  struct scrypt_job* next;
+  uint32_t index;
+  uint32_t room = pool_batch_room(batch[0]);
+  uint32_t max = (count + room < CRYPTO_SCRYPT_SMIX_MULTI) ? count + room : CRYPTO_SCRYPT_SMIX_MULTI;
+  for (index = 0; index < 3; index += 1) {
+    prev = 0;
+    for (a = pool.head[pool_order[index]]; a && (count < max); a = next) {
+      next = a->next;
+      if (!pool_batch_match(batch[0], a)) {
+        prev = a;
+        continue;
+      }
+      pool_dequeue(prev, a);
+      batch[count] = a;
+      count += 1;
+    }
+  }
+  return(count);
+}
+
+/** with pool.lock held, start a batch with job and fill it from the queue. if it is not full, wait up to
+  batch_linger microseconds for more submissions, unless the job is interactive, other work is queued or
+  a worker is idle */
+uint32_t pool_batch (struct scrypt_job* job, struct scrypt_job** batch) {
+  struct timespec until;
+  uint32_t count = 1;
+  batch[0] = job;
+  if (!pool_batchable(job)) { return(1); }
+  count = pool_batch_fill(batch, count);
+  if ((count == CRYPTO_SCRYPT_SMIX_MULTI) || !pool.batch_linger || (scrypt_priority_interactive == job->priority)
+    || (pool.busy < pool_admitted())) {
+    return(count);
+  }
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += (long)(pool.batch_linger % 1000000) * 1000;
+  until.tv_sec += pool.batch_linger / 1000000 + until.tv_nsec / 1000000000;
+  until.tv_nsec %= 1000000000;
+  while ((count < CRYPTO_SCRYPT_SMIX_MULTI) && !pool.stop) {
+    if (pool_queued() || __atomic_load_n(&pool.stealable, __ATOMIC_RELAXED)) {
+      // the wakeup was for other work, pass it on
+      pthread_cond_signal(&pool.work);
+      break;
+    }
+    if (ETIMEDOUT == pthread_cond_timedwait(&pool.work, &pool.lock, &until)) { break; }
+    count = pool_batch_fill(batch, count);
+  }
+  return(count);
+}
+
+/** mix the lanes of a prepared job on the calling worker, or for jobs with several large lanes, mix the first
+  lane here and leave the others on the deque of the worker where idle workers can steal them */
+void pool_run_lanes (uint32_t index, struct scrypt_job* job) {
+  struct pool_deque* deque = pool.deques + index;
+  size_t lane = 1;
+  if (pool_splits(job)) {
+    pthread_mutex_lock(&deque->lock);
+    // lanes that do not fit into the deque are mixed here
+    for (; lane < job->p; lane += 1) {
+      if (pool_deque_push(deque, job, lane)) { break; }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+  }
+  for (; lane < job->p; lane += 1) { pool_run_lane(job, lane); }
+  pool_run_lane(job, 0);
+}
+
+/** derive on the calling worker, or prepare a job that is split and pass it to pool_run_lanes */
+void pool_run_job (uint32_t index, struct scrypt_job* job) {
+  if (!pool_splits(job)) {
+    job->status = scrypt_cancellable(job->password, job->password_len, job->salt, job->salt_len,
+      job->N, job->r, job->p, job->res, job->res_len, job->cancel, job->deadline);
+    pool_job_done(job);
+    return;
+  }
+  job->lanes = crypto_scrypt_lanes_new(job->password, job->password_len, job->salt, job->salt_len,
+    job->N, job->r, job->p, job->res, job->res_len, job->cancel, job->deadline);
+  if (!job->lanes) {
+    job->status = 1;
+    pool_job_done(job);
+    return;
+  }
+  pool_run_lanes(index, job);
+}
+
+/** derive a batch of jobs with the same N and r together with the multi-buffer smix, or one after another if that fails */
+void pool_run_batch (uint32_t index, struct scrypt_job** batch, uint32_t count) {
+  struct crypto_scrypt_multi_job jobs[CRYPTO_SCRYPT_SMIX_MULTI];
+  struct scrypt_job* job;
+  uint32_t a;
+  for (a = 0; a < count; a += 1) {
+    job = batch[a];
+    jobs[a].passwd = job->password;
+    jobs[a].passwdlen = job->password_len;
+    jobs[a].salt = job->salt;
+    jobs[a].saltlen = job->salt_len;
+    jobs[a].p = job->p;
+    jobs[a].buf = job->res;
+    jobs[a].buflen = job->res_len;
+  }
+  if (crypto_scrypt_multi(jobs, count, batch[0]->N, batch[0]->r)) {
+    for (a = 0; a < count; a += 1) { pool_run_job(index, batch[a]); }
+    return;
+  }
+  for (a = 0; a < count; a += 1) {
+    batch[a]->status = 0;
+    pool_job_done(batch[a]);
+  }
+}
+
+void* pool_worker (void* arg) {
+  uint32_t index = (uint32_t)(uintptr_t)arg;
+  struct scrypt_job* job;
+  struct scrypt_job* batch[CRYPTO_SCRYPT_SMIX_MULTI];
+  uint32_t count = 0;
+  uint64_t start;
+  uint8_t busy = 0;
+  struct pool_task task;
+  cpu_set_t set;
+  if (topology_worker_cpus(&pool.topology, pool.placement, index, &set)) {
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  void* arena = pool.arena_size ? pool_arena_create(pool.arena_size) : 0;
+  if (arena) { crypto_scrypt_set_arena(arena, pool.arena_size); }
+  while (1) {
+    // lanes of own jobs first, so that split jobs finish before new ones start
+    start = timing_now();
+    if (!pool_deque_take(pool.deques + index, 1, &task)) {
+      pool_run_lane(task.job, task.lane);
+      stats_stage_add(stats_stage_mix, timing_now() - start);
+      continue;
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (busy) {
+      pool.busy -= 1;
+      busy = 0;
+    }
+    // prepared jobs first, their B is already allocated. new work only below the concurrency limit
+    job = 0;
+    while (!((pool.busy < pool_admitted())
+        && ((job = pool_take_ready()) || (job = pool_next_job()) || __atomic_load_n(&pool.stealable, __ATOMIC_RELAXED)))
+      && !(pool.stop && !pool_queued() && !pool.preparing)) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    if (!job && !__atomic_load_n(&pool.stealable, __ATOMIC_RELAXED)) {
+      pthread_mutex_unlock(&pool.lock);
+      break;
+    }
+    pool.busy += 1;
+    busy = 1;
+    if (pool.busy >= pool.limit) { pool.limit_reached = 1; }
+    if (job && pool.stage_count) { pthread_cond_signal(&pool.stage); }
+    if (job && !job->lanes) { count = pool_batch(job, batch); }
+    pthread_mutex_unlock(&pool.lock);
+    start = timing_now();
+    if (job && job->lanes) { pool_run_lanes(index, job); }
+    else if (job && (count > 1)) { pool_run_batch(index, batch, count); }
+    else if (job) { pool_run_job(index, job); }
+    else if (!pool_steal(index, &task)) { pool_run_lane(task.job, task.lane); }
+    else { continue; }
+    stats_stage_add(stats_stage_mix, timing_now() - start);
+  }
+  if (arena) {
+    crypto_scrypt_set_arena(0, 0);
+    munmap(arena, pool.arena_size);
+  }
+  return(0);
+}
+
+/** run the pbkdf2 steps of jobs for the workers. jobs whose lanes are mixed are finished first, which completes them
+  and frees their B, then queued jobs are prepared ahead of the workers. the workers then only run smix, unless they
+  take a job from the queue themselves because none is prepared */
+void* pool_stage_worker (void* arg) {
+  struct scrypt_job* job;
+  uint64_t start;
+  (void)arg;
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    if ((job = pool_take(&pool.finish_head, &pool.finish_tail))) {
+      pthread_mutex_unlock(&pool.lock);
+      start = timing_now();
+      job->status = crypto_scrypt_lanes_finish(job->lanes) ? status_from_errno() : 0;
+      job->lanes = 0;
+      // counted before the job is done and its waiter may read the stats
+      stats_stage_add(stats_stage_finish, timing_now() - start);
+      pool_job_done(job);
+      pthread_mutex_lock(&pool.lock);
+    }
+    else if ((job = pool_next_staged())) {
+      pool.preparing += 1;
+      pthread_mutex_unlock(&pool.lock);
+      start = timing_now();
+      job->lanes = crypto_scrypt_lanes_new(job->password, job->password_len, job->salt, job->salt_len,
+        job->N, job->r, job->p, job->res, job->res_len, job->cancel, job->deadline);
+      stats_stage_add(stats_stage_prepare, timing_now() - start);
+      if (!job->lanes) {
+        job->status = 1;
+        pool_job_done(job);
+        job = 0;
+      }
+      pthread_mutex_lock(&pool.lock);
+      pool.preparing -= 1;
+      if (job) {
+        pool_append(&pool.ready_head, &pool.ready_tail, job);
+        pool.ready_count += 1;
+      }
+      // stopping workers wait until nothing is being prepared
+      if (pool.stop) { pthread_cond_broadcast(&pool.work); } else { pthread_cond_signal(&pool.work); }
+    }
+    else if (pool.stage_stop) { break; }
+    else { pthread_cond_wait(&pool.stage, &pool.lock); }
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return(0);
+}
+
+/** adapt pool.pressure_limit to the pressure on memory and cpu. a window in which some tasks stalled for longer than
+  a threshold halves it, and every window without raises it by one up to the number of workers */
+void* pool_pressure_watch (void* arg) {
+  int status;
+  (void)arg;
+  while (1) {
+    status = pressure_wait(pool.pressure, pool.pressure_count, pool.pressure_wake[0], pool.pressure_window);
+    if (status < 0) { break; }
+    pthread_mutex_lock(&pool.lock);
+    if (status) {
+      pool.pressure_limit = (pool.pressure_limit + 1) / 2;
+      stats_pressure_throttle();
+    }
+    else if (pool.pressure_limit < pool.thread_count) {
+      pool.pressure_limit += 1;
+      pthread_cond_broadcast(&pool.work);
+    }
+    stats_pressure_limit(pool.pressure_limit);
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return(0);
+}
+
+/** start watching the resources with a threshold. without pressure stall information, the workers are not throttled */
+void pool_pressure_start () {
+  const char* names[pressure_resources] = {"memory", "cpu"};
+  uint32_t thresholds[pressure_resources];
+  uint32_t index;
+  const char* env = getenv("SCRYPT_PRESSURE_MEMORY");
+  thresholds[0] = env ? strtoul(env, 0, 10) : pool_config.pressure_memory;
+  env = getenv("SCRYPT_PRESSURE_CPU");
+  thresholds[1] = env ? strtoul(env, 0, 10) : pool_config.pressure_cpu;
+  pool.pressure_limit = pool.thread_count;
+  pool.pressure_window = pool_config.pressure_window ? pool_config.pressure_window : default_pressure_window;
+  pool.pressure_count = 0;
+  for (index = 0; index < pressure_resources; index += 1) {
+    if (!thresholds[index]) { continue; }
+    if (!pressure_open(names[index], thresholds[index], pool.pressure_window, pool.pressure + pool.pressure_count)) {
+      pool.pressure_count += 1;
+    }
+  }
+  if (!pool.pressure_count) { return; }
+  if (!pipe2(pool.pressure_wake, O_CLOEXEC)) {
+    if (!pthread_create(&pool.pressure_thread, 0, pool_pressure_watch, 0)) {
+      stats_pressure_limit(pool.pressure_limit);
+      return;
+    }
+    close(pool.pressure_wake[0]);
+    close(pool.pressure_wake[1]);
+  }
+  for (index = 0; index < pool.pressure_count; index += 1) { pressure_close(pool.pressure + index); }
+  pool.pressure_count = 0;
+}
+
+void pool_pressure_stop () {
+  uint32_t index;
+  if (!pool.pressure_count) { return; }
+  // the watcher sees the end of the pipe
+  close(pool.pressure_wake[1]);
+  pthread_join(pool.pressure_thread, 0);
+  close(pool.pressure_wake[0]);
+  for (index = 0; index < pool.pressure_count; index += 1) { pressure_close(pool.pressure + index); }
+  pool.pressure_count = 0;
+}
+
+void pool_free () {
+  uint32_t index;
+  for (index = 0; index < pool.thread_count; index += 1) {
+    pthread_mutex_destroy(&pool.deques[index].lock);
+    free(pool.deques[index].tasks);
+  }
+  free(pool.deques);
+  pool.deques = 0;
+  free(pool.threads);
+  pool.threads = 0;
+  pool.thread_count = 0;
+  free(pool.stage_threads);
+  pool.stage_threads = 0;
+  pool.stage_count = 0;
+  stats_stage_workers(0, 0);
+  stats_concurrency_limit(0);
+  stats_pressure_limit(0);
+}
+
+/** start the workers. environment variables override the configuration to allow comparing placements per host */
+uint32_t pool_start () {
+  size_t count = pool_config.workers;
+  const char* cpus = getenv("SCRYPT_CPUS");
+  const char* env = getenv("SCRYPT_PLACEMENT");
+  uint32_t index;
+  pool.placement = env ? topology_placement_from_string(env) : pool_config.placement;
+  if (!cpus) { cpus = pool_config.cpus; }
+  if (topology_read(cpus, &pool.topology)) { return(1); }
+  env = getenv("SCRYPT_WORKERS");
+  if (env) { count = strtoul(env, 0, 10); }
+  if (!count) {
+    if (cputouse_workers(&count)) { return(1); }
+    if (count > pool.topology.cpu_count) { count = pool.topology.cpu_count; }
+    if ((pool.placement == scrypt_placement_cores) || (pool.placement == scrypt_placement_nosmt)) {
+      if (count > pool.topology.core_count) { count = pool.topology.core_count; }
+    }
+  }
+  pool.arena_size = pool_config.worker_arena_size ? pool_config.worker_arena_size : default_arena_size;
+  pool.threads = malloc(count * sizeof(pthread_t)); if (!pool.threads) { return(1); }
+  pool.deques = calloc(count, sizeof(struct pool_deque));
+  if (!pool.deques) { free(pool.threads); return(1); }
+  for (index = 0; index < count; index += 1) { pthread_mutex_init(&pool.deques[index].lock, 0); }
+  pool.stop = 0;
+  for (index = 0; index < count; index += 1) {
+    if (pthread_create(pool.threads + index, 0, pool_worker, (void*)(uintptr_t)index)) { break; }
+  }
+  // set before any worker can take pool.lock, which the caller holds
+  pool.thread_count = index;
+  for (; index < count; index += 1) { pthread_mutex_destroy(&pool.deques[index].lock); }
+  if (!pool.thread_count) { pool_free(); return(1); }
+  env = getenv("SCRYPT_BULK_WORKERS");
+  pool.bulk_workers = env ? strtoul(env, 0, 10) : pool_config.bulk_workers;
+  if (!pool.bulk_workers) { pool.bulk_workers = (pool.thread_count + 3) / 4; }
+  pool.bulk_running = 0;
+  env = getenv("SCRYPT_BATCH_LINGER");
+  pool.batch_linger = env ? strtoul(env, 0, 10) : pool_config.batch_linger;
+  env = getenv("SCRYPT_STAGE_WORKERS");
+  count = env ? strtoul(env, 0, 10) : pool_config.stage_workers;
+  pool.stage_stop = 0;
+  // without stage workers, the workers run all steps
+  pool.stage_threads = count ? malloc(count * sizeof(pthread_t)) : 0;
+  for (index = 0; pool.stage_threads && (index < count); index += 1) {
+    if (pthread_create(pool.stage_threads + index, 0, pool_stage_worker, 0)) { break; }
+  }
+  pool.stage_count = pool.stage_threads ? index : 0;
+  stats_stage_workers(pool.thread_count, pool.stage_count);
+  env = getenv("SCRYPT_ADAPTIVE_CONCURRENCY");
+  pool.limit_adaptive = env ? (0 != strtoul(env, 0, 10)) : pool_config.adaptive_concurrency;
+  pool.limit = pool.limit_adaptive ? 1 : pool.thread_count;
+  pool.limit_slow_start = 1;
+  pool.limit_reached = 0;
+  pool.limit_raised = 0;
+  pool.limit_rate = 0;
+  pool.window_start = 0;
+  pool.window_jobs = 0;
+  pool.window_ns = 0;
+  pool.window_work = 0;
+  pool.busy = 0;
+  stats_concurrency_limit(pool.limit);
+  pool_pressure_start();
+  if (!pool.flight_secret_set) {
+    FILE* file = fopen("/dev/urandom", "r");
+    if (file) {
+      pool.flight_secret_set = fread(pool.flight_secret, sizeof(pool.flight_secret), 1, file);
+      fclose(file);
+    }
+  }
+  pool.started = 1;
+  return(0);
+}
+
+void pool_stop () {
+  uint32_t index;
+  pthread_mutex_lock(&pool.lock);
+  if (!pool.started) { pthread_mutex_unlock(&pool.lock); return; }
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  for (index = 0; index < pool.thread_count; index += 1) { pthread_join(pool.threads[index], 0); }
+  // the workers are done, so no further job is finished
+  pthread_mutex_lock(&pool.lock);
+  pool.stage_stop = 1;
+  pthread_cond_broadcast(&pool.stage);
+  pthread_mutex_unlock(&pool.lock);
+  for (index = 0; index < pool.stage_count; index += 1) { pthread_join(pool.stage_threads[index], 0); }
+  pool_pressure_stop();
+  pool_free();
+  pool.started = 0;
+}
+
+/** thread that measures the speed of the cpu for pool_cost_ns. it takes about a second */
+void* pool_measure_opps (void* arg) {
+  double opps;
+  (void)arg;
+  if (scryptenc_cpuperf(&opps)) { opps = -1; }
+  pthread_mutex_lock(&pool.lock);
+  pool.opps = opps;
+  pool.opps_state = 2;
+  pthread_mutex_unlock(&pool.lock);
+  return(0);
+}
+
+/** with pool.lock held, measure the speed of the cpu in the background, once. jobs submitted meanwhile have
+  an unknown duration */
+void pool_measure_start () {
+  pthread_attr_t attributes;
+  pthread_t thread;
+  if (pool.opps_state) { return; }
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  if (!pthread_create(&thread, &attributes, pool_measure_opps, 0)) { pool.opps_state = 1; }
+  pthread_attr_destroy(&attributes);
+}
+
+/** predicted duration of a job, with pool.lock held. the mean of earlier derivations with the same parameters,
+  or scaled from other parameters, or for jobs with a deadline from the speed of the cpu, which is measured when
+  the first of them can not be predicted otherwise. the first job with a deadline also starts the statistics that
+  the means are taken from. 0 if unknown */
+uint64_t pool_cost_ns (struct scrypt_job* job) {
+  if (job->N < 2) { return(0); }
+  if (job->deadline) { stats_enable(); }
+  uint64_t ns = stats_predict_ns(job->N, job->r, job->p);
+  if (ns || !job->deadline) { return(ns); }
+  pool_measure_start();
+  return((pool.opps > 0) ? (uint64_t)(4.0 * job->N * job->r * job->p / pool.opps * 1e9) : 0);
+}
+
+/** true if the job is predicted to finish after its deadline, with pool.lock held. it starts once the jobs queued
+  ahead of it and about half of the running ones are done, spread over the workers */
+uint8_t pool_unreachable (struct scrypt_job* job) {
+  uint64_t ahead = pool.queued_ns[scrypt_priority_interactive] + pool.running_ns / 2;
+  uint64_t start;
+  if (!job->deadline || !job->cost_ns) { return(0); }
+  if (scrypt_priority_interactive != job->priority) { ahead += pool.queued_ns[scrypt_priority_normal]; }
+  start = ahead / pool_admitted();
+  if (scrypt_priority_bulk == job->priority) { start += pool.queued_ns[scrypt_priority_bulk] / pool.bulk_workers; }
+  return(timing_now() + start + job->cost_ns > job->deadline);
+}
+
+/** queue a job behind those of the same priority. the job and its buffers must stay valid until scrypt_wait returns.
+  a job with a deadline that it is predicted to miss is not queued, it is done with status scrypt_error_unreachable,
+  which is also returned */
+uint32_t scrypt_submit (struct scrypt_job* job) {
+  uint8_t priority = job->priority;
+  if (priority > scrypt_priority_bulk) { return(1); }
+  pthread_mutex_lock(&pool.lock);
+  if (!pool.started && pool_start()) {
+    pthread_mutex_unlock(&pool.lock);
+    return(1);
+  }
+  job->done = 0;
+  if (pool_flight_join(job)) {
+    pthread_mutex_unlock(&pool.lock);
+    return(0);
+  }
+  job->cost_ns = pool_cost_ns(job);
+  if (pool_unreachable(job)) {
+    job->status = scrypt_error_unreachable;
+    job->done = 1;
+    pthread_mutex_unlock(&pool.lock);
+    return(scrypt_error_unreachable);
+  }
+  job->next = 0;
+  job->lanes = 0;
+  pool_flight_register(job);
+  pool.queued_ns[priority] += job->cost_ns;
+  if (pool.tail[priority]) { pool.tail[priority]->next = job; } else { pool.head[priority] = job; }
+  pool.tail[priority] = job;
+  pthread_cond_signal(&pool.work);
+  if (pool.stage_count) { pthread_cond_signal(&pool.stage); }
+  pthread_mutex_unlock(&pool.lock);
+  return(0);
+}
+
+/** wait until a submitted job is finished and return its status */
+uint32_t scrypt_wait (struct scrypt_job* job) {
+  pthread_mutex_lock(&pool.lock);
+  while (!job->done) { pthread_cond_wait(&pool.done, &pool.lock); }
+  pthread_mutex_unlock(&pool.lock);
+  return(job->status);
+}
+
+/** run jobs on the worker pool and wait for all of them. returns the first non-zero job status */
+uint32_t scrypt_batch (struct scrypt_job* jobs, size_t count) {
+  size_t index;
+  uint32_t status = 0;
+  uint32_t submitted;
+  for (index = 0; index < count; index += 1) {
+    submitted = scrypt_submit(jobs + index);
+    // rejected jobs are done and their status is returned below
+    if (submitted && (scrypt_error_unreachable != submitted)) {
+      count = index;
+      status = 1;
+      break;
+    }
+  }
+  for (index = 0; index < count; index += 1) {
+    if (scrypt_wait(jobs + index) && !status) { status = jobs[index].status; }
+  }
+  return(status);
+}
@@ -0,0 +1,100 @@
+/* pressure stall information of linux, for throttling the workers while the host is short of memory or cpu.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define pressure_resources 2
+// milliseconds. linux accepts trigger windows of 500 to 10000, unprivileged processes only multiples of 2000
+#define default_pressure_window 2000
+
+// a watched /proc/pressure file. with a trigger, linux signals POLLPRI when the time in which some tasks stalled
+// exceeds threshold percent of a window, at most once per window. without, the file is read after every window
+struct pressure {
+  int fd;
+  uint8_t trigger;
+  uint32_t threshold;
+};
+
+/** watch /proc/pressure/name for more than threshold percent of stalls. falls back to reading the file where
+  triggers are not permitted. returns 1 if linux has no pressure stall information */
+uint32_t pressure_open (const char* name, uint32_t threshold, uint32_t window, struct pressure* a) {
+  char path[64];
+  char trigger[64];
+  int len;
+  snprintf(path, sizeof(path), "/proc/pressure/%s", name);
+  a->threshold = (threshold > 100) ? 100 : threshold;
+  a->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (a->fd >= 0) {
+    len = snprintf(trigger, sizeof(trigger), "some %lu %lu",
+      (unsigned long)window * 10 * a->threshold, (unsigned long)window * 1000);
+    if (write(a->fd, trigger, len + 1) == len + 1) {
+      a->trigger = 1;
+      return(0);
+    }
+    close(a->fd);
+  }
+  a->trigger = 0;
+  a->fd = open(path, O_RDONLY | O_CLOEXEC);
+  return((a->fd < 0) ? 1 : 0);
+}
+
+void pressure_close (struct pressure* a) {
+  if (a->fd >= 0) { close(a->fd); }
+  a->fd = -1;
+}
+
+/** percentage of the last 10 seconds in which some tasks stalled, or -1 if it can not be read */
+double pressure_read (struct pressure* a) {
+  char buffer[256];
+  double avg10;
+  ssize_t len = pread(a->fd, buffer, sizeof(buffer) - 1, 0);
+  if (len <= 0) { return(-1); }
+  buffer[len] = 0;
+  if (1 != sscanf(buffer, "some avg10=%lf", &avg10)) { return(-1); }
+  return(avg10);
+}
+
+/** wait up to window milliseconds for a resource to cross its threshold, or for wake to become readable.
+  returns 1 if a resource crossed its threshold, 0 if none did and -1 if woken */
+int pressure_wait (struct pressure* a, uint32_t count, int wake, uint32_t window) {
+  struct pollfd fds[pressure_resources + 1];
+  uint32_t index;
+  fds[0].fd = wake;
+  fds[0].events = POLLIN;
+  for (index = 0; index < count; index += 1) {
+    // negative descriptors are ignored by poll
+    fds[index + 1].fd = a[index].trigger ? a[index].fd : -1;
+    fds[index + 1].events = POLLPRI;
+    fds[index + 1].revents = 0;
+  }
+  if (poll(fds, count + 1, window) < 0) {
+    if (EINTR != errno) { return(-1); }
+    return(0);
+  }
+  if (fds[0].revents) { return(-1); }
+  for (index = 0; index < count; index += 1) {
+    if (fds[index + 1].revents & POLLPRI) { return(1); }
+    // the watched cgroup is gone
+    if (fds[index + 1].revents & (POLLERR | POLLNVAL)) { pressure_close(a + index); }
+  }
+  for (index = 0; index < count; index += 1) {
+    if (!a[index].trigger && (a[index].fd >= 0) && (pressure_read(a + index) >= a[index].threshold)) { return(1); }
+  }
+  return(0);
+}
@@ -15,27 +15,175 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+// for linux interfaces like sched_getaffinity
+#define _GNU_SOURCE
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include "scrypt.h"
 #include "../foreign/crypt_base64.c"
 #include "../foreign/base91/base91.c"
 #include "crypto_scrypt.c"
 #include "pickparams/pickparams.c"
 #include "shared.c"
+#include "stats.c"
+#include "pool.c"
+#include "verify_cache.c"
+#include "autotune.c"
 
-#define error_invalid_hash_format 2
+#define error_invalid_hash_format scrypt_error_invalid_hash_format
 
 int scrypt(const uint8_t * passwd, size_t passwdlen,
     const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t _r, uint32_t _p,
     uint8_t * buf, size_t buflen) {
-  crypto_scrypt(passwd, passwdlen, salt, saltlen, N, _r, _p, buf, buflen);
+  return(crypto_scrypt(passwd, passwdlen, salt, saltlen, N, _r, _p, buf, buflen));
+}
+
+/** like scrypt but give up when *cancel is non-zero or the monotonic clock passes deadline (see scrypt_deadline_after),
+  freeing V right away. cancel can be null and deadline 0. checked every few thousand iterations and between lanes */
+uint32_t scrypt_cancellable (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len, const volatile int* cancel, uint64_t deadline) {
+  if (!crypto_scrypt_cancel(password, password_len, salt, salt_len, N, r, p, res, res_len, cancel, deadline)) { return(0); }
+  return(status_from_errno());
+}
+
+/** the deadline for scrypt_cancellable that is the given number of nanoseconds from now */
+uint64_t scrypt_deadline_after (uint64_t ns) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + ns);
+}
+
+/** start a derivation that is performed in slices by scrypt_step, for cooperative schedulers.
+  res must stay valid until scrypt_step returned scrypt_step_done */
+uint32_t scrypt_state_new (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len, struct scrypt_state** state) {
+  *state = (struct scrypt_state*)crypto_scrypt_state_new(password, password_len, salt, salt_len, N, r, p, res, res_len);
+  return(*state ? 0 : 1);
+}
+
+/** perform at most about max_iterations more smix iterations. a derivation takes 2 * N * p */
+uint32_t scrypt_step (struct scrypt_state* state, uint64_t max_iterations) {
+  return(crypto_scrypt_state_step((struct crypto_scrypt_state*)state, max_iterations) ? scrypt_step_done : scrypt_step_more);
+}
+
+void scrypt_state_free (struct scrypt_state* state) {
+  crypto_scrypt_state_free((struct crypto_scrypt_state*)state);
+}
+
+void scrypt_perf_counts_from_crypto (const struct crypto_scrypt_perf_counts* a, struct scrypt_perf_counts* b) {
+  b->cycles = a->cycles;
+  b->instructions = a->instructions;
+  b->cache_misses = a->cache_misses;
+  b->dtlb_misses = a->dtlb_misses;
+  b->stalled_cycles = a->stalls;
+}
+
+void scrypt_timing_from_crypto (const struct crypto_scrypt_timing* a, struct scrypt_timing* b) {
+  b->alloc_ns = a->alloc;
+  b->pbkdf2_in_ns = a->pbkdf2_in;
+  b->loop1_ns = a->loop1;
+  b->loop2_ns = a->loop2;
+  b->pbkdf2_out_ns = a->pbkdf2_out;
+  b->free_ns = a->free;
+  b->total_ns = a->total;
+  b->lane_ns = a->lanes;
+  b->lane_count = a->nlanes;
+  b->kernel = a->kernel;
+  b->v_allocation = a->valloc;
+  b->perf = a->perf ? 1 : 0;
+  scrypt_perf_counts_from_crypto(&a->perf_loop1, &b->loop1_perf);
+  scrypt_perf_counts_from_crypto(&a->perf_loop2, &b->loop2_perf);
+  scrypt_perf_counts_from_crypto(&a->perf_pbkdf2, &b->pbkdf2_perf);
+}
+
+/** like scrypt, and record per phase and lane timings, the smix kernel and how V was allocated */
+uint32_t scrypt_timed (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len, struct scrypt_timing* timing) {
+  struct crypto_scrypt_timing a = {0};
+  a.lanes = timing->lane_ns;
+  a.nlanes = timing->lane_ns ? timing->lane_count : 0;
+  uint32_t status = crypto_scrypt_timed(password, password_len, salt, salt_len, N, r, p, res, res_len, &a) ? 1 : 0;
+  scrypt_timing_from_crypto(&a, timing);
+  return(status);
+}
+
+static void (*scrypt_timing_hook)(const struct scrypt_timing*) = 0;
+
+void scrypt_timing_hook_call (const struct crypto_scrypt_timing* a) {
+  struct scrypt_timing b;
+  void (*hook)(const struct scrypt_timing*) = scrypt_timing_hook;
+  if (!hook) { return; }
+  scrypt_timing_from_crypto(a, &b);
+  hook(&b);
+}
+
+/** call hook with the timings of every successful derivation not made with scrypt_timed, including those on the worker pool.
+  the first 16 lanes are recorded. null disables it, which then costs nothing while the statistics are off */
+void scrypt_set_timing_hook (void (*hook)(const struct scrypt_timing*)) {
+  scrypt_timing_hook = hook;
+  crypto_scrypt_set_timing(hook ? scrypt_timing_hook_call : 0);
+}
+
+#define default_v_pool_size (128u * 8u * 16384u)
+
+uint32_t scrypt_init (const struct scrypt_config* config) {
+  pool_config = *config;
+  crypto_scrypt_set_vlimit(config->max_v_size);
+  crypto_scrypt_set_blimit(config->max_b_size);
+  size_t size = config->v_pool_size ? config->v_pool_size : default_v_pool_size;
+  int flags = 0;
+  if (config->v_pool_flags & scrypt_v_pool_mlock) { flags |= CRYPTO_SCRYPT_VPOOL_MLOCK; }
+  if (config->v_pool_flags & scrypt_v_pool_nodump) { flags |= CRYPTO_SCRYPT_VPOOL_NODUMP; }
+  if (crypto_scrypt_vpool_init(config->v_pool_count, size, flags)) { return(1); }
+  if (config->shm_name) {
+    size = config->shm_slab_size ? config->shm_slab_size : default_v_pool_size;
+    if (crypto_scrypt_shm_open(config->shm_name, config->shm_budget, config->shm_slab_count, size)) { return(1); }
+  }
+  size = config->v_file_cache_size ? config->v_file_cache_size : default_v_pool_size;
+  crypto_scrypt_vfile_config(config->v_file_dir, config->v_file_threshold, config->v_file_direct, size);
+  crypto_scrypt_perf_enable(config->perf_counters);
+  crypto_scrypt_set_generic(config->generic_smix);
+  if (config->stats) { stats_enable(); }
+  if (config->verify_cache_size && verify_cache_init(config->verify_cache_size, config->verify_cache_ttl)) { return(1); }
+  return(0);
+}
+
+void scrypt_deinit () {
+  pool_stop();
+  crypto_scrypt_shm_close();
+  crypto_scrypt_set_vlimit(0);
+  crypto_scrypt_set_blimit(0);
+  crypto_scrypt_vfile_config(0, 0, 0, 0);
+  crypto_scrypt_perf_enable(0);
+  crypto_scrypt_set_generic(0);
+  crypto_scrypt_vpool_free();
+  verify_cache_free();
+}
+
+void scrypt_v_file_stats (struct scrypt_v_file_stats* stats) {
+  struct crypto_scrypt_vfile_stats a;
+  crypto_scrypt_vfile_stats(&a);
+  stats->derivations = a.derivations;
+  stats->major_faults = a.majflt;
+  stats->writes = a.writes;
+  stats->bytes_written = a.bytes_written;
+  stats->reads = a.reads;
+  stats->bytes_read = a.bytes_read;
+  stats->cache_hits = a.cache_hits;
 }
 
 uint8_t* scrypt_strerror (uint32_t n) {
   return(error_invalid_hash_format == n ? "invalid hash format" :
+    scrypt_error_canceled == n ? "derivation canceled" :
+    scrypt_error_deadline == n ? "derivation deadline passed" :
+    scrypt_error_mismatch == n ? "password does not match" :
+    scrypt_error_unreachable == n ? "derivation deadline unreachable" :
+    scrypt_error_limit == n ? "parameters above the limit" :
     "error without description");
 }
 
@@ -47,14 +195,23 @@ uint32_t random_string (uint8_t** salt, size_t salt_len) {
   fclose(file); return (0);
 }
 
+/** choose N, r and p for derivations that take about max_time seconds on this cpu with V of at most max_memory bytes.
+  max_memory 0 is half of the memory available */
+uint32_t scrypt_calibrate (size_t max_memory, double max_time, uint64_t* N, uint32_t* r, uint32_t* p) {
+  int logN;
+  uint32_t status = pickparams(max_memory, 0.5, max_time, &logN, r, p, 0); if (status) { return(status); }
+  *N = (uint64_t)(1) << logN;
+  return(0);
+}
+
 uint32_t scrypt_set_defaults (uint8_t** salt, size_t* salt_len, size_t* size, uint64_t* N, uint32_t* r, uint32_t* p) {
   uint32_t status;
   if (!(*N && *r && *p)) {
-    int logN;
+    uint64_t default_N;
     uint32_t default_r;
     uint32_t default_p;
-    status = pickparams(0, 0.5, 3.0, &logN, &default_r, &default_p, 0); if (status) { return(status); }
-    if (!*N) { *N = (uint64_t)(1) << logN; }
+    status = scrypt_calibrate(0, 3.0, &default_N, &default_r, &default_p); if (status) { return(status); }
+    if (!*N) { *N = default_N; }
     if (!*r) { *r = default_r; }
     if (!*p) { *p = default_p; }
   }
@@ -67,58 +224,68 @@ uint32_t scrypt_set_defaults (uint8_t** salt, size_t* salt_len, size_t* size, ui
   return(0);
 }
 
-uint32_t scrypt_parse_string_base91 (uint8_t* arg, size_t arg_len, uint8_t** key, size_t* key_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
-  size_t index = 0;
-  uint8_t count = 0;
-  size_t previous_index = 0;
-  uint32_t logN = 0;
-  while (index < arg_len) {
-    if (*(arg + index) == '-') {
-      count += 1;
-      switch (count) {
-      case 1:
-	previous_index = index;
-	*key = malloc(index); if (!*key) { return(1); }
-	*key_len = base91_decode(*key, arg, index);
-      case 2:
-	*salt = malloc(index - previous_index); if (!*salt) { return(1); }
-	*salt_len = base91_decode(*salt, arg + previous_index, index - previous_index);
-	previous_index = index;
-      case 3:
-	base91_decode((uint8_t*)&logN, arg + previous_index, index - previous_index);
-	*N = (uint64_t)(1) << logN;
-	previous_index = index;
-      case 4:
-	*r = 0;
-	base91_decode((uint8_t*)r, arg + previous_index, index - previous_index);
-	previous_index = index;
-      }
-    }
-    index += 1;
+/** decode a number field of a base91 hash string, which has at most 4 bytes. returns 1 if it is empty or longer */
+uint32_t parse_number_base91 (uint8_t* field, size_t len, uint32_t* res) {
+  uint8_t buffer[16];
+  size_t size;
+  // base91 has 13 bits in 2 characters, so 8 characters decode to at most 7 bytes
+  if (!len || (len > 8)) { return(1); }
+  size = base91_decode(buffer, field, len);
+  if (!size || (size > 4)) { return(1); }
+  *res = 0;
+  memcpy(res, buffer, size);
+  return(0);
+}
+
+/** parse "key-salt-logN-r-p". key and salt must not be empty, and N, r and p must be usable with crypto_scrypt.
+  returns error_invalid_hash_format otherwise, and then key and salt are not allocated */
+uint32_t parse_string_base91 (uint8_t* arg, size_t arg_len, uint8_t** key, size_t* key_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
+  size_t dashes[4];
+  size_t count = 0;
+  size_t index;
+  uint32_t logN;
+  for (index = 0; index < arg_len; index += 1) {
+    if ('-' != arg[index]) { continue; }
+    if (4 == count) { return(error_invalid_hash_format); }
+    dashes[count] = index;
+    count += 1;
+  }
+  if ((4 != count) || !dashes[0] || (dashes[1] == dashes[0] + 1)
+    || parse_number_base91(arg + dashes[1] + 1, dashes[2] - dashes[1] - 1, &logN)
+    || parse_number_base91(arg + dashes[2] + 1, dashes[3] - dashes[2] - 1, r)
+    || parse_number_base91(arg + dashes[3] + 1, arg_len - dashes[3] - 1, p)
+    || !logN || (logN > 63) || !*r || !*p) {
+    return(error_invalid_hash_format);
+  }
+  *N = (uint64_t)(1) << logN;
+  *key = malloc(dashes[0]); if (!*key) { return(1); }
+  *salt = malloc(dashes[1] - dashes[0] - 1);
+  if (!*salt) { free(*key); *key = 0; return(1); }
+  *key_len = base91_decode(*key, arg, dashes[0]);
+  *salt_len = base91_decode(*salt, arg + dashes[0] + 1, dashes[1] - dashes[0] - 1);
+  if (!*key_len || !*salt_len || checkparams(*N, *r, *p, *key_len)) {
+    free(*key);
+    free(*salt);
+    *key = 0;
+    *salt = 0;
+    return(error_invalid_hash_format);
   }
-  *p = 0;
-  base91_decode((uint8_t*)p, arg + previous_index, index - previous_index);
   return(0);
 }
 
-uint32_t scrypt_to_string_base91 (
-  uint8_t* password, size_t password_len, uint8_t* salt, size_t salt_len,
-  uint64_t N, uint32_t r, uint32_t p, size_t size, uint8_t** res, size_t* res_len)
-{
-  uint32_t status;
-  status = scrypt_set_defaults(&salt, &salt_len, &size, &N, &r, &p);
-#if verbose
-  printf("with defaults: N %lu, r %d, p %d, key_len %lu, salt_len %lu\n", N, r, p, size, salt_len);
-#endif
-  if (status) { return(status); }
-  uint8_t* derived_key = malloc(size); if (!derived_key) { return(1); }
-  status = crypto_scrypt(password, password_len, salt, salt_len, N, r, p, derived_key, size);
-  if (status) { return(status); }
+uint32_t scrypt_parse_string_base91 (uint8_t* arg, size_t arg_len, uint8_t** key, size_t* key_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
+  uint32_t status = stats_parse(parse_string_base91(arg, arg_len, key, key_len, salt, salt_len, N, r, p));
+  CRYPTO_SCRYPT_PROBE2(parse, "base91", status);
+  return(status);
+}
+
+uint32_t encode_base91 (const uint8_t* key, size_t key_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len) {
   uint32_t logN = (uint32_t)log2f(N);
-  *res = (uint8_t*)malloc(estimate_encoded_length_base91(size, salt_len, N, r, p));
+  *res = (uint8_t*)malloc(estimate_encoded_length_base91(key_len, salt_len, N, r, p));
   if (!*res) { return(1); }
   *res_len = 0;
-  base91_encode_concat(*res, *res_len, derived_key, size);
+  base91_encode_concat(*res, *res_len, key, key_len);
   add_dash(res, res_len);
   base91_encode_concat(*res, *res_len, salt, salt_len);
   add_dash(res, res_len);
@@ -131,29 +298,77 @@ uint32_t scrypt_to_string_base91 (
   return(0);
 }
 
-uint32_t scrypt_parse_string_crypt (const uint8_t* arg, size_t arg_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
-  if (!((arg[0] == '$') && (arg[1] == '7') && (arg[2] == '$'))) {
-    return(error_invalid_hash_format);
-  }
-  uint32_t logN = 0;
+uint32_t to_string_base91 (
+  uint8_t* password, size_t password_len, uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, size_t size, uint8_t** res, size_t* res_len)
+{
+  uint32_t status;
+  status = scrypt_set_defaults(&salt, &salt_len, &size, &N, &r, &p);
+#if verbose
+  printf("with defaults: N %lu, r %d, p %d, key_len %lu, salt_len %lu\n", N, r, p, size, salt_len);
+#endif
+  if (status) { return(status); }
+  uint8_t* derived_key = malloc(size); if (!derived_key) { return(1); }
+  status = crypto_scrypt(password, password_len, salt, salt_len, N, r, p, derived_key, size);
+  if (!status) { status = encode_base91(derived_key, size, salt, salt_len, N, r, p, res, res_len); }
+  free(derived_key);
+  return(status);
+}
+
+uint32_t scrypt_to_string_base91 (uint8_t* password, size_t password_len, uint8_t* salt, size_t salt_len, uint64_t N, uint32_t r, uint32_t p, size_t size, uint8_t** res, size_t* res_len) {
+  return(stats_encode(to_string_base91(password, password_len, salt, salt_len, N, r, p, size, res, res_len)));
+}
+
+/** parse "$7$" logN r p salt "$" key, with logN one character and r and p five. N, r and p must be usable with
+  crypto_scrypt. returns error_invalid_hash_format otherwise, and then salt is not allocated */
+uint32_t parse_string_crypt (const uint8_t* arg, size_t arg_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
+  // crypt format-identifier (3 chars) + parameters (11 chars) + salt (non-limited size) + "$" + key
   size_t index = arg_len;
-  // crypt format-identifier (3 chars) + parameters (11 chars) + salt (non-limited size) + password (43 chars)
-  while (index >= 14) {
-    if (*(arg + index) == '$') {
-      *salt_len = index - 14;
-      *salt = malloc(*salt_len); if (!*salt) { return(1); }
-      memcpy(*salt, arg + 14, *salt_len);
-      if (decode64_one(&logN, *(arg + 3))) { return(1); }
-      *N = (uint64_t)(1) << logN;
-      decode64_uint32(r, 30, arg + 4);
-      decode64_uint32(p, 30, arg + 9);
-    }
-    index -= 1;
+  uint32_t logN;
+  if ((arg_len < 15) || memcmp(arg, "$7$", 3)) { return(error_invalid_hash_format); }
+  // the key has no '$', so the last one ends the salt
+  do { index -= 1; } while ((index > 14) && ('$' != arg[index]));
+  // the string of scrypt_to_string_crypt may include its terminating zero byte
+  if (('$' != arg[index]) || (index + 1 >= arg_len - !arg[arg_len - 1]) || decode64_one(&logN, arg[3])
+    || !decode64_uint32(r, 30, arg + 4) || !decode64_uint32(p, 30, arg + 9)
+    || !logN || (logN > 63) || !*r || !*p || checkparams((uint64_t)(1) << logN, *r, *p, 32)) {
+    return(error_invalid_hash_format);
   }
+  *N = (uint64_t)(1) << logN;
+  *salt_len = index - 14;
+  *salt = malloc(*salt_len + 1); if (!*salt) { return(1); }
+  memcpy(*salt, arg + 14, *salt_len);
   return(0);
 }
 
-uint32_t scrypt_to_string_crypt (
+uint32_t scrypt_parse_string_crypt (const uint8_t* arg, size_t arg_len, uint8_t** salt, size_t* salt_len, uint64_t* N, uint32_t* r, uint32_t* p) {
+  uint32_t status = stats_parse(parse_string_crypt(arg, arg_len, salt, salt_len, N, r, p));
+  CRYPTO_SCRYPT_PROBE2(parse, "crypt", status);
+  return(status);
+}
+
+uint32_t encode_crypt (const uint8_t* key, size_t key_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len) {
+  uint32_t logN = (uint32_t)log2f(N);
+  size_t estimated_len = estimate_encoded_length_base64(key_len, salt_len, N, r, p);
+  uint8_t* res_p;
+  *res = (uint8_t*)malloc(estimated_len);
+  if (!*res) { return(1); }
+  memcpy(*res, "$7$", 3);
+  res_p = *res + 3;
+  *res_p = itoa64[logN];
+  res_p = encode64_uint32(res_p + 1, estimated_len - (res_p - *res), r, 30);
+  res_p = encode64_uint32(res_p, estimated_len - (res_p - *res), p, 30);
+  memcpy(res_p, salt, salt_len);
+  res_p += salt_len;
+  *res_p = '$';
+  res_p = encode64(res_p + 1, estimated_len - (res_p - *res), key, key_len);
+  *res_p = 0;
+  *res_len = (res_p + 1) - *res;
+  return(0);
+}
+
+uint32_t to_string_crypt (
   uint8_t* password, size_t password_len, uint8_t* salt, size_t salt_len,
   uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len)
 {
@@ -171,22 +386,127 @@ uint32_t scrypt_to_string_crypt (
   }
   uint8_t* derived_key = malloc(key_len); if (!derived_key) { return(1); }
   status = crypto_scrypt(password, password_len, salt, salt_len, N, r, p, derived_key, key_len);
-  if (status) { return(status); }
-  uint32_t logN = (uint32_t)log2f(N);
-  size_t estimated_len = estimate_encoded_length_base64(key_len, salt_len, N, r, p);
-  uint8_t* res_p;
-  *res = (uint8_t*)malloc(estimated_len);
-  if (!*res) { return(1); }
-  memcpy(*res, "$7$", 3);
-  res_p = *res + 3;
-  *res_p = itoa64[logN];
-  res_p = encode64_uint32(res_p + 1, estimated_len - (res_p - *res), r, 30);
-  res_p = encode64_uint32(res_p, estimated_len - (res_p - *res), p, 30);
-  memcpy(res_p, salt, salt_len);
-  res_p += salt_len;
-  *res_p = '$';
-  res_p = encode64(res_p + 1, estimated_len - (res_p - *res), derived_key, key_len);
-  *res_p = 0;
-  *res_len = (res_p + 1) - *res;
-  return(0);
+  if (!status) { status = encode_crypt(derived_key, key_len, salt, salt_len, N, r, p, res, res_len); }
+  free(derived_key);
+  return(status);
+}
+
+uint32_t scrypt_to_string_crypt (uint8_t* password, size_t password_len, uint8_t* salt, size_t salt_len, uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len) {
+  return(stats_encode(to_string_crypt(password, password_len, salt, salt_len, N, r, p, res, res_len)));
+}
+
+/** encode a key derived with the given parameters, for example by scrypt_submit, like scrypt_to_string_base91 would */
+uint32_t scrypt_encode_base91 (const uint8_t* key, size_t key_len, const uint8_t* salt, size_t salt_len, uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len) {
+  return(stats_encode(encode_base91(key, key_len, salt, salt_len, N, r, p, res, res_len)));
+}
+
+/** like scrypt_encode_base91 for the format of scrypt_to_string_crypt, which uses 32 byte keys */
+uint32_t scrypt_encode_crypt (const uint8_t* key, size_t key_len, const uint8_t* salt, size_t salt_len, uint64_t N, uint32_t r, uint32_t p, uint8_t** res, size_t* res_len) {
+  return(stats_encode(encode_crypt(key, key_len, salt, salt_len, N, r, p, res, res_len)));
+}
+
+/** compare in time that depends only on the lengths */
+uint8_t scrypt_equal (const uint8_t* a, size_t a_len, const uint8_t* b, size_t b_len) {
+  uint8_t difference = 0;
+  size_t index;
+  if (a_len != b_len) { return(0); }
+  for (index = 0; index < a_len; index += 1) { difference |= a[index] ^ b[index]; }
+  return(!difference);
+}
+
+// derives a key like crypto_scrypt and returns a status
+typedef uint32_t (*verify_derive_t)(const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t*, size_t);
+
+uint32_t verify_derive_direct (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len) {
+  return(crypto_scrypt(password, password_len, salt, salt_len, N, r, p, res, res_len) ? 1 : 0);
+}
+
+uint32_t verify_derive_pooled (const uint8_t* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+  uint64_t N, uint32_t r, uint32_t p, uint8_t* res, size_t res_len) {
+  struct scrypt_job job = {.password = password, .password_len = password_len, .salt = salt, .salt_len = salt_len,
+    .N = N, .r = r, .p = p, .res = res, .res_len = res_len};
+  // a login is waiting for it
+  job.priority = scrypt_priority_interactive;
+  if (scrypt_submit(&job)) { return(1); }
+  return(scrypt_wait(&job));
+}
+
+uint32_t verify_base91 (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len, verify_derive_t derive) {
+  uint8_t* key = 0;
+  uint8_t* salt = 0;
+  size_t key_len = 0;
+  size_t salt_len = 0;
+  uint64_t N = 0;
+  uint32_t r = 0;
+  uint32_t p = 0;
+  uint32_t status = scrypt_parse_string_base91((uint8_t*)hash, hash_len, &key, &key_len, &salt, &salt_len, &N, &r, &p);
+  uint8_t* derived_key = 0;
+  if (!status && !(derived_key = malloc(key_len))) { status = 1; }
+  if (!status) { status = derive(password, password_len, salt, salt_len, N, r, p, derived_key, key_len); }
+  if (!status && !scrypt_equal(key, key_len, derived_key, key_len)) { status = scrypt_error_mismatch; }
+  free(derived_key);
+  free(salt);
+  free(key);
+  return(status);
+}
+
+uint32_t verify_crypt (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len, verify_derive_t derive) {
+  uint8_t* salt = 0;
+  size_t salt_len = 0;
+  uint8_t derived_key[32];
+  uint8_t* res = 0;
+  size_t res_len;
+  uint64_t N = 0;
+  uint32_t r = 0;
+  uint32_t p = 0;
+  uint32_t status = scrypt_parse_string_crypt(hash, hash_len, &salt, &salt_len, &N, &r, &p);
+  if (!status) { status = derive(password, password_len, salt, salt_len, N, r, p, derived_key, 32); }
+  if (!status) { status = encode_crypt(derived_key, 32, salt, salt_len, N, r, p, &res, &res_len); }
+  // the string of scrypt_to_string_crypt is terminated by a zero byte which res_len includes
+  if (hash_len && !hash[hash_len - 1]) { hash_len -= 1; }
+  if (!status && !scrypt_equal(res, res_len - 1, hash, hash_len)) { status = scrypt_error_mismatch; }
+  free(res);
+  free(salt);
+  return(status);
+}
+
+uint32_t verify (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len, verify_derive_t derive) {
+  uint8_t crypt = (hash_len >= 3) && !memcmp(hash, "$7$", 3);
+  if (verify_cache_lookup(password, password_len, hash, hash_len)) {
+    CRYPTO_SCRYPT_PROBE2(verify, crypt ? "crypt" : "base91", 0);
+    return(0);
+  }
+  uint32_t status = crypt ? verify_crypt(password, password_len, hash, hash_len, derive)
+    : verify_base91(password, password_len, hash, hash_len, derive);
+  // only successes are cached, so that guessing is not made cheaper
+  if (!status) { verify_cache_insert(password, password_len, hash, hash_len); }
+  CRYPTO_SCRYPT_PROBE2(verify, crypt ? "crypt" : "base91", status);
+  return(status);
+}
+
+/** test if hash, a string of scrypt_to_string_base91 or scrypt_to_string_crypt, is derived from password.
+  returns 0 if it is, scrypt_error_mismatch if not and scrypt_error_invalid_hash_format if hash is not such a string */
+uint32_t scrypt_verify (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len) {
+  return(verify(password, password_len, hash, hash_len, verify_derive_direct));
+}
+
+/** like scrypt_verify with the derivation performed on the worker pool */
+uint32_t scrypt_verify_pooled (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len) {
+  return(verify(password, password_len, hash, hash_len, verify_derive_pooled));
+}
+
+/** N, r and p of a string of scrypt_to_string_base91 or scrypt_to_string_crypt, for example to refuse verifying
+  hashes that take too long. returns scrypt_error_invalid_hash_format if hash is not such a string */
+uint32_t scrypt_hash_parameters (const uint8_t* hash, size_t hash_len, uint64_t* N, uint32_t* r, uint32_t* p) {
+  uint8_t* key = 0;
+  uint8_t* salt = 0;
+  size_t key_len;
+  size_t salt_len;
+  uint32_t status = ((hash_len >= 3) && !memcmp(hash, "$7$", 3))
+    ? parse_string_crypt(hash, hash_len, &salt, &salt_len, N, r, p)
+    : parse_string_base91((uint8_t*)hash, hash_len, &key, &key_len, &salt, &salt_len, N, r, p);
+  free(key);
+  free(salt);
+  return(status);
 }
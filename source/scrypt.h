@@ -1,7 +1,278 @@
+#ifndef scrypt_h
+#define scrypt_h
+
+// scrypt_config.v_pool_flags
+#define scrypt_v_pool_mlock 1
+#define scrypt_v_pool_nodump 2
+
+// scrypt_config.placement of pool workers
+#define scrypt_placement_none 0
+#define scrypt_placement_cores 1
+#define scrypt_placement_nosmt 2
+#define scrypt_placement_pack 3
+
+struct scrypt_config {
+  // number and size in bytes of pre-faulted V regions shared by all derivations. size 0 is 16MiB (N 16384, r 8)
+  size_t v_pool_count;
+  size_t v_pool_size;
+  uint32_t v_pool_flags;
+  // worker pool for scrypt_submit and scrypt_batch. workers 0 is the number of usable cpus
+  uint32_t workers;
+  uint32_t placement;
+  // cpu list like "0-3,8" to place workers on instead of the affinity mask
+  const char* cpus;
+  // size in bytes of the V arena that each worker allocates on its cpu. 0 is 16MiB
+  size_t worker_arena_size;
+  // posix shared memory segment like "/scrypt" that bounds V memory of all processes on the host:
+  // at most shm_budget bytes mapped on demand plus shm_slab_count pre-faulted slabs. slab size 0 is 16MiB
+  const char* shm_name;
+  size_t shm_budget;
+  size_t shm_slab_count;
+  size_t shm_slab_size;
+  // largest V in bytes that is stored in full, larger ones are partly recomputed. 0 is the memory limit of the system
+  size_t max_v_size;
+  // largest B (128 * r * p bytes) that is held in full, for larger p the lanes are computed one after another holding only 128 * r bytes. 0 is 16MiB
+  size_t max_b_size;
+  // directory for an unlinked temporary file holding V when V is larger than v_file_threshold bytes, for N beyond physical memory.
+  // the file is mapped, or with v_file_direct read and written with O_DIRECT through a cache of v_file_cache_size bytes. 0 is 16MiB
+  const char* v_file_dir;
+  size_t v_file_threshold;
+  uint8_t v_file_direct;
+  size_t v_file_cache_size;
+  // read hardware counters with perf_event_open around the smix loops and pbkdf2 for scrypt_timed, the timing hook and scrypt_stats.
+  // costs a few system calls per derivation. ignored where perf_event_open is not permitted
+  uint8_t perf_counters;
+  // most workers that run bulk jobs at the same time. 0 is a quarter of the workers, at least one
+  uint32_t bulk_workers;
+  // remember up to about verify_cache_size successful scrypt_verify calls for verify_cache_ttl milliseconds (0 is 5000)
+  // and answer repeated ones without deriving. 0 disables the cache
+  size_t verify_cache_size;
+  uint32_t verify_cache_ttl;
+  // microseconds a worker waits for more jobs with the same N and r to derive them together. 0 does not wait
+  uint32_t batch_linger;
+  // threads besides the workers that run the pbkdf2 steps of queued jobs, so that the workers mostly run smix. 0 disables the stages
+  uint32_t stage_workers;
+  // limit the workers that derive at the same time to the number that gives the most derivations per second
+  uint8_t adaptive_concurrency;
+  // halve the workers that derive at the same time for every pressure_window milliseconds (0 is 2000) in which some tasks
+  // stalled on memory or cpu for longer than these percentages, per the pressure stall information of linux, and raise
+  // them again by one per window without. 0 does not watch the resource
+  uint8_t pressure_memory;
+  uint8_t pressure_cpu;
+  uint32_t pressure_window;
+  // use the smix loops for any r also where loops unrolled for r 1, 8 or 16 exist. for comparing them, see scrypt-bench
+  uint8_t generic_smix;
+  // time every derivation for scrypt_stats_snapshot from now on. also started by the first snapshot
+  uint8_t stats;
+};
+
+// i/o of derivations with V in a file, totals of the process
+struct scrypt_v_file_stats {
+  uint64_t derivations;
+  // major page faults with mapped files
+  uint64_t major_faults;
+  // with v_file_direct
+  uint64_t writes;
+  uint64_t bytes_written;
+  uint64_t reads;
+  uint64_t bytes_read;
+  uint64_t cache_hits;
+};
+
+// scrypt_job.priority. queued interactive jobs start before normal ones and those before bulk ones
+#define scrypt_priority_normal 0
+#define scrypt_priority_interactive 1
+#define scrypt_priority_bulk 2
+
+struct scrypt_job {
+  const uint8_t* password;
+  size_t password_len;
+  const uint8_t* salt;
+  size_t salt_len;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+  uint8_t* res;
+  size_t res_len;
+  uint32_t status;
+  // optional, see scrypt_cancellable
+  const volatile int* cancel;
+  uint64_t deadline;
+  // optional, scrypt_priority_*
+  uint8_t priority;
+  // used internally
+  struct scrypt_job* next;
+  void* lanes;
+  uint64_t cost_ns;
+  uint64_t started;
+  uint8_t flight_key[32];
+  struct scrypt_job* flight_next;
+  struct scrypt_job* followers;
+  uint8_t done;
+};
+
+// statuses of scrypt_cancellable and jobs, besides 0 for success and 1 for other errors
+#define scrypt_error_canceled 3
+#define scrypt_error_deadline 4
+// scrypt_parse_string_* and scrypt_verify: the string is not one of scrypt_to_string_*
+#define scrypt_error_invalid_hash_format 2
+// scrypt_verify
+#define scrypt_error_mismatch 5
+// scrypt_submit: the job would not finish before its deadline
+#define scrypt_error_unreachable 6
+// scrypt-kdfd: the parameters of the request exceed the limit of the daemon
+#define scrypt_error_limit 7
+
+// hardware counters of the deriving thread. 0 where the cpu or kernel does not provide one
+struct scrypt_perf_counts {
+  uint64_t cycles;
+  uint64_t instructions;
+  // last level cache and data tlb load misses
+  uint64_t cache_misses;
+  uint64_t dtlb_misses;
+  // cycles stalled in the back end, mostly waiting for memory
+  uint64_t stalled_cycles;
+};
+
+// where the time of a derivation went, in nanoseconds
+struct scrypt_timing {
+  uint64_t alloc_ns;
+  uint64_t pbkdf2_in_ns;
+  uint64_t loop1_ns;
+  uint64_t loop2_ns;
+  uint64_t pbkdf2_out_ns;
+  uint64_t free_ns;
+  uint64_t total_ns;
+  // optional, set by the caller of scrypt_timed: loop 1 and 2 of lane i are stored at 2 * i and 2 * i + 1 for i < lane_count
+  uint64_t* lane_ns;
+  size_t lane_count;
+  // smix kernel: generic, generic-r1, generic-r8, generic-r16, sse2, tmto or io. v allocation: heap, mmap, pool, arena, shm, file or file-direct
+  const char* kernel;
+  const char* v_allocation;
+  // with scrypt_config.perf_counters, if the counters could be read. pbkdf2 covers steps 1 and 5
+  uint8_t perf;
+  struct scrypt_perf_counts loop1_perf;
+  struct scrypt_perf_counts loop2_perf;
+  struct scrypt_perf_counts pbkdf2_perf;
+};
+
+// sizes of struct scrypt_stats
+#define scrypt_stats_buckets 122
+#define scrypt_stats_errnos 16
+#define scrypt_stats_parameter_sets 64
+#define scrypt_stats_kernels 4
+#define scrypt_stats_perf_sections 3
+#define scrypt_stats_stages 3
+
+// log-linear latency histogram of successful derivations. bucket i counts durations below scrypt_stats_bucket_bound(i) nanoseconds
+struct scrypt_stats_histogram {
+  // the parameter set, or for histograms by kernel its name
+  uint32_t logN;
+  uint32_t r;
+  uint32_t p;
+  const char* kernel;
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[scrypt_stats_buckets];
+};
+
+// a stage of the worker pool: prepare (pbkdf2 of step 1 on stage workers), mix (everything the workers do) or finish
+// (pbkdf2 of step 5 on stage workers). its utilization over an interval is the increase of busy_ns divided by the
+// length of the interval and by workers
+struct scrypt_stats_stage {
+  const char* stage;
+  uint32_t workers;
+  uint64_t jobs;
+  uint64_t busy_ns;
+};
+
+// counters of the process since it started
+struct scrypt_stats {
+  // derivations, including those of the encoding functions and the worker pool
+  uint64_t calls;
+  uint64_t failures;
+  // failures per errno value, for the first scrypt_stats_errnos distinct values. 0 marks unused entries
+  int failure_errno[scrypt_stats_errnos];
+  uint64_t failures_by_errno[scrypt_stats_errnos];
+  // total size of all V allocated
+  uint64_t v_bytes;
+  uint64_t concurrent;
+  uint64_t peak_concurrent;
+  // scrypt_to_string_* and scrypt_parse_string_*
+  uint64_t encodes;
+  uint64_t encode_failures;
+  uint64_t parses;
+  uint64_t parse_failures;
+  // per (log2 N, r, p), for the first scrypt_stats_parameter_sets distinct sets
+  size_t histogram_count;
+  struct scrypt_stats_histogram histograms[scrypt_stats_parameter_sets];
+  // per smix kernel: generic, sse2, tmto, io
+  struct scrypt_stats_histogram kernels[scrypt_stats_kernels];
+  // successful derivations with hardware counters and the sums of their counters per section: loop1, loop2, pbkdf2
+  uint64_t perf_derivations;
+  struct scrypt_perf_counts perf[scrypt_stats_perf_sections];
+  // worker pool stages, see stage_workers in scrypt_init
+  struct scrypt_stats_stage stages[scrypt_stats_stages];
+  // most workers that derive at the same time: all, or with adaptive_concurrency the current limit. 0 while the pool is stopped
+  uint32_t concurrency_limit;
+  // with pressure_memory or pressure_cpu, the most workers that derive at the same time under the current pressure, else 0
+  uint32_t pressure_limit;
+  // windows in which the pressure crossed a threshold and pressure_limit was halved
+  uint64_t pressure_throttles;
+};
+
+// a configuration of the smix kernels, see scrypt_autotune
+struct scrypt_tuning {
+  // "generic" or "sse2"
+  const char* kernel;
+  // derivations with the same N and r that batches of the worker pool mix together, 1 to 4
+  uint32_t interleave;
+  // prefetch the blocks of V read next when mixing together
+  uint8_t prefetch;
+  // transparent huge pages for mapped V
+  uint8_t hugepages;
+  // derivations per second on one thread when it was measured
+  double rate;
+};
+
+// scrypt_step results
+#define scrypt_step_done 0
+#define scrypt_step_more 1
+
+// a derivation performed in slices
+struct scrypt_state;
+
 int scrypt(const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t*, size_t);
+uint32_t scrypt_cancellable (const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t*, size_t, const volatile int*, uint64_t);
+uint64_t scrypt_deadline_after (uint64_t);
+uint32_t scrypt_timed (const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t*, size_t, struct scrypt_timing*);
+void scrypt_set_timing_hook (void (*)(const struct scrypt_timing*));
+void scrypt_stats_snapshot (struct scrypt_stats*);
+uint64_t scrypt_stats_bucket_bound (uint32_t);
+uint32_t scrypt_stats_text (const struct scrypt_stats*, uint8_t**, size_t*);
+uint32_t scrypt_init (const struct scrypt_config*);
+void scrypt_deinit ();
+uint32_t scrypt_submit (struct scrypt_job*);
+uint32_t scrypt_wait (struct scrypt_job*);
+uint32_t scrypt_batch (struct scrypt_job*, size_t);
+void scrypt_v_file_stats (struct scrypt_v_file_stats*);
+uint32_t scrypt_state_new (const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t*, size_t, struct scrypt_state**);
+uint32_t scrypt_step (struct scrypt_state*, uint64_t);
+void scrypt_state_free (struct scrypt_state*);
 uint32_t scrypt_set_defaults (uint8_t**, size_t*, size_t*, uint64_t*, uint32_t*, uint32_t*);
-uint8_t scrypt_to_string_base91 (uint8_t*, size_t, uint8_t*, size_t, uint64_t, uint32_t, uint32_t, size_t, uint8_t**, size_t*);
+uint32_t scrypt_to_string_base91 (uint8_t*, size_t, uint8_t*, size_t, uint64_t, uint32_t, uint32_t, size_t, uint8_t**, size_t*);
 uint32_t scrypt_parse_string_base91 (uint8_t*, size_t, uint8_t**, size_t*, uint8_t**, size_t*, uint64_t*, uint32_t*, uint32_t*);
-uint8_t scrypt_to_string_crypt (uint8_t*, size_t, uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t**, size_t*);
+uint32_t scrypt_to_string_crypt (uint8_t*, size_t, uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t**, size_t*);
 uint32_t scrypt_parse_string_crypt (const uint8_t*, size_t, uint8_t**, size_t*, uint64_t*, uint32_t*, uint32_t*);
+uint32_t scrypt_encode_base91 (const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t**, size_t*);
+uint32_t scrypt_encode_crypt (const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, uint8_t**, size_t*);
+uint8_t scrypt_equal (const uint8_t*, size_t, const uint8_t*, size_t);
+uint32_t scrypt_verify (const uint8_t*, size_t, const uint8_t*, size_t);
+uint32_t scrypt_verify_pooled (const uint8_t*, size_t, const uint8_t*, size_t);
+uint32_t scrypt_hash_parameters (const uint8_t*, size_t, uint64_t*, uint32_t*, uint32_t*);
+uint32_t scrypt_calibrate (size_t, double, uint64_t*, uint32_t*, uint32_t*);
 uint8_t* scrypt_strerror (uint32_t);
+uint32_t scrypt_autotune (uint64_t, uint32_t, const char*, uint8_t, struct scrypt_tuning*);
+uint32_t scrypt_set_tuning (const struct scrypt_tuning*);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef scrypt_kdfd_h
+#define scrypt_kdfd_h
+
+#include <stdint.h>
+#include <stddef.h>
+// statuses are those of scrypt.h
+#include "scrypt.h"
+
+#define scrypt_kdfd_default_socket "/run/scrypt-kdfd.socket"
+
+// scrypt_kdfd_hash formats
+#define scrypt_kdfd_format_base91 0
+#define scrypt_kdfd_format_crypt 1
+
+// wire format. requests and responses are sent in host byte order, the socket is local.
+// a request is followed by password_len bytes of password and data_len bytes of salt (hash) or hash string (verify)
+#define scrypt_kdfd_version 1
+#define scrypt_kdfd_op_hash 1
+#define scrypt_kdfd_op_verify 2
+#define scrypt_kdfd_op_calibrate 3
+// largest password, salt or hash string
+#define scrypt_kdfd_max_data 4096
+
+struct scrypt_kdfd_request {
+  uint8_t version;
+  uint8_t op;
+  uint8_t format;
+  uint8_t reserved;
+  uint32_t password_len;
+  uint32_t data_len;
+  uint32_t r;
+  uint32_t p;
+  // hash: key length in bytes. calibrate: derivation time in milliseconds
+  uint32_t size;
+  // calibrate: largest V in bytes
+  uint64_t N;
+};
+
+// followed by data_len bytes of hash string (hash). N, r and p are set by calibrate
+struct scrypt_kdfd_response {
+  uint32_t status;
+  uint32_t data_len;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+};
+
+uint32_t scrypt_kdfd_connect (const char*, int*);
+void scrypt_kdfd_close (int);
+uint32_t scrypt_kdfd_hash (int, const uint8_t*, size_t, const uint8_t*, size_t, uint64_t, uint32_t, uint32_t, size_t, uint8_t, uint8_t**, size_t*);
+uint32_t scrypt_kdfd_verify (int, const uint8_t*, size_t, const uint8_t*, size_t);
+uint32_t scrypt_kdfd_calibrate (int, uint64_t, uint32_t, uint64_t*, uint32_t*, uint32_t*);
+
+#endif
@@ -0,0 +1,442 @@
+/* library-wide counters and latency histograms.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <inttypes.h>
+#include <stdarg.h>
+
+// histogram buckets: below 1us, then four per power of two up to 2^40ns (about 18 minutes), then the rest
+#define stats_min_exponent 10
+#define stats_max_exponent 40
+#define stats_add(a, n) __atomic_fetch_add(&(a), n, __ATOMIC_RELAXED)
+#define stats_load(a) __atomic_load_n(&(a), __ATOMIC_RELAXED)
+// states of a histogram or errno table entry
+#define stats_entry_free 0
+#define stats_entry_claimed 1
+#define stats_entry_ready 2
+// worker pool stages
+#define stats_stage_prepare 0
+#define stats_stage_mix 1
+#define stats_stage_finish 2
+
+struct stats_histogram {
+  uint32_t state;
+  uint32_t logN;
+  uint32_t r;
+  uint32_t p;
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[scrypt_stats_buckets];
+};
+
+struct stats {
+  uint64_t calls;
+  uint64_t failures;
+  int failure_errno[scrypt_stats_errnos];
+  uint64_t failures_by_errno[scrypt_stats_errnos];
+  uint64_t v_bytes;
+  uint64_t concurrent;
+  uint64_t peak_concurrent;
+  uint64_t encodes;
+  uint64_t encode_failures;
+  uint64_t parses;
+  uint64_t parse_failures;
+  struct stats_histogram histograms[scrypt_stats_parameter_sets];
+  struct stats_histogram kernels[scrypt_stats_kernels];
+  uint64_t perf_derivations;
+  struct crypto_scrypt_perf_counts perf[scrypt_stats_perf_sections];
+  uint32_t stage_workers[scrypt_stats_stages];
+  uint64_t stage_jobs[scrypt_stats_stages];
+  uint64_t stage_busy_ns[scrypt_stats_stages];
+  uint32_t concurrency_limit;
+  uint32_t pressure_limit;
+  uint64_t pressure_throttles;
+  uint8_t enabled;
+};
+
+static struct stats stats;
+static const char* stats_kernel_names[scrypt_stats_kernels] = {"generic", "sse2", "tmto", "io"};
+static const char* stats_perf_sections[scrypt_stats_perf_sections] = {"loop1", "loop2", "pbkdf2"};
+static const char* stats_stage_names[scrypt_stats_stages] = {"prepare", "mix", "finish"};
+
+/** upper bound in nanoseconds of the durations counted in bucket index. the last bucket has no bound and returns UINT64_MAX */
+uint64_t scrypt_stats_bucket_bound (uint32_t index) {
+  if (!index) { return((uint64_t)1 << stats_min_exponent); }
+  if (index >= scrypt_stats_buckets - 1) { return(UINT64_MAX); }
+  uint64_t base = (uint64_t)1 << (stats_min_exponent + (index - 1) / 4);
+  return(base + (base >> 2) * ((index - 1) % 4 + 1));
+}
+
+uint32_t stats_bucket (uint64_t ns) {
+  if (ns < ((uint64_t)1 << stats_min_exponent)) { return(0); }
+  uint32_t exponent = 63 - __builtin_clzll(ns);
+  if (exponent >= stats_max_exponent) { return(scrypt_stats_buckets - 1); }
+  return(1 + (exponent - stats_min_exponent) * 4 + ((ns >> (exponent - 2)) & 3));
+}
+
+void stats_histogram_add (struct stats_histogram* a, uint64_t ns) {
+  stats_add(a->count, 1);
+  stats_add(a->sum_ns, ns);
+  stats_add(a->buckets[stats_bucket(ns)], 1);
+}
+
+/** find or claim the entry for a parameter set without locking. returns 0 if the table is full */
+struct stats_histogram* stats_histogram_find (uint64_t N, uint32_t r, uint32_t p) {
+  uint32_t logN = (uint32_t)(63 - __builtin_clzll(N));
+  uint32_t start = (logN * 31 + r * 17 + p) % scrypt_stats_parameter_sets;
+  uint32_t index;
+  uint32_t state;
+  struct stats_histogram* a;
+  for (index = 0; index < scrypt_stats_parameter_sets; index += 1) {
+    a = stats.histograms + (start + index) % scrypt_stats_parameter_sets;
+    state = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+    if (stats_entry_free == state) {
+      if (__atomic_compare_exchange_n(&a->state, &state, stats_entry_claimed, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        a->logN = logN;
+        a->r = r;
+        a->p = p;
+        __atomic_store_n(&a->state, stats_entry_ready, __ATOMIC_RELEASE);
+        return(a);
+      }
+    }
+    // another thread is filling in the key
+    while (stats_entry_claimed == state) { state = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE); }
+    if ((a->logN == logN) && (a->r == r) && (a->p == p)) { return(a); }
+  }
+  return(0);
+}
+
+/** mean duration in nanoseconds of successful derivations with these parameters. for parameters that were not measured
+  yet, the mean time per salsa20/8 core of all measured derivations times the 4 * N * r * p cores. 0 if nothing was measured */
+uint64_t stats_predict_ns (uint64_t N, uint32_t r, uint32_t p) {
+  uint32_t logN = (uint32_t)(63 - __builtin_clzll(N));
+  uint32_t index;
+  uint64_t count;
+  double ns = 0;
+  double cores = 0;
+  struct stats_histogram* a;
+  for (index = 0; index < scrypt_stats_parameter_sets; index += 1) {
+    a = stats.histograms + index;
+    if (stats_entry_ready != __atomic_load_n(&a->state, __ATOMIC_ACQUIRE)) { continue; }
+    count = stats_load(a->count);
+    if (!count) { continue; }
+    if ((a->logN == logN) && (a->r == r) && (a->p == p)) { return(stats_load(a->sum_ns) / count); }
+    ns += stats_load(a->sum_ns);
+    cores += 4.0 * ((uint64_t)1 << a->logN) * a->r * a->p * count;
+  }
+  return(cores ? (uint64_t)(ns / cores * 4.0 * N * r * p) : 0);
+}
+
+void stats_count_errno (int error) {
+  uint32_t index;
+  int current;
+  for (index = 0; index < scrypt_stats_errnos; index += 1) {
+    current = __atomic_load_n(stats.failure_errno + index, __ATOMIC_RELAXED);
+    if (!current) {
+      if (__atomic_compare_exchange_n(stats.failure_errno + index, &current, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        current = error;
+      }
+    }
+    if (current == error) {
+      stats_add(stats.failures_by_errno[index], 1);
+      return;
+    }
+  }
+}
+
+void stats_perf_add (struct crypto_scrypt_perf_counts* a, const struct crypto_scrypt_perf_counts* b) {
+  stats_add(a->cycles, b->cycles);
+  stats_add(a->instructions, b->instructions);
+  stats_add(a->cache_misses, b->cache_misses);
+  stats_add(a->dtlb_misses, b->dtlb_misses);
+  stats_add(a->stalls, b->stalls);
+}
+
+void stats_begin () {
+  uint64_t concurrent = stats_add(stats.concurrent, 1) + 1;
+  uint64_t peak = stats_load(stats.peak_concurrent);
+  while ((concurrent > peak)
+    && !__atomic_compare_exchange_n(&stats.peak_concurrent, &peak, concurrent, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stats_end (uint64_t N, uint32_t r, uint32_t p, const struct crypto_scrypt_timing* timing, int error) {
+  uint32_t index;
+  size_t length;
+  struct stats_histogram* a;
+  __atomic_fetch_sub(&stats.concurrent, 1, __ATOMIC_RELAXED);
+  stats_add(stats.calls, 1);
+  stats_add(stats.v_bytes, timing->vlen);
+  if (error) {
+    stats_add(stats.failures, 1);
+    stats_count_errno(error);
+    return;
+  }
+  a = stats_histogram_find(N, r, p);
+  if (a) { stats_histogram_add(a, timing->total); }
+  // generic-r8 and the other unrolled generic kernels count as generic
+  for (index = 0; index < scrypt_stats_kernels; index += 1) {
+    length = strlen(stats_kernel_names[index]);
+    if (timing->kernel && !strncmp(timing->kernel, stats_kernel_names[index], length)
+      && (!timing->kernel[length] || ('-' == timing->kernel[length]))) {
+      stats_histogram_add(stats.kernels + index, timing->total);
+    }
+  }
+  if (timing->perf) {
+    stats_add(stats.perf_derivations, 1);
+    stats_perf_add(stats.perf, &timing->perf_loop1);
+    stats_perf_add(stats.perf + 1, &timing->perf_loop2);
+    stats_perf_add(stats.perf + 2, &timing->perf_pbkdf2);
+  }
+}
+
+/** count a call of an encoding or parsing function and pass its status through */
+uint32_t stats_encode (uint32_t status) {
+  stats_add(stats.encodes, 1);
+  if (status) { stats_add(stats.encode_failures, 1); }
+  return(status);
+}
+
+uint32_t stats_parse (uint32_t status) {
+  stats_add(stats.parses, 1);
+  if (status) { stats_add(stats.parse_failures, 1); }
+  return(status);
+}
+
+/** record a job or lane that a worker of the pool was busy with for ns nanoseconds */
+void stats_stage_add (uint32_t stage, uint64_t ns) {
+  stats_add(stats.stage_jobs[stage], 1);
+  stats_add(stats.stage_busy_ns[stage], ns);
+}
+
+/** set the number of threads that serve the stages when the pool starts or stops */
+void stats_stage_workers (uint32_t workers, uint32_t stage_workers) {
+  __atomic_store_n(stats.stage_workers + stats_stage_prepare, stage_workers, __ATOMIC_RELAXED);
+  __atomic_store_n(stats.stage_workers + stats_stage_mix, workers, __ATOMIC_RELAXED);
+  __atomic_store_n(stats.stage_workers + stats_stage_finish, stage_workers, __ATOMIC_RELAXED);
+}
+
+void stats_concurrency_limit (uint32_t limit) {
+  __atomic_store_n(&stats.concurrency_limit, limit, __ATOMIC_RELAXED);
+}
+
+void stats_pressure_limit (uint32_t limit) {
+  __atomic_store_n(&stats.pressure_limit, limit, __ATOMIC_RELAXED);
+}
+
+void stats_pressure_throttle () {
+  __atomic_add_fetch(&stats.pressure_throttles, 1, __ATOMIC_RELAXED);
+}
+
+/** observe derivations from now on. until then, they are not timed for the statistics and cost nothing extra */
+void stats_enable () {
+  if (!__atomic_exchange_n(&stats.enabled, 1, __ATOMIC_RELAXED)) { crypto_scrypt_set_observer(stats_begin, stats_end); }
+}
+
+void stats_histogram_copy (struct stats_histogram* a, struct scrypt_stats_histogram* b) {
+  uint32_t index;
+  b->count = stats_load(a->count);
+  b->sum_ns = stats_load(a->sum_ns);
+  for (index = 0; index < scrypt_stats_buckets; index += 1) { b->buckets[index] = stats_load(a->buckets[index]); }
+}
+
+/** copy all counters. each counter is read atomically, but not all of them at the same instant */
+void scrypt_stats_snapshot (struct scrypt_stats* a) {
+  uint32_t index;
+  stats_enable();
+  memset(a, 0, sizeof(*a));
+  a->calls = stats_load(stats.calls);
+  a->failures = stats_load(stats.failures);
+  for (index = 0; index < scrypt_stats_errnos; index += 1) {
+    a->failure_errno[index] = __atomic_load_n(stats.failure_errno + index, __ATOMIC_RELAXED);
+    a->failures_by_errno[index] = stats_load(stats.failures_by_errno[index]);
+  }
+  a->v_bytes = stats_load(stats.v_bytes);
+  a->concurrent = stats_load(stats.concurrent);
+  a->peak_concurrent = stats_load(stats.peak_concurrent);
+  a->encodes = stats_load(stats.encodes);
+  a->encode_failures = stats_load(stats.encode_failures);
+  a->parses = stats_load(stats.parses);
+  a->parse_failures = stats_load(stats.parse_failures);
+  for (index = 0; index < scrypt_stats_parameter_sets; index += 1) {
+    struct stats_histogram* b = stats.histograms + index;
+    if (stats_entry_ready != __atomic_load_n(&b->state, __ATOMIC_ACQUIRE)) { continue; }
+    struct scrypt_stats_histogram* c = a->histograms + a->histogram_count;
+    c->logN = b->logN;
+    c->r = b->r;
+    c->p = b->p;
+    stats_histogram_copy(b, c);
+    a->histogram_count += 1;
+  }
+  for (index = 0; index < scrypt_stats_kernels; index += 1) {
+    a->kernels[index].kernel = stats_kernel_names[index];
+    stats_histogram_copy(stats.kernels + index, a->kernels + index);
+  }
+  a->perf_derivations = stats_load(stats.perf_derivations);
+  for (index = 0; index < scrypt_stats_perf_sections; index += 1) {
+    a->perf[index].cycles = stats_load(stats.perf[index].cycles);
+    a->perf[index].instructions = stats_load(stats.perf[index].instructions);
+    a->perf[index].cache_misses = stats_load(stats.perf[index].cache_misses);
+    a->perf[index].dtlb_misses = stats_load(stats.perf[index].dtlb_misses);
+    a->perf[index].stalled_cycles = stats_load(stats.perf[index].stalls);
+  }
+  for (index = 0; index < scrypt_stats_stages; index += 1) {
+    a->stages[index].stage = stats_stage_names[index];
+    a->stages[index].workers = stats_load(stats.stage_workers[index]);
+    a->stages[index].jobs = stats_load(stats.stage_jobs[index]);
+    a->stages[index].busy_ns = stats_load(stats.stage_busy_ns[index]);
+  }
+  a->concurrency_limit = stats_load(stats.concurrency_limit);
+  a->pressure_limit = stats_load(stats.pressure_limit);
+  a->pressure_throttles = stats_load(stats.pressure_throttles);
+}
+
+struct stats_text {
+  uint8_t* data;
+  size_t len;
+  size_t size;
+};
+
+uint32_t stats_printf (struct stats_text* a, const char* format, ...) {
+  va_list args;
+  int len;
+  while (1) {
+    va_start(args, format);
+    len = vsnprintf((char*)a->data + a->len, a->size - a->len, format, args);
+    va_end(args);
+    if (len < 0) { return(1); }
+    if (a->len + len < a->size) { break; }
+    a->size = 2 * (a->size + len);
+    uint8_t* data = realloc(a->data, a->size); if (!data) { return(1); }
+    a->data = data;
+  }
+  a->len += len;
+  return(0);
+}
+
+uint32_t stats_text_histogram (struct stats_text* a, const char* name, const char* labels, const struct scrypt_stats_histogram* b) {
+  uint32_t index;
+  uint64_t cumulative = 0;
+  for (index = 0; index < scrypt_stats_buckets - 1; index += 1) {
+    cumulative += b->buckets[index];
+    if (stats_printf(a, "%s_bucket{%s,le=\"%.9f\"} %" PRIu64 "\n", name, labels,
+      (double)scrypt_stats_bucket_bound(index) / 1e9, cumulative)) { return(1); }
+  }
+  if (stats_printf(a, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name, labels, b->count)
+    || stats_printf(a, "%s_sum{%s} %.9f\n", name, labels, (double)b->sum_ns / 1e9)
+    || stats_printf(a, "%s_count{%s} %" PRIu64 "\n", name, labels, b->count)) { return(1); }
+  return(0);
+}
+
+uint32_t stats_text_perf_metric (struct stats_text* a, const char* name, const uint64_t* values) {
+  uint32_t index;
+  if (stats_printf(a, "# TYPE %s counter\n", name)) { return(1); }
+  for (index = 0; index < scrypt_stats_perf_sections; index += 1) {
+    if (stats_printf(a, "%s{section=\"%s\"} %" PRIu64 "\n", name, stats_perf_sections[index], values[index])) { return(1); }
+  }
+  return(0);
+}
+
+/** hardware counter sums per section, only if any derivation had them */
+uint32_t stats_text_perf (const struct scrypt_stats* a, struct stats_text* b) {
+  uint64_t cycles[scrypt_stats_perf_sections];
+  uint64_t instructions[scrypt_stats_perf_sections];
+  uint64_t cache_misses[scrypt_stats_perf_sections];
+  uint64_t dtlb_misses[scrypt_stats_perf_sections];
+  uint64_t stalled_cycles[scrypt_stats_perf_sections];
+  uint32_t index;
+  if (!a->perf_derivations) { return(0); }
+  for (index = 0; index < scrypt_stats_perf_sections; index += 1) {
+    cycles[index] = a->perf[index].cycles;
+    instructions[index] = a->perf[index].instructions;
+    cache_misses[index] = a->perf[index].cache_misses;
+    dtlb_misses[index] = a->perf[index].dtlb_misses;
+    stalled_cycles[index] = a->perf[index].stalled_cycles;
+  }
+  return(stats_printf(b, "# TYPE scrypt_perf_derivations_total counter\nscrypt_perf_derivations_total %" PRIu64 "\n", a->perf_derivations)
+    || stats_text_perf_metric(b, "scrypt_perf_cycles_total", cycles)
+    || stats_text_perf_metric(b, "scrypt_perf_instructions_total", instructions)
+    || stats_text_perf_metric(b, "scrypt_perf_cache_misses_total", cache_misses)
+    || stats_text_perf_metric(b, "scrypt_perf_dtlb_misses_total", dtlb_misses)
+    || stats_text_perf_metric(b, "scrypt_perf_stalled_cycles_total", stalled_cycles));
+}
+
+/** worker pool stages and concurrency, only once the pool was started */
+uint32_t stats_text_stages (const struct scrypt_stats* a, struct stats_text* b) {
+  uint32_t index;
+  if (!a->stages[stats_stage_mix].workers && !a->stages[stats_stage_mix].jobs) { return(0); }
+  if (stats_printf(b, "# TYPE scrypt_concurrency_limit gauge\nscrypt_concurrency_limit %u\n", a->concurrency_limit)
+    || stats_printf(b, "# TYPE scrypt_pressure_limit gauge\nscrypt_pressure_limit %u\n", a->pressure_limit)
+    || stats_printf(b, "# TYPE scrypt_pressure_throttles_total counter\nscrypt_pressure_throttles_total %" PRIu64 "\n", a->pressure_throttles)
+    || stats_printf(b, "# TYPE scrypt_stage_workers gauge\n")) { return(1); }
+  for (index = 0; index < scrypt_stats_stages; index += 1) {
+    if (stats_printf(b, "scrypt_stage_workers{stage=\"%s\"} %u\n", a->stages[index].stage, a->stages[index].workers)) { return(1); }
+  }
+  if (stats_printf(b, "# TYPE scrypt_stage_jobs_total counter\n")) { return(1); }
+  for (index = 0; index < scrypt_stats_stages; index += 1) {
+    if (stats_printf(b, "scrypt_stage_jobs_total{stage=\"%s\"} %" PRIu64 "\n", a->stages[index].stage, a->stages[index].jobs)) { return(1); }
+  }
+  if (stats_printf(b, "# TYPE scrypt_stage_busy_seconds_total counter\n")) { return(1); }
+  for (index = 0; index < scrypt_stats_stages; index += 1) {
+    if (stats_printf(b, "scrypt_stage_busy_seconds_total{stage=\"%s\"} %.9f\n", a->stages[index].stage,
+      (double)a->stages[index].busy_ns / 1e9)) { return(1); }
+  }
+  return(0);
+}
+
+uint32_t stats_text_write (const struct scrypt_stats* a, struct stats_text* b) {
+  char labels[64];
+  uint32_t index;
+  if (stats_printf(b, "# TYPE scrypt_calls_total counter\nscrypt_calls_total %" PRIu64 "\n", a->calls)
+    || stats_printf(b, "# TYPE scrypt_failures_total counter\nscrypt_failures_total %" PRIu64 "\n", a->failures)) { return(1); }
+  for (index = 0; index < scrypt_stats_errnos; index += 1) {
+    if (!a->failure_errno[index]) { continue; }
+    if (stats_printf(b, "scrypt_failures_by_errno_total{errno=\"%d\"} %" PRIu64 "\n",
+      a->failure_errno[index], a->failures_by_errno[index])) { return(1); }
+  }
+  if (stats_printf(b, "# TYPE scrypt_v_bytes_total counter\nscrypt_v_bytes_total %" PRIu64 "\n", a->v_bytes)
+    || stats_printf(b, "# TYPE scrypt_concurrent gauge\nscrypt_concurrent %" PRIu64 "\n", a->concurrent)
+    || stats_printf(b, "# TYPE scrypt_concurrent_peak gauge\nscrypt_concurrent_peak %" PRIu64 "\n", a->peak_concurrent)
+    || stats_printf(b, "# TYPE scrypt_encodes_total counter\nscrypt_encodes_total %" PRIu64 "\n", a->encodes)
+    || stats_printf(b, "# TYPE scrypt_encode_failures_total counter\nscrypt_encode_failures_total %" PRIu64 "\n", a->encode_failures)
+    || stats_printf(b, "# TYPE scrypt_parses_total counter\nscrypt_parses_total %" PRIu64 "\n", a->parses)
+    || stats_printf(b, "# TYPE scrypt_parse_failures_total counter\nscrypt_parse_failures_total %" PRIu64 "\n", a->parse_failures)
+    || stats_printf(b, "# TYPE scrypt_duration_seconds histogram\n")) { return(1); }
+  for (index = 0; index < a->histogram_count; index += 1) {
+    const struct scrypt_stats_histogram* c = a->histograms + index;
+    snprintf(labels, sizeof(labels), "log_n=\"%u\",r=\"%u\",p=\"%u\"", c->logN, c->r, c->p);
+    if (stats_text_histogram(b, "scrypt_duration_seconds", labels, c)) { return(1); }
+  }
+  if (stats_printf(b, "# TYPE scrypt_kernel_duration_seconds histogram\n")) { return(1); }
+  for (index = 0; index < scrypt_stats_kernels; index += 1) {
+    if (!a->kernels[index].count) { continue; }
+    snprintf(labels, sizeof(labels), "kernel=\"%s\"", a->kernels[index].kernel);
+    if (stats_text_histogram(b, "scrypt_kernel_duration_seconds", labels, a->kernels + index)) { return(1); }
+  }
+  return(stats_text_perf(a, b) || stats_text_stages(a, b));
+}
+
+/** write a snapshot in the prometheus text exposition format to a new string in text */
+uint32_t scrypt_stats_text (const struct scrypt_stats* a, uint8_t** text, size_t* text_len) {
+  struct stats_text b = {0, 0, 4096};
+  b.data = malloc(b.size); if (!b.data) { return(1); }
+  if (stats_text_write(a, &b)) {
+    free(b.data);
+    return(1);
+  }
+  *text = b.data;
+  *text_len = b.len;
+  return(0);
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <scrypt.h>
 
 // the default key and salt length is hardcoded here
@@ -125,8 +127,671 @@ char test_scrypt_to_string_base91 () {
   return(res_2);
 }
 
+char test_scrypt_init () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87 };
+  struct scrypt_config config = {0};
+  // a pre-faulted V pool must not change results, also when V is reused
+  config.v_pool_count = 1;
+  config.v_pool_flags = scrypt_v_pool_nodump;
+  int status = scrypt_init(&config);
+  if (status) {
+    printf("failure scrypt_init with status %d\n", status);
+    return(0);
+  }
+  uint8_t result = evaluate_result(5,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res))
+    && evaluate_result(6,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  scrypt_deinit();
+  return(result);
+}
+
+char test_scrypt_batch () {
+  uint8_t res[3][64];
+  uint8_t exp[3][64] = {{
+    0x77, 0xd6, 0x57, 0x62, 0x38, 0x65, 0x7b, 0x20, 0x3b, 0x19, 0xca, 0x42, 0xc1, 0x8a, 0x04, 0x97,
+    0xf1, 0x6b, 0x48, 0x44, 0xe3, 0x07, 0x4a, 0xe8, 0xdf, 0xdf, 0xfa, 0x3f, 0xed, 0xe2, 0x14, 0x42,
+    0xfc, 0xd0, 0x06, 0x9d, 0xed, 0x09, 0x48, 0xf8, 0x32, 0x6a, 0x75, 0x3a, 0x0f, 0xc8, 0x1f, 0x17,
+    0xe8, 0xd3, 0xe0, 0xfb, 0x2e, 0x0d, 0x36, 0x28, 0xcf, 0x35, 0xe2, 0x0c, 0x38, 0xd1, 0x89, 0x06 }, {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+    0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+    0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+    0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40 }, {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87 }};
+  struct scrypt_job jobs[3] = {
+    {"", 0, "", 0, 16, 1, 1, res[0], 64},
+    {"password", 8, "NaCl", 4, 1024, 8, 16, res[1], 64},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[2], 64}};
+  struct scrypt_config config = {0};
+  config.workers = 2;
+  config.placement = scrypt_placement_nosmt;
+  scrypt_init(&config);
+  int status = scrypt_batch(jobs, 3);
+  scrypt_deinit();
+  return(evaluate_result(7, status, exp[0], 64, res[0], 64)
+    && evaluate_result(8, status, exp[1], 64, res[1], 64)
+    && evaluate_result(9, status, exp[2], 64, res[2], 64));
+}
+
+char test_scrypt_batch_canceled () {
+  // lanes of large jobs are mixed by several workers, each of which sees the cancellation
+  uint8_t res[2][64];
+  int cancel = 1;
+  struct scrypt_job jobs[2] = {
+    {"password", 8, "NaCl", 4, 1024, 8, 16, res[0], 64, 0, &cancel},
+    {"", 0, "", 0, 16, 1, 1, res[1], 64}};
+  struct scrypt_config config = {0};
+  config.workers = 4;
+  scrypt_init(&config);
+  scrypt_batch(jobs, 2);
+  scrypt_deinit();
+  if ((scrypt_error_canceled != jobs[0].status) || jobs[1].status) {
+    printf("failure test 24: status %u %u\n", jobs[0].status, jobs[1].status);
+    return(0);
+  }
+  return(1);
+}
+
+char test_scrypt_priorities () {
+  uint8_t res[4][64];
+  uint8_t exp[64];
+  uint32_t index;
+  struct scrypt_job jobs[4] = {
+    {"password", 8, "NaCl", 4, 1024, 8, 1, res[0], 64},
+    {"password", 8, "NaCl", 4, 1024, 8, 1, res[1], 64},
+    {"password", 8, "NaCl", 4, 1024, 8, 1, res[2], 64},
+    {"password", 8, "NaCl", 4, 1024, 8, 1, res[3], 64}};
+  struct scrypt_job invalid = {"password", 8, "NaCl", 4, 1024, 8, 1, res[0], 64};
+  struct scrypt_config config = {0};
+  jobs[0].priority = scrypt_priority_bulk;
+  jobs[1].priority = scrypt_priority_bulk;
+  jobs[2].priority = scrypt_priority_interactive;
+  invalid.priority = 3;
+  config.workers = 2;
+  config.bulk_workers = 1;
+  scrypt_init(&config);
+  uint32_t status = scrypt_batch(jobs, 4);
+  if (!scrypt_submit(&invalid)) {
+    printf("failure test 25: invalid priority accepted\n");
+    return(0);
+  }
+  scrypt_deinit();
+  status = status || scrypt("password", 8, "NaCl", 4, 1024, 8, 1, exp, 64);
+  for (index = 0; index < 4; index += 1) {
+    if (!evaluate_result(25, status, exp, 64, res[index], 64)) { return(0); }
+  }
+  return(1);
+}
+
+char test_scrypt_admission () {
+  uint8_t res[2][64];
+  struct scrypt_job jobs[2] = {
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[0], 64},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[1], 64}};
+  struct scrypt_config config = {0};
+  // durations are predicted from the statistics of earlier derivations
+  config.stats = 1;
+  scrypt_init(&config);
+  uint32_t status_0 = scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[0], 64);
+  jobs[0].deadline = scrypt_deadline_after(1000);
+  jobs[1].deadline = scrypt_deadline_after(60000000000);
+  uint32_t status = scrypt_submit(jobs);
+  uint32_t status_2 = scrypt_batch(jobs + 1, 1);
+  if (status_0 || (scrypt_error_unreachable != status) || (scrypt_error_unreachable != scrypt_wait(jobs)) || status_2) {
+    printf("failure test 26: status %u %u %u\n", status, jobs[0].status, status_2);
+    return(0);
+  }
+  scrypt_deinit();
+  return(1);
+}
+
+char test_scrypt_coalescing () {
+  // identical jobs in flight are derived once
+  uint8_t res[3][64];
+  uint8_t exp[64];
+  uint32_t index;
+  uint64_t calls;
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  struct scrypt_job jobs[3] = {
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[0], 64},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[1], 64},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res[2], 64}};
+  struct scrypt_config config = {0};
+  config.workers = 2;
+  scrypt_init(&config);
+  scrypt_stats_snapshot(stats);
+  calls = stats->calls;
+  uint32_t status = scrypt_batch(jobs, 3);
+  scrypt_stats_snapshot(stats);
+  scrypt_deinit();
+  calls = stats->calls - calls;
+  free(stats);
+  if (calls != 1) {
+    printf("failure test 27: %lu derivations\n", calls);
+    return(0);
+  }
+  status = status || scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, exp, 64);
+  for (index = 0; index < 3; index += 1) {
+    if (!evaluate_result(27, status, exp, 64, res[index], 64)) { return(0); }
+  }
+  return(1);
+}
+
+uint32_t test_timing_hook_calls = 0;
+
+void test_timing_hook (const struct scrypt_timing* timing) {
+  test_timing_hook_calls += 1;
+}
+
+char test_scrypt_multi () {
+  // jobs with the same N and r are derived together, and the results equal those of single derivations
+  uint8_t res[6][32];
+  uint8_t exp[32];
+  uint32_t index;
+  struct scrypt_job jobs[6] = {
+    {"password", 8, "salt", 4, 1024, 8, 1, res[0], 32},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 1024, 8, 2, res[1], 32},
+    {"password", 8, "NaCl", 4, 2048, 4, 1, res[2], 32},
+    {"", 0, "", 0, 1024, 8, 1, res[3], 32},
+    {"password", 8, "NaCl", 4, 2048, 4, 3, res[4], 32},
+    {"letmein", 7, "salt", 4, 1024, 8, 1, res[5], 32}};
+  struct scrypt_config config = {0};
+  struct scrypt_tuning tuning = {0};
+  config.workers = 1;
+  config.batch_linger = 100000;
+  // batches are off until a tuning turns them on
+  tuning.interleave = 4;
+  uint32_t status = scrypt_set_tuning(&tuning);
+  scrypt_init(&config);
+  // the hook sees every job, also those derived together or by lanes
+  scrypt_set_timing_hook(test_timing_hook);
+  status = status || scrypt_batch(jobs, 6);
+  scrypt_set_timing_hook(0);
+  scrypt_deinit();
+  tuning.interleave = 1;
+  status = status || scrypt_set_tuning(&tuning);
+  if (6 != test_timing_hook_calls) {
+    printf("failure test 29: hook called %u times\n", test_timing_hook_calls);
+    return(0);
+  }
+  for (index = 0; index < 6; index += 1) {
+    status = status || scrypt(jobs[index].password, jobs[index].password_len, jobs[index].salt, jobs[index].salt_len,
+      jobs[index].N, jobs[index].r, jobs[index].p, exp, 32);
+    if (!evaluate_result(29, status, exp, 32, res[index], 32)) { return(0); }
+  }
+  return(1);
+}
+
+char test_scrypt_stages () {
+  // stage workers run the pbkdf2 steps of queued jobs while the worker mixes
+  uint8_t res[4][32];
+  uint8_t exp[32];
+  uint32_t index;
+  uint64_t prepared;
+  uint64_t finished;
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  struct scrypt_job jobs[4] = {
+    {"password", 8, "salt", 4, 16384, 8, 1, res[0], 32},
+    {"pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 2, res[1], 32},
+    {"password", 8, "NaCl", 4, 8192, 4, 3, res[2], 32},
+    {"letmein", 7, "salt", 4, 16384, 8, 1, res[3], 32}};
+  struct scrypt_config config = {0};
+  config.workers = 1;
+  config.stage_workers = 1;
+  scrypt_init(&config);
+  scrypt_stats_snapshot(stats);
+  prepared = stats->stages[0].jobs;
+  finished = stats->stages[2].jobs;
+  uint32_t status = scrypt_batch(jobs, 4);
+  scrypt_stats_snapshot(stats);
+  scrypt_deinit();
+  prepared = stats->stages[0].jobs - prepared;
+  finished = stats->stages[2].jobs - finished;
+  if ((stats->stages[0].workers != 1) || (stats->stages[1].workers != 1) || !prepared || (prepared != finished)) {
+    printf("failure test 30: %lu prepared, %lu finished\n", prepared, finished);
+    free(stats);
+    return(0);
+  }
+  free(stats);
+  for (index = 0; index < 4; index += 1) {
+    status = status || scrypt(jobs[index].password, jobs[index].password_len, jobs[index].salt, jobs[index].salt_len,
+      jobs[index].N, jobs[index].r, jobs[index].p, exp, 32);
+    if (!evaluate_result(30, status, exp, 32, res[index], 32)) { return(0); }
+  }
+  return(1);
+}
+
+char test_scrypt_adaptive_concurrency () {
+  // the limit stays within the workers and the results are those of single derivations
+  uint8_t res[12][32];
+  uint8_t exp[32];
+  uint8_t salt[12];
+  uint32_t index;
+  struct scrypt_job jobs[12] = {{0}};
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  struct scrypt_config config = {0};
+  config.workers = 2;
+  config.adaptive_concurrency = 1;
+  for (index = 0; index < 12; index += 1) {
+    salt[index] = index;
+    jobs[index].password = "pleaseletmein";
+    jobs[index].password_len = 13;
+    jobs[index].salt = salt + index;
+    jobs[index].salt_len = 1;
+    jobs[index].N = 1024;
+    jobs[index].r = 8;
+    jobs[index].p = 1;
+    jobs[index].res = res[index];
+    jobs[index].res_len = 32;
+  }
+  scrypt_init(&config);
+  uint32_t status = scrypt_batch(jobs, 12);
+  scrypt_stats_snapshot(stats);
+  scrypt_deinit();
+  uint32_t limit = stats->concurrency_limit;
+  free(stats);
+  if ((limit < 1) || (limit > 2)) {
+    printf("failure test 32: concurrency limit %u\n", limit);
+    return(0);
+  }
+  for (index = 0; index < 12; index += 1) {
+    status = status || scrypt("pleaseletmein", 13, salt + index, 1, 1024, 8, 1, exp, 32);
+    if (!evaluate_result(32, status, exp, 32, res[index], 32)) { return(0); }
+  }
+  return(1);
+}
+
+char test_scrypt_pressure () {
+  // where linux has pressure stall information, the workers are watched and the results are unchanged
+  uint8_t res[4][32];
+  uint8_t exp[32];
+  uint8_t salt[4];
+  uint32_t index;
+  struct scrypt_job jobs[4] = {{0}};
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  struct scrypt_config config = {0};
+  uint8_t available = !access("/proc/pressure/memory", R_OK);
+  config.workers = 2;
+  config.pressure_memory = 100;
+  for (index = 0; index < 4; index += 1) {
+    salt[index] = index;
+    jobs[index].password = "pleaseletmein";
+    jobs[index].password_len = 13;
+    jobs[index].salt = salt + index;
+    jobs[index].salt_len = 1;
+    jobs[index].N = 1024;
+    jobs[index].r = 8;
+    jobs[index].p = 1;
+    jobs[index].res = res[index];
+    jobs[index].res_len = 32;
+  }
+  scrypt_init(&config);
+  uint32_t status = scrypt_batch(jobs, 4);
+  scrypt_stats_snapshot(stats);
+  scrypt_deinit();
+  uint32_t limit = stats->pressure_limit;
+  free(stats);
+  if (available ? ((limit < 1) || (limit > 2)) : limit) {
+    printf("failure test 33: pressure limit %u\n", limit);
+    return(0);
+  }
+  for (index = 0; index < 4; index += 1) {
+    status = status || scrypt("pleaseletmein", 13, salt + index, 1, 1024, 8, 1, exp, 32);
+    if (!evaluate_result(33, status, exp, 32, res[index], 32)) { return(0); }
+  }
+  return(1);
+}
+
+char test_scrypt_shm () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87 };
+  char name[64];
+  struct scrypt_config config = {0};
+  // one leased slab, and a budget that only allows V mapped on demand up to 1MiB
+  snprintf(name, sizeof(name), "/scrypt-test-%d", getpid());
+  config.shm_name = name;
+  config.shm_budget = 1048576;
+  config.shm_slab_count = 1;
+  int status = scrypt_init(&config);
+  if (status) {
+    printf("failure scrypt_init shared memory with status %d\n", status);
+    return(0);
+  }
+  uint8_t result = evaluate_result(10,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  // larger than both the slab and the budget
+  if (!scrypt("pleaseletmein", 13, "SodiumChloride", 14, 32768, 8, 1, res, sizeof(res))) {
+    printf("failure test 11: derivation over the memory budget succeeded\n");
+    result = 0;
+  }
+  scrypt_deinit();
+  shm_unlink(name);
+  return(result);
+}
+
+char test_scrypt_tmto () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87 };
+  struct scrypt_config config = {0};
+  // 16MiB V with only every fourth block stored must give the same key
+  config.max_v_size = 4194304;
+  scrypt_init(&config);
+  uint8_t result = evaluate_result(12,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  scrypt_deinit();
+  return(result);
+}
+
+char test_scrypt_v_file () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48, 0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+    0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e, 0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+    0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf, 0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+    0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40, 0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87 };
+  struct scrypt_config config = {0};
+  struct scrypt_v_file_stats stats;
+  // V of any size goes into a file, mapped
+  config.v_file_dir = "temp";
+  scrypt_init(&config);
+  uint8_t result = evaluate_result(13,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  scrypt_deinit();
+  if (!result) { return(result); }
+  // direct i/o with a cache of a quarter of V
+  config.v_file_direct = 1;
+  config.v_file_cache_size = 4194304;
+  scrypt_init(&config);
+  result = evaluate_result(14,
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  scrypt_v_file_stats(&stats);
+  scrypt_deinit();
+  if (result && ((stats.derivations != 2) || !stats.reads || !stats.cache_hits)) {
+    printf("failure test 14: v file stats\n");
+    result = 0;
+  }
+  return(result);
+}
+
+char test_scrypt_stream_b () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+    0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+    0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+    0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40 };
+  struct scrypt_config config = {0};
+  // all 16 lanes one at a time
+  config.max_b_size = 1;
+  scrypt_init(&config);
+  uint8_t result = evaluate_result(15,
+    scrypt("password", 8, "NaCl", 4, 1024, 8, 16, res, sizeof(res)),
+    exp, sizeof(exp), res, sizeof(res));
+  scrypt_deinit();
+  return(result);
+}
+
+char test_scrypt_step () {
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+    0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+    0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+    0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40 };
+  struct scrypt_state* state;
+  uint32_t status = scrypt_state_new("password", 8, "NaCl", 4, 1024, 8, 16, res, sizeof(res), &state);
+  uint32_t steps = 0;
+  // slices that end inside both loops and at lane boundaries
+  while (!status && (scrypt_step(state, 300) == scrypt_step_more)) { steps += 1; }
+  if (!status) { scrypt_state_free(state); }
+  if (!status && (steps != 2 * 1024 * 16 / 300)) {
+    printf("failure test 16: %u slices\n", steps);
+    return(0);
+  }
+  return(evaluate_result(16, status, exp, sizeof(exp), res, sizeof(res)));
+}
+
+char test_scrypt_cancellable () {
+  uint8_t res[64];
+  int cancel = 1;
+  uint32_t status = scrypt_cancellable("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res), &cancel, 0);
+  if (scrypt_error_canceled != status) {
+    printf("failure test 17: status %u\n", status);
+    return(0);
+  }
+  status = scrypt_cancellable("pleaseletmein", 13, "SodiumChloride", 14, 16384, 8, 1, res, sizeof(res), 0, scrypt_deadline_after(0));
+  if (scrypt_error_deadline != status) {
+    printf("failure test 18: status %u\n", status);
+    return(0);
+  }
+  return(1);
+}
+
+char test_scrypt_timed () {
+  uint8_t res[64];
+  uint64_t lanes[2 * 16];
+  struct scrypt_timing timing = {0};
+  timing.lane_ns = lanes;
+  timing.lane_count = 16;
+  uint32_t status = scrypt_timed("password", 8, "NaCl", 4, 1024, 8, 16, res, sizeof(res), &timing);
+  if (status || !timing.kernel || !timing.v_allocation || !timing.loop1_ns || !timing.loop2_ns || !lanes[31]
+    || (timing.total_ns < timing.loop1_ns + timing.loop2_ns)) {
+    printf("failure test 19: status %u\n", status);
+    return(0);
+  }
+  // the generic kernel reports the loops unrolled for r 8 that replace it
+  struct scrypt_tuning tuning = {"generic", 1, 0, 0, 0};
+  status = scrypt_set_tuning(&tuning) || scrypt_timed("password", 8, "NaCl", 4, 1024, 8, 1, res, sizeof(res), &timing);
+  tuning.kernel = 0;
+  status = scrypt_set_tuning(&tuning) || status;
+  if (status || strcmp(timing.kernel, "generic-r8")) {
+    printf("failure test 19: kernel %s\n", timing.kernel);
+    return(0);
+  }
+  uint32_t calls = test_timing_hook_calls;
+  scrypt_set_timing_hook(test_timing_hook);
+  status = scrypt("password", 8, "NaCl", 4, 1024, 8, 16, res, sizeof(res));
+  scrypt_set_timing_hook(0);
+  status = status || scrypt("password", 8, "NaCl", 4, 1024, 8, 16, res, sizeof(res));
+  if (status || (calls + 1 != test_timing_hook_calls)) {
+    printf("failure test 20: hook called %u times\n", test_timing_hook_calls - calls);
+    return(0);
+  }
+  return(1);
+}
+
+char test_scrypt_stats () {
+  uint8_t res[64];
+  uint8_t* text;
+  size_t text_len;
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  if (!stats) { return(0); }
+  scrypt_stats_snapshot(stats);
+  uint64_t calls = stats->calls;
+  uint64_t failures = stats->failures;
+  scrypt("pleaseletmein", 13, "SodiumChloride", 14, 1024, 8, 1, res, sizeof(res));
+  // N not a power of two
+  scrypt("pleaseletmein", 13, "SodiumChloride", 14, 1000, 8, 1, res, sizeof(res));
+  scrypt_stats_snapshot(stats);
+  uint8_t result = (stats->calls == calls + 2) && (stats->failures == failures + 1) && stats->histogram_count
+    && !stats->concurrent && stats->peak_concurrent && !scrypt_stats_text(stats, &text, &text_len);
+  if (result) {
+    result = !!strstr(text, "scrypt_duration_seconds_count{log_n=\"10\",r=\"8\",p=\"1\"}");
+    free(text);
+  }
+  free(stats);
+  if (!result) { printf("failure test 21: stats\n"); }
+  return(result);
+}
+
+char test_scrypt_perf_counters () {
+  uint8_t res[64];
+  uint8_t expected[64];
+  struct scrypt_config config = {0};
+  struct scrypt_timing timing = {0};
+  config.perf_counters = 1;
+  uint32_t status = scrypt("password", 8, "NaCl", 4, 1024, 8, 2, expected, sizeof(expected));
+  status = status || scrypt_init(&config);
+  status = status || scrypt_timed("password", 8, "NaCl", 4, 1024, 8, 2, res, sizeof(res), &timing);
+  scrypt_deinit();
+  // the counters are optional, perf_event_open is often not permitted
+  if (status || memcmp(res, expected, sizeof(res)) || (timing.perf && !timing.loop2_perf.cycles)) {
+    printf("failure test 22: status %u, perf %u\n", status, timing.perf);
+    return(0);
+  }
+  return(1);
+}
+
+char test_scrypt_verify () {
+  uint8_t* hash;
+  size_t hash_len;
+  uint8_t* crypt_hash;
+  size_t crypt_hash_len;
+  uint32_t status = scrypt_to_string_base91("password", 8, "NaCl", 4, 1024, 8, 1, 32, &hash, &hash_len);
+  status = status || scrypt_to_string_crypt("password", 8, 0, 0, 1024, 8, 1, &crypt_hash, &crypt_hash_len);
+  if (status || scrypt_verify("password", 8, hash, hash_len) || scrypt_verify("password", 8, crypt_hash, crypt_hash_len)
+    || (scrypt_error_mismatch != scrypt_verify("passwore", 8, hash, hash_len))
+    || (scrypt_error_mismatch != scrypt_verify("passwore", 8, crypt_hash, crypt_hash_len))
+    || scrypt_verify_pooled("password", 8, hash, hash_len)) {
+    printf("failure test 23: verify\n");
+    return(0);
+  }
+  // malformed hashes match no password: an empty key, a hash cut after its last separator, and garbage
+  size_t truncated_len = (uint8_t*)strrchr((char*)hash, '-') + 1 - hash;
+  if ((scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "-9D_Fb-KA-IA-BA", 15))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, hash, truncated_len))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "abc", 3))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$abc", 6))
+    || (scrypt_error_invalid_hash_format != scrypt_verify_pooled("passwore", 8, "abc", 3))) {
+    printf("failure test 23: malformed hash accepted\n");
+    return(0);
+  }
+  // crypt strings without a key, with a character outside of its alphabet, with logN or r 0 and with N too large
+  size_t crypt_truncated_len = (uint8_t*)strrchr((char*)crypt_hash, '$') + 1 - crypt_hash;
+  if ((scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, crypt_hash, crypt_truncated_len))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$C6..../....salt", 18))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$C6.!../....salt$abc", 22))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$.6..../....salt$abc", 22))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$C...../....salt$abc", 22))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "$7$z6..../....salt$abc", 22))) {
+    printf("failure test 23: malformed crypt hash accepted\n");
+    return(0);
+  }
+  free(hash);
+  free(crypt_hash);
+  return(1);
+}
+
+char test_scrypt_verify_cache () {
+  uint8_t* hash;
+  size_t hash_len;
+  uint64_t calls;
+  struct scrypt_stats* stats = malloc(sizeof(struct scrypt_stats));
+  struct scrypt_config config = {0};
+  config.verify_cache_size = 64;
+  uint32_t status = scrypt_to_string_base91("password", 8, "NaCl", 4, 1024, 8, 1, 32, &hash, &hash_len);
+  status = status || scrypt_init(&config) || scrypt_verify("password", 8, hash, hash_len);
+  scrypt_stats_snapshot(stats);
+  calls = stats->calls;
+  // answered from the cache, failures are not cached
+  status = status || scrypt_verify("password", 8, hash, hash_len) || scrypt_verify_pooled("password", 8, hash, hash_len)
+    || (scrypt_error_mismatch != scrypt_verify("passwore", 8, hash, hash_len))
+    || (scrypt_error_mismatch != scrypt_verify("passwore", 8, hash, hash_len));
+  scrypt_stats_snapshot(stats);
+  // a malformed hash matches no password, also not from the cache when asked again
+  status = status || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "-9D_Fb-KA-IA-BA", 15))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "-9D_Fb-KA-IA-BA", 15))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "abc", 3))
+    || (scrypt_error_invalid_hash_format != scrypt_verify("passwore", 8, "abc", 3));
+  scrypt_deinit();
+  calls = stats->calls - calls;
+  free(stats);
+  free(hash);
+  if (status || (calls != 2)) {
+    printf("failure test 28: status %u, %lu derivations\n", status, calls);
+    return(0);
+  }
+  return(1);
+}
+
+char test_scrypt_autotune () {
+  // a measured tuning is used and remembered, the next call reads it
+  struct scrypt_tuning a;
+  struct scrypt_tuning b;
+  char path[64];
+  uint8_t res[64];
+  uint8_t exp[] = {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+    0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+    0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+    0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40 };
+  snprintf(path, sizeof(path), "/tmp/scrypt-test-autotune-%d", getpid());
+  uint32_t status = scrypt_autotune(1024, 8, path, 0, &a);
+  status = status || scrypt_autotune(1024, 8, path, 0, &b);
+  unlink(path);
+  if (status || !a.kernel || (a.interleave < 1) || (a.interleave > 4) || !(a.rate > 0)
+    || strcmp(a.kernel, b.kernel) || (a.interleave != b.interleave) || (a.prefetch != b.prefetch) || (a.rate != b.rate)) {
+    printf("failure test 31: tuning not measured or not remembered\n");
+    return(0);
+  }
+  status = scrypt("password", 8, "NaCl", 4, 1024, 8, 16, res, 64);
+  return(evaluate_result(31, status, exp, 64, res, 64));
+}
+
+char test_scrypt_generic_smix () {
+  // the smix loops unrolled for r 1, 8 and 16 give the results of the generic ones
+  static const uint32_t rs[3] = {1, 8, 16};
+  struct scrypt_config config = {0};
+  uint8_t res[64];
+  uint8_t exp[64];
+  uint32_t index;
+  uint32_t status = 0;
+  for (index = 0; index < 3; index += 1) {
+    config.generic_smix = 1;
+    status = status || scrypt_init(&config) || scrypt("pleaseletmein", 13, "SodiumChloride", 14, 256, rs[index], 2, exp, 64);
+    scrypt_deinit();
+    config.generic_smix = 0;
+    status = status || scrypt_init(&config) || scrypt("pleaseletmein", 13, "SodiumChloride", 14, 256, rs[index], 2, res, 64);
+    scrypt_deinit();
+    if (!evaluate_result(34, status, exp, 64, res, 64)) { return(0); }
+  }
+  return(1);
+}
+
 void main () {
-  if (test_1() && test_2() && test_3() && test_4() && test_scrypt_to_string_base91()) {
+  if (test_1() && test_2() && test_3() && test_4() && test_scrypt_to_string_base91() && test_scrypt_init()
+    && test_scrypt_batch() && test_scrypt_batch_canceled() && test_scrypt_priorities()
+    && test_scrypt_admission() && test_scrypt_coalescing() && test_scrypt_multi()
+    && test_scrypt_stages() && test_scrypt_adaptive_concurrency()
+    && test_scrypt_pressure()
+    && test_scrypt_shm()
+    && test_scrypt_tmto() && test_scrypt_v_file()
+    && test_scrypt_stream_b() && test_scrypt_step()
+    && test_scrypt_cancellable() && test_scrypt_timed() && test_scrypt_stats() && test_scrypt_perf_counters()
+    && test_scrypt_verify() && test_scrypt_verify_cache()
+    && test_scrypt_autotune() && test_scrypt_generic_smix()) {
     printf("%s\n", "success - all tests passed.");
   }
 }
@@ -0,0 +1,114 @@
+/* round trips through scrypt-kdfd. run from the repository root after exe/compile, like temp/test.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <scrypt_kdfd.h>
+
+#define test_kdfd_daemon "temp/scrypt-kdfd"
+
+pid_t test_kdfd_pid = 0;
+char test_kdfd_socket[64];
+
+/** start the daemon on a socket of its own and connect to it. it calibrates before it listens */
+char test_kdfd_start (int* fd) {
+  uint32_t index;
+  snprintf(test_kdfd_socket, sizeof(test_kdfd_socket), "/tmp/scrypt-kdfd-test-%d.socket", (int)getpid());
+  test_kdfd_pid = fork();
+  if (test_kdfd_pid < 0) { return(0); }
+  if (!test_kdfd_pid) {
+    // the daemon is linked to find libscrypt.so in its working directory
+    setenv("LD_LIBRARY_PATH", "temp", 1);
+    execl(test_kdfd_daemon, test_kdfd_daemon, "-s", test_kdfd_socket, "-w", "2", "-p", "none", "-l", "65536", (char*)0);
+    _exit(1);
+  }
+  for (index = 0; index < 600; index += 1) {
+    if (!scrypt_kdfd_connect(test_kdfd_socket, fd)) { return(1); }
+    if (waitpid(test_kdfd_pid, 0, WNOHANG)) {
+      test_kdfd_pid = 0;
+      return(0);
+    }
+    usleep(100000);
+  }
+  return(0);
+}
+
+void test_kdfd_stop () {
+  if (!test_kdfd_pid) { return; }
+  kill(test_kdfd_pid, SIGTERM);
+  waitpid(test_kdfd_pid, 0, 0);
+}
+
+char test_kdfd_round_trip (int fd, uint8_t format) {
+  uint8_t* hash;
+  size_t hash_len;
+  uint32_t status = scrypt_kdfd_hash(fd, (const uint8_t*)"password", 8, 0, 0, 1024, 8, 1, 32, format, &hash, &hash_len);
+  if (status) {
+    printf("failure test 35: hash status %u\n", status);
+    return(0);
+  }
+  uint32_t right = scrypt_kdfd_verify(fd, (const uint8_t*)"password", 8, hash, hash_len);
+  uint32_t wrong = scrypt_kdfd_verify(fd, (const uint8_t*)"passw0rd", 8, hash, hash_len);
+  free(hash);
+  if (right || (scrypt_error_mismatch != wrong)) {
+    printf("failure test 36: verify status %u and %u\n", right, wrong);
+    return(0);
+  }
+  return(1);
+}
+
+char test_kdfd_invalid_hash (int fd) {
+  uint32_t status = scrypt_kdfd_verify(fd, (const uint8_t*)"password", 8, (const uint8_t*)"abc", 3);
+  if (scrypt_error_invalid_hash_format != status) {
+    printf("failure test 37: verify status %u\n", status);
+    return(0);
+  }
+  return(1);
+}
+
+char test_kdfd_limit (int fd) {
+  // N * r * p 131072 is above the limit of 65536, also in a hash string of N 2^40
+  uint8_t* hash;
+  size_t hash_len;
+  uint32_t status = scrypt_kdfd_hash(fd, (const uint8_t*)"password", 8, 0, 0, 16384, 8, 1, 32, scrypt_kdfd_format_base91,
+    &hash, &hash_len);
+  uint32_t status_2 = scrypt_kdfd_verify(fd, (const uint8_t*)"password", 8, (const uint8_t*)"$7$c6..../....salt$abc", 22);
+  if ((scrypt_error_limit != status) || (scrypt_error_limit != status_2)) {
+    printf("failure test 38: status %u and %u\n", status, status_2);
+    return(0);
+  }
+  return(1);
+}
+
+int main () {
+  int fd;
+  char result = test_kdfd_start(&fd);
+  if (!result) { printf("failure test 35: %s did not start\n", test_kdfd_daemon); }
+  else {
+    result = test_kdfd_round_trip(fd, scrypt_kdfd_format_base91) && test_kdfd_round_trip(fd, scrypt_kdfd_format_crypt)
+      && test_kdfd_invalid_hash(fd) && test_kdfd_limit(fd);
+    scrypt_kdfd_close(fd);
+  }
+  test_kdfd_stop();
+  if (result) { printf("%s\n", "success - all kdfd tests passed."); }
+  return(result ? 0 : 1);
+}
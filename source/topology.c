@@ -0,0 +1,131 @@
+/* cpu topology for worker placement.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <sched.h>
+
+#define topology_max_cpus CPU_SETSIZE
+
+// the usable cpus, sorted and grouped by physical core:
+// cpus of core c are cpus[core_start[c]] to cpus[core_start[c + 1] - 1]
+struct topology {
+  uint32_t cpus[topology_max_cpus];
+  uint32_t cpu_count;
+  uint32_t core_start[topology_max_cpus + 1];
+  uint32_t core_count;
+};
+
+uint32_t topology_read_number (uint32_t cpu, const char* name, uint32_t fallback) {
+  char path[128];
+  unsigned int value;
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+  FILE* file = fopen(path, "r"); if (!file) { return(fallback); }
+  if (fscanf(file, "%u", &value) != 1) { value = fallback; }
+  fclose(file);
+  return(value);
+}
+
+/** parse a cpu list like "0-3,8,10-11" as used by the kernel and taskset */
+uint32_t topology_parse_cpu_list (const char* list, cpu_set_t* set) {
+  unsigned long first;
+  unsigned long last;
+  char* end;
+  CPU_ZERO(set);
+  while (*list) {
+    first = strtoul(list, &end, 10); if (end == list) { return(1); }
+    last = first;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtoul(list, &end, 10); if (end == list) { return(1); }
+    }
+    if ((last < first) || (last >= topology_max_cpus)) { return(1); }
+    while (first <= last) { CPU_SET(first, set); first += 1; }
+    if (*end == ',') { end += 1; }
+    else if (*end && (*end != '\n')) { return(1); }
+    list = end;
+    if (*list == '\n') { break; }
+  }
+  return(0);
+}
+
+/** read the topology of the cpus in cpu_list, or of the cpus in the affinity mask if cpu_list is null */
+uint32_t topology_read (const char* cpu_list, struct topology* t) {
+  cpu_set_t set;
+  uint64_t keys[topology_max_cpus];
+  uint64_t key;
+  uint32_t cpu;
+  uint32_t i;
+  if (cpu_list) {
+    if (topology_parse_cpu_list(cpu_list, &set)) { return(1); }
+  }
+  else if (sched_getaffinity(0, sizeof(set), &set)) { return(1); }
+  // sort by package, core and cpu number so that smt siblings are adjacent
+  t->cpu_count = 0;
+  for (cpu = 0; cpu < topology_max_cpus; cpu += 1) {
+    if (!CPU_ISSET(cpu, &set)) { continue; }
+    key = ((uint64_t)topology_read_number(cpu, "physical_package_id", 0) << 48)
+      | ((uint64_t)topology_read_number(cpu, "core_id", cpu) << 24) | cpu;
+    i = t->cpu_count;
+    while (i && (keys[i - 1] > key)) {
+      keys[i] = keys[i - 1];
+      t->cpus[i] = t->cpus[i - 1];
+      i -= 1;
+    }
+    keys[i] = key;
+    t->cpus[i] = cpu;
+    t->cpu_count += 1;
+  }
+  if (!t->cpu_count) { return(1); }
+  // cpus with equal package and core id are smt siblings of one physical core
+  t->core_count = 0;
+  for (i = 0; i < t->cpu_count; i += 1) {
+    if (!i || ((keys[i] >> 24) != (keys[i - 1] >> 24))) {
+      t->core_start[t->core_count] = i;
+      t->core_count += 1;
+    }
+  }
+  t->core_start[t->core_count] = t->cpu_count;
+  return(0);
+}
+
+/** the cpus that the worker with the given index may run on. returns 0 if the worker should not be pinned */
+uint8_t topology_worker_cpus (struct topology* t, uint32_t placement, uint32_t worker, cpu_set_t* set) {
+  uint32_t core;
+  uint32_t i;
+  CPU_ZERO(set);
+  switch (placement) {
+  case scrypt_placement_cores:
+    // the whole physical core, the scheduler picks a sibling
+    core = worker % t->core_count;
+    for (i = t->core_start[core]; i < t->core_start[core + 1]; i += 1) { CPU_SET(t->cpus[i], set); }
+    return(1);
+  case scrypt_placement_nosmt:
+    // only the first sibling of each physical core, the others stay idle
+    CPU_SET(t->cpus[t->core_start[worker % t->core_count]], set);
+    return(1);
+  case scrypt_placement_pack:
+    // fill all siblings of a core before using the next one
+    CPU_SET(t->cpus[worker % t->cpu_count], set);
+    return(1);
+  }
+  return(0);
+}
+
+uint32_t topology_placement_from_string (const char* a) {
+  return(!strcmp(a, "cores") ? scrypt_placement_cores :
+    !strcmp(a, "nosmt") ? scrypt_placement_nosmt :
+    !strcmp(a, "pack") ? scrypt_placement_pack : scrypt_placement_none);
+}
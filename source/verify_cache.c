@@ -0,0 +1,146 @@
+/* cache of successful verifications, for credentials that are checked again and again.
+
+   copyright 2013-2018 Julian Kalbhenn <jkal@posteo.eu>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+
+// entries are spread over shards with a lock each, and within a shard over sets of a few entries
+#define verify_cache_shards 16
+#define verify_cache_ways 4
+#define default_verify_cache_ttl 5000
+
+// hmac of password and hash string, and when it expires on the monotonic clock in nanoseconds. 0 is unused
+struct verify_cache_entry {
+  uint8_t key[32];
+  uint64_t expires;
+};
+
+struct verify_cache_shard {
+  pthread_mutex_t lock;
+  struct verify_cache_entry* entries;
+  uint32_t sets;
+} __attribute__((aligned(64)));
+
+struct verify_cache {
+  struct verify_cache_shard shards[verify_cache_shards];
+  uint8_t secret[32];
+  uint64_t ttl_ns;
+  uint8_t enabled;
+};
+
+static struct verify_cache verify_cache;
+
+/** enable the cache with room for about size entries, each valid for ttl milliseconds */
+uint32_t verify_cache_init (size_t size, uint32_t ttl) {
+  struct verify_cache_shard* a;
+  uint32_t index;
+  uint32_t sets = (size + verify_cache_shards * verify_cache_ways - 1) / (verify_cache_shards * verify_cache_ways);
+  FILE* file = fopen("/dev/urandom", "r"); if (!file) { return(1); }
+  size_t len = fread(verify_cache.secret, sizeof(verify_cache.secret), 1, file);
+  fclose(file);
+  if (!len) { return(1); }
+  for (index = 0; index < verify_cache_shards; index += 1) {
+    a = verify_cache.shards + index;
+    a->entries = calloc(sets * verify_cache_ways, sizeof(struct verify_cache_entry));
+    if (!a->entries) {
+      while (index) { index -= 1; free(verify_cache.shards[index].entries); }
+      return(1);
+    }
+    a->sets = sets;
+    pthread_mutex_init(&a->lock, 0);
+  }
+  verify_cache.ttl_ns = (uint64_t)(ttl ? ttl : default_verify_cache_ttl) * 1000000;
+  verify_cache.enabled = 1;
+  return(0);
+}
+
+void verify_cache_free () {
+  uint32_t index;
+  if (!verify_cache.enabled) { return; }
+  verify_cache.enabled = 0;
+  for (index = 0; index < verify_cache_shards; index += 1) {
+    pthread_mutex_destroy(&verify_cache.shards[index].lock);
+    free(verify_cache.shards[index].entries);
+  }
+  insecure_memzero(&verify_cache, sizeof(verify_cache));
+}
+
+/** the key of a verification. password and hash cannot be recovered from it without the secret of the process */
+void verify_cache_key (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len, uint8_t* key) {
+  HMAC_SHA256_CTX ctx;
+  uint64_t len = password_len;
+  HMAC_SHA256_Init(&ctx, verify_cache.secret, sizeof(verify_cache.secret));
+  HMAC_SHA256_Update(&ctx, &len, sizeof(len));
+  HMAC_SHA256_Update(&ctx, password, password_len);
+  HMAC_SHA256_Update(&ctx, hash, hash_len);
+  HMAC_SHA256_Final(key, &ctx);
+  insecure_memzero(&ctx, sizeof(ctx));
+}
+
+/** the shard and the first entry of the set of key */
+struct verify_cache_entry* verify_cache_set (const uint8_t* key, struct verify_cache_shard** shard) {
+  uint32_t set;
+  *shard = verify_cache.shards + key[0] % verify_cache_shards;
+  memcpy(&set, key + 1, sizeof(set));
+  return((*shard)->entries + (set % (*shard)->sets) * verify_cache_ways);
+}
+
+/** true if password was verified against hash less than the ttl ago */
+uint8_t verify_cache_lookup (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len) {
+  struct verify_cache_shard* shard;
+  struct verify_cache_entry* a;
+  uint8_t key[32];
+  uint32_t index;
+  uint8_t found = 0;
+  if (!verify_cache.enabled) { return(0); }
+  verify_cache_key(password, password_len, hash, hash_len, key);
+  a = verify_cache_set(key, &shard);
+  uint64_t now = timing_now();
+  pthread_mutex_lock(&shard->lock);
+  for (index = 0; index < verify_cache_ways; index += 1) {
+    if ((a[index].expires > now) && !memcmp(a[index].key, key, sizeof(key))) {
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return(found);
+}
+
+/** remember a successful verification. replaces an entry of the same key, an expired one or the one expiring first */
+void verify_cache_insert (const uint8_t* password, size_t password_len, const uint8_t* hash, size_t hash_len) {
+  struct verify_cache_shard* shard;
+  struct verify_cache_entry* a;
+  struct verify_cache_entry* b;
+  uint8_t key[32];
+  uint32_t index;
+  if (!verify_cache.enabled) { return; }
+  verify_cache_key(password, password_len, hash, hash_len, key);
+  a = verify_cache_set(key, &shard);
+  uint64_t now = timing_now();
+  pthread_mutex_lock(&shard->lock);
+  b = a;
+  for (index = 0; index < verify_cache_ways; index += 1) {
+    if (!memcmp(a[index].key, key, sizeof(key)) || (a[index].expires <= now)) {
+      b = a + index;
+      break;
+    }
+    if (a[index].expires < b->expires) { b = a + index; }
+  }
+  memcpy(b->key, key, sizeof(key));
+  b->expires = now + verify_cache.ttl_ns;
+  pthread_mutex_unlock(&shard->lock);
+}